@@ -0,0 +1,245 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "attack_detector.h"
+#include "ip_port_connection.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+using namespace filter;
+
+// Independent hash functions for the rows of the sketches
+static const u_int32_t ROW_SEEDS[] = { 0x2545F491, 0x9E3779B9, 0x85EBCA6B, 0xC2B2AE35 };
+
+static inline u_int32_t rowHash(u_int32_t key, unsigned int row) {
+	return hashMix32(key ^ ROW_SEEDS[row]);
+}
+
+static inline u_int32_t serviceKey(in_addr_t addr, u_int16_t port) {
+	return hashEndpoint(addr, port);
+}
+
+AttackDetector::AttackDetector(unsigned int syns, unsigned int scans, unsigned int window,
+		unsigned int w, unsigned int holdoff)
+		: syn_threshold(syns), scan_threshold(scans), window_ms(window < SUB_WINDOWS ? SUB_WINDOWS : window),
+		holdoff_ms(holdoff), current(0), alert_count(0) {
+	width = 64;
+	while (width < w && width < 0x1000000u) width <<= 1;
+
+	size_t counters = (size_t)SKETCH_ROWS * width * sizeof(u_int32_t);
+	size_t ports = (size_t)HLL_ROWS * width * HLL_REGISTERS;
+	size_t counter_stamps = (size_t)SKETCH_ROWS * width / COUNTER_BLOCK * sizeof(u_int32_t);
+	size_t port_stamps = (size_t)HLL_ROWS * width * sizeof(u_int32_t);
+	size_t window_size = SKETCHES * (counters + counter_stamps) + ports + port_stamps;
+	block = (unsigned char *)calloc(SUB_WINDOWS, window_size);
+	if (!block) abort();
+	memory_size = SUB_WINDOWS * window_size;
+	for (unsigned int i = 0; i < SUB_WINDOWS; i++) {
+		unsigned char * p = block + i * window_size;
+		for (unsigned int s = 0; s < SKETCHES; s++) {
+			windows[i].counters[s] = (u_int32_t *)p;
+			p += counters;
+			windows[i].counter_stamps[s] = (u_int32_t *)p;
+			p += counter_stamps;
+		}
+		windows[i].port_stamps = (u_int32_t *)p;
+		p += port_stamps;
+		windows[i].ports = p;
+	}
+	memset(held, 0, sizeof(held));
+}
+
+AttackDetector::~AttackDetector() {
+	free(block);
+}
+
+// Sliding Window
+
+// Nothing is cleared here, the blocks left by the sub windows that expired
+// are told apart by their stamps
+void AttackDetector::rotate(u_int64_t now_ms) {
+	u_int64_t number = now_ms / (window_ms / SUB_WINDOWS);
+	if (number > current) current = number; // Else same sub window, or time going back
+}
+
+// Count-Min
+
+void AttackDetector::count(unsigned int sketch, u_int32_t key) {
+	SubWindow & window = windows[current % SUB_WINDOWS];
+	u_int32_t * counters = window.counters[sketch];
+	for (unsigned int row = 0; row < SKETCH_ROWS; row++) {
+		u_int32_t column = row * width + (rowHash(key, row) & (width - 1));
+		u_int32_t & stamp = window.counter_stamps[sketch][column / COUNTER_BLOCK];
+		if (stamp != (u_int32_t)current) {
+			memset(counters + (column & ~(COUNTER_BLOCK - 1)), 0, COUNTER_BLOCK * sizeof(u_int32_t));
+			stamp = current;
+		}
+		counters[column]++;
+	}
+}
+
+// The rows are added up over the whole window first, then the smallest is taken
+u_int32_t AttackDetector::estimate(unsigned int sketch, u_int32_t key) const {
+	u_int32_t result = 0xFFFFFFFF;
+	for (unsigned int row = 0; row < SKETCH_ROWS; row++) {
+		u_int32_t column = row * width + (rowHash(key, row) & (width - 1));
+		u_int32_t sum = 0;
+		for (unsigned int age = 0; age < SUB_WINDOWS; age++) {
+			const SubWindow * sub = window(age);
+			if (sub && sub->counter_stamps[sketch][column / COUNTER_BLOCK] == (u_int32_t)(current - age))
+				sum += sub->counters[sketch][column];
+		}
+		if (sum < result) result = sum;
+	}
+	return result;
+}
+
+// HyperLogLog
+
+// Returns true if a register changed
+bool AttackDetector::addPort(in_addr_t source, u_int16_t port) {
+	u_int32_t h = hashMix32(port * 0x9E3779B1 + 0x7F4A7C15);
+	unsigned int index = h & (HLL_REGISTERS - 1);
+	u_int32_t rest = h >> 6;
+	u_int8_t rank = rest ? __builtin_clz(rest) - 6 + 1 : 27;
+
+	bool changed = false;
+	SubWindow & window = windows[current % SUB_WINDOWS];
+	for (unsigned int row = 0; row < HLL_ROWS; row++) {
+		size_t cell = (size_t)row * width + (rowHash(source, row) & (width - 1));
+		u_int8_t * registers = window.ports + cell * HLL_REGISTERS;
+		if (window.port_stamps[cell] != (u_int32_t)current) {
+			memset(registers, 0, HLL_REGISTERS);
+			window.port_stamps[cell] = current;
+		}
+		u_int8_t & reg = registers[index];
+		if (rank > reg) {
+			reg = rank;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// The sketches of the sub windows are merged (maximum of the registers), and
+// the smallest estimate of the rows is taken
+u_int32_t AttackDetector::estimatePorts(in_addr_t source) const {
+	double result = 1e30;
+	for (unsigned int row = 0; row < HLL_ROWS; row++) {
+		size_t cell = (size_t)row * width + (rowHash(source, row) & (width - 1));
+		const u_int8_t * registers[SUB_WINDOWS];
+		unsigned int valid = 0;
+		for (unsigned int age = 0; age < SUB_WINDOWS; age++) {
+			const SubWindow * sub = window(age);
+			if (sub && sub->port_stamps[cell] == (u_int32_t)(current - age))
+				registers[valid++] = sub->ports + cell * HLL_REGISTERS;
+		}
+		double sum = 0;
+		unsigned int zeros = 0;
+		for (unsigned int r = 0; r < HLL_REGISTERS; r++) {
+			u_int8_t reg = 0;
+			for (unsigned int i = 0; i < valid; i++) {
+				u_int8_t value = registers[i][r];
+				if (value > reg) reg = value;
+			}
+			sum += 1.0 / (1u << reg);
+			if (!reg) zeros++;
+		}
+		double m = HLL_REGISTERS;
+		double estimate = 0.709 * m * m / sum;
+		if (estimate <= 2.5 * m && zeros) // Small range correction (linear counting)
+			estimate = m * log(m / zeros);
+		if (estimate < result) result = estimate;
+	}
+	return (u_int32_t)(result + 0.5);
+}
+
+// Alerts
+
+bool AttackDetector::holdOff(unsigned int type, u_int32_t key, u_int64_t now_ms) {
+	u_int64_t id = ((u_int64_t)type << 32) | key;
+	Held & slot = held[hashMix32(key + type) % HOLDOFF_SLOTS];
+	if (slot.key == id && now_ms - slot.time_ms < holdoff_ms) return true;
+	slot.key = id;
+	slot.time_ms = now_ms;
+	return false;
+}
+
+unsigned int AttackDetector::update(const PacketSummary & summary, u_int64_t now_ms, AttackAlert * alerts) {
+	if (!(summary.flags & SUMMARY_PORTS)) return 0;
+	rotate(now_ms);
+
+	unsigned int raised = 0;
+	bool syn = summary.protocol == IPPROTO_TCP && (summary.tcp_flags & (TH_SYN | TH_ACK)) == TH_SYN;
+	if (syn) {
+		u_int32_t key = serviceKey(summary.daddr, summary.dport);
+		count(SKETCH_SYN, key);
+		u_int32_t syns = estimate(SKETCH_SYN, key);
+		if (syns >= syn_threshold) {
+			u_int32_t synacks = estimate(SKETCH_SYNACK, key);
+			u_int32_t unanswered = syns > synacks ? syns - synacks : 0;
+			if (unanswered >= syn_threshold && !holdOff(ALERT_SYN_FLOOD, key, now_ms)) {
+				AttackAlert & alert = alerts[raised++];
+				alert.type = ALERT_SYN_FLOOD;
+				alert.addr = summary.daddr;
+				alert.port = summary.dport;
+				alert.count = unanswered;
+				alert.window_ms = window_ms;
+				alert.time_ms = now_ms;
+			}
+		}
+	} else if (summary.protocol == IPPROTO_TCP && (summary.tcp_flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
+		count(SKETCH_SYNACK, serviceKey(summary.saddr, summary.sport));
+	}
+
+	if ((syn || summary.protocol == IPPROTO_UDP) && addPort(summary.saddr, summary.dport)) {
+		u_int32_t ports = estimatePorts(summary.saddr);
+		if (ports >= scan_threshold && !holdOff(ALERT_PORT_SCAN, summary.saddr, now_ms)) {
+			AttackAlert & alert = alerts[raised++];
+			alert.type = ALERT_PORT_SCAN;
+			alert.addr = summary.saddr;
+			alert.port = 0;
+			alert.count = ports;
+			alert.window_ms = window_ms;
+			alert.time_ms = now_ms;
+		}
+	}
+
+	alert_count += raised;
+	return raised;
+}
+
+void AttackDetector::print(const AttackAlert & alert, std::ostream& out) {
+	struct in_addr addr;
+	addr.s_addr = alert.addr;
+	out << "ALERT ";
+	if (alert.type == ALERT_SYN_FLOOD)
+		out << "SYN flood to " << inet_ntoa(addr) << ":" << alert.port << " : " << alert.count << " SYNs unanswered";
+	else
+		out << "Port scan from " << inet_ntoa(addr) << " : about " << alert.count << " ports";
+	out << " in " << alert.window_ms << " ms" << std::endl;
+}
@@ -0,0 +1,145 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef ATTACK_DETECTOR_H_D6A52D10_CBDC_11F1_9420_02FC00000001_
+#define ATTACK_DETECTOR_H_D6A52D10_CBDC_11F1_9420_02FC00000001_
+
+#include "packet_summary.h"
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <iostream>
+
+namespace filter {
+
+// Detection of SYN floods and port scans, updated with every packet from its
+// summary alone, without looking at the connection table. The counts are
+// kept in sketches over a sliding window, made of SUB_WINDOWS parts reused
+// in turn. Every block of a part (a cache line of counters, the registers of
+// a cell) is stamped with the number of the sub window that wrote it; blocks
+// of an older one are ignored when read and cleared when first written. So
+// the memory is fixed and the cost of a packet doesn't depend on the traffic,
+// with no part to clear at once when the window moves, even after a gap:
+//
+// - SYN flood: a Count-Min sketch of the SYNs sent to every service
+//   (address and port) and another one of the SYN-ACKs it answered with.
+//   Services with too many SYNs left unanswered raise an alert.
+//
+// - Port scan: a Count-Min like grid of small HyperLogLog sketches (64
+//   registers each) of the destination ports of the SYNs and UDP packets
+//   of every source. Sources that reach too many distinct ports raise an
+//   alert. The estimate is only computed when a register changes, that is,
+//   when the port is likely new for the source.
+//
+// Repeated alerts for the same target are held back for holdoff_ms.
+
+enum {
+	ALERT_SYN_FLOOD = 1,
+	ALERT_PORT_SCAN = 2,
+};
+
+struct AttackAlert {
+	unsigned int type;        // ALERT_*
+	in_addr_t addr;           // Target of a flood, source of a scan (network byte order)
+	u_int16_t port;           // Target port of a flood
+	u_int32_t count;          // SYNs left unanswered, or distinct ports (estimated)
+	u_int32_t window_ms;
+	u_int64_t time_ms;        // Capture time of the packet that raised it
+};
+
+class AttackDetector {
+public:
+	enum {
+		SUB_WINDOWS = 4,
+		SKETCH_ROWS = 4,
+		HLL_ROWS = 2,
+		HLL_REGISTERS = 64,
+	};
+
+	// Alert when syn_threshold SYNs to a service, or scan_threshold distinct
+	// ports from a source, are seen within window_ms. width is the number of
+	// counters in each row of the sketches (rounded up to a power of two).
+	AttackDetector(unsigned int syn_threshold = 1000, unsigned int scan_threshold = 100,
+		unsigned int window_ms = 1000, unsigned int width = 4096, unsigned int holdoff_ms = 10000);
+	~AttackDetector();
+
+	// Returns the number of alerts raised by this packet (up to 2) in alerts
+	unsigned int update(const PacketSummary & summary, u_int64_t now_ms, AttackAlert * alerts);
+
+	inline size_t getMemorySize() const { return memory_size; }
+	inline u_int64_t getAlerts() const { return alert_count; }
+
+	static void print(const AttackAlert & alert, std::ostream& out);
+
+private:
+	enum {
+		SKETCH_SYN,
+		SKETCH_SYNACK,
+		SKETCHES
+	};
+	enum { COUNTER_BLOCK = 16 };         // Counters in a cache line
+	struct SubWindow {
+		u_int32_t * counters[SKETCHES];  // SKETCH_ROWS x width each
+		u_int8_t * ports;                // HLL_ROWS x width x HLL_REGISTERS
+		u_int32_t * counter_stamps[SKETCHES]; // Sub window number of each block of counters
+		u_int32_t * port_stamps;              // And of each cell of registers
+	};
+
+	void rotate(u_int64_t now_ms);
+	void count(unsigned int sketch, u_int32_t key);
+	u_int32_t estimate(unsigned int sketch, u_int32_t key) const;
+	bool addPort(in_addr_t source, u_int16_t port);
+	u_int32_t estimatePorts(in_addr_t source) const;
+	bool holdOff(unsigned int type, u_int32_t key, u_int64_t now_ms);
+
+	unsigned int syn_threshold;
+	unsigned int scan_threshold;
+	unsigned int window_ms;
+	unsigned int width;
+	unsigned int holdoff_ms;
+
+	SubWindow windows[SUB_WINDOWS];
+	u_int64_t current;            // Number of the current sub window since the epoch
+	// Sub window of a given age, NULL if it is older than the epoch
+	inline const SubWindow * window(unsigned int age) const {
+		return age <= current ? &windows[(current - age) % SUB_WINDOWS] : NULL;
+	}
+	unsigned char * block;
+	size_t memory_size;
+
+	enum { HOLDOFF_SLOTS = 256 };
+	struct Held {
+		u_int64_t key;            // type << 32 | key, 0 if free
+		u_int64_t time_ms;
+	};
+	Held held[HOLDOFF_SLOTS];
+	u_int64_t alert_count;
+
+	// Can't be copied
+	AttackDetector(const AttackDetector &other);
+	AttackDetector &operator=(const AttackDetector &other);
+};
+
+} // namespace filter
+
+#endif // ATTACK_DETECTOR_H_D6A52D10_CBDC_11F1_9420_02FC00000001_
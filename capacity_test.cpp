@@ -0,0 +1,257 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Measures how many packets per second the whole pipeline sustains, with
+// synthetic traffic (traffic_generator.h) and no network device:
+//
+//   capacity_test [-r RATE] [-d SECONDS] [-f FLOWS] [-z EXPONENT]
+//                 [-s imix|SIZE|MIN-MAX] [-m TCP,UDP] [-b BATCH] [-q QUEUE]
+//                 [-p POOL] [-e FEATURE,...]
+//
+// Packets are due at RATE per second, whether the sniffer keeps up or not
+// (open loop), and wait in a queue of QUEUE packets like the ring of a
+// network card: when it's full, they are dropped. The latency of a packet
+// goes from the time it was due to the end of its decoding, so the time
+// spent waiting in the queue is included. RATE 0 sends packets as fast as
+// they are decoded, to find the peak. BATCH 1 uses newPacket(), larger
+// batches newPackets(). FEATURE is checksums, counters, dns, tls, attacks or
+// duplicates.
+
+#include "sniffer.h"
+#include "traffic_generator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+using namespace filter;
+
+static inline u_int64_t nowNanoseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Log-linear histogram of latencies in nanoseconds: 32 buckets for each power
+// of two, so percentiles are within 3%
+class LatencyHistogram {
+public:
+	enum { SUB_BUCKETS = 32, POWERS = 40 };
+
+	LatencyHistogram() : count(0), max(0) {
+		memset(buckets, 0, sizeof(buckets));
+	}
+
+	inline void add(u_int64_t ns, u_int64_t times = 1) {
+		unsigned int power = 0;
+		while ((ns >> power) >= 2 * SUB_BUCKETS && power < POWERS - 1) power++;
+		unsigned int sub = (ns >> power) - (power ? SUB_BUCKETS : 0);
+		if (sub >= 2 * SUB_BUCKETS) sub = 2 * SUB_BUCKETS - 1;
+		buckets[power][sub] += times;
+		count += times;
+		if (ns > max) max = ns;
+	}
+
+	u_int64_t percentile(double p) const {
+		u_int64_t rank = (u_int64_t)(p / 100.0 * count);
+		u_int64_t seen = 0;
+		for (unsigned int power = 0; power < POWERS; power++) {
+			for (unsigned int sub = 0; sub < 2 * SUB_BUCKETS; sub++) {
+				seen += buckets[power][sub];
+				if (seen > rank) return (u_int64_t)(sub + (power ? SUB_BUCKETS : 0) + 1) << power;
+			}
+		}
+		return max;
+	}
+
+	inline u_int64_t getCount() const { return count; }
+	inline u_int64_t getMax() const { return max; }
+
+private:
+	u_int64_t buckets[POWERS][2 * SUB_BUCKETS];
+	u_int64_t count;
+	u_int64_t max;
+};
+
+class CapacitySniffer : public Sniffer {
+public:
+	inline void feed(const PacketRecord & packet) {
+		current_time = packet.ts;
+		newPacket(packet.data, packet.caplen);
+	}
+};
+
+static bool parseSizes(const char * text, TrafficProfile & profile) {
+	char * end;
+	if (!strcmp(text, "imix")) {
+		profile.sizes = SIZES_IMIX;
+		return true;
+	}
+	profile.min_size = profile.max_size = strtoul(text, &end, 10);
+	profile.sizes = SIZES_FIXED;
+	if (*end == '-') {
+		profile.max_size = strtoul(end + 1, &end, 10);
+		profile.sizes = SIZES_UNIFORM;
+	}
+	return *end == '\0' && profile.min_size <= profile.max_size && profile.max_size <= 1514;
+}
+
+static bool parseMix(const char * text, TrafficProfile & profile) {
+	char * end;
+	profile.tcp_percent = strtoul(text, &end, 10);
+	if (*end != ',') return false;
+	profile.udp_percent = strtoul(end + 1, &end, 10);
+	return *end == '\0' && profile.tcp_percent + profile.udp_percent <= 100;
+}
+
+static bool enableFeatures(char * list, Sniffer & sniffer) {
+	for (char * feature = strtok(list, ","); feature; feature = strtok(NULL, ",")) {
+		if (!strcmp(feature, "checksums")) sniffer.enableChecksumValidation();
+		else if (!strcmp(feature, "counters")) sniffer.enableTrafficCounters();
+		else if (!strcmp(feature, "dns")) sniffer.enableDnsStatistics();
+		else if (!strcmp(feature, "tls")) sniffer.enableTlsInspection();
+		else if (!strcmp(feature, "attacks")) sniffer.enableAttackDetection();
+		else if (!strcmp(feature, "duplicates")) sniffer.enableDuplicateFilter();
+		else return false;
+	}
+	return true;
+}
+
+static void usage(const char * program) {
+	fprintf(stderr, "Usage: %s [-r RATE] [-d SECONDS] [-f FLOWS] [-z EXPONENT] [-s imix|SIZE|MIN-MAX]\n"
+		"       [-m TCP,UDP] [-b BATCH] [-q QUEUE] [-p POOL] [-e FEATURE,...]\n", program);
+}
+
+int main(int argc, char * argv[])
+{
+	TrafficProfile profile;
+	double rate = 1000000;
+	double seconds = 10;
+	unsigned int batch_size = PacketBatch::DEFAULT_CAPACITY;
+	unsigned int queue = 4096;
+	unsigned int pool = 1 << 18;
+	CapacitySniffer sniffer;
+	sniffer.setPrintPackets(false);
+
+	int option;
+	while ((option = getopt(argc, argv, "r:d:f:z:s:m:b:q:p:e:")) != -1) {
+		bool ok = true;
+		switch (option) {
+			case 'r': rate = atof(optarg); ok = rate >= 0; break;
+			case 'd': seconds = atof(optarg); ok = seconds > 0; break;
+			case 'f': profile.flows = strtoul(optarg, NULL, 10); ok = profile.flows > 0; break;
+			case 'z': profile.zipf_exponent = atof(optarg); ok = profile.zipf_exponent >= 0; break;
+			case 's': ok = parseSizes(optarg, profile); break;
+			case 'm': ok = parseMix(optarg, profile); break;
+			case 'b': batch_size = strtoul(optarg, NULL, 10); ok = batch_size > 0; break;
+			case 'q': queue = strtoul(optarg, NULL, 10); ok = queue > 0; break;
+			case 'p': pool = strtoul(optarg, NULL, 10); ok = pool > 0; break;
+			case 'e': ok = enableFeatures(optarg, sniffer); break;
+			default: ok = false;
+		}
+		if (!ok) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fprintf(stderr, "Generating %u packets of %u connections...\n", pool, profile.flows);
+	TrafficGenerator generator(profile, pool);
+	PacketBatch batch(batch_size);
+	LatencyHistogram latency;
+
+	// Capture times start now, and follow the schedule
+	struct timeval base;
+	gettimeofday(&base, NULL);
+	u_int64_t total = rate > 0 ? (u_int64_t)(rate * seconds) : 0;
+	double interval_ns = rate > 0 ? 1e9 / rate : 0;
+	u_int64_t next = 0;       // Packet due next
+	u_int64_t processed = 0;
+	u_int64_t dropped = 0;
+	u_int64_t start = nowNanoseconds();
+	u_int64_t now = start;
+
+	while (rate > 0 ? next < total : now - start < seconds * 1e9) {
+		now = nowNanoseconds();
+		u_int64_t due = next;     // Packets due by now
+		if (rate > 0) {
+			due = (u_int64_t)((now - start) / interval_ns) + 1;
+			if (due > total) due = total;
+			if (due <= next) continue;
+			if (due - next > queue) { // Queue overflow
+				dropped += due - next - queue;
+				next = due - queue;
+			}
+		} else {
+			due = next + batch_size;
+		}
+
+		unsigned int count = due - next < batch_size ? due - next : batch_size;
+		u_int64_t first_due_ns = rate > 0 ? (u_int64_t)(next * interval_ns) : now - start;
+		for (unsigned int i = 0; i < count; i++) {
+			u_int64_t offset_us = (rate > 0 ? (u_int64_t)((next + i) * interval_ns) : now - start) / 1000;
+			struct timeval ts;
+			ts.tv_sec = base.tv_sec + (base.tv_usec + offset_us) / 1000000;
+			ts.tv_usec = (base.tv_usec + offset_us) % 1000000;
+			PacketRecord record;
+			generator.next(record, ts);
+			if (batch_size == 1) sniffer.feed(record);
+			else batch.addRef(record.ts, record.data, record.caplen, record.len);
+		}
+		if (batch_size > 1) {
+			sniffer.newPackets(batch);
+			batch.clear();
+		}
+
+		u_int64_t done = nowNanoseconds() - start;
+		for (unsigned int i = 0; i < count; i++) {
+			u_int64_t due_ns = rate > 0 ? (u_int64_t)((next + i) * interval_ns) : first_due_ns;
+			latency.add(done > due_ns ? done - due_ns : 0);
+		}
+		next += count;
+		processed += count;
+		now = start + done;
+	}
+	double elapsed = (nowNanoseconds() - start) / 1e9;
+
+	printf("Capacity Test\n");
+	printf("   |-Offered     : %llu packets", (unsigned long long)(processed + dropped));
+	if (rate > 0) printf(" at %.0f/s", rate);
+	printf("\n");
+	printf("   |-Decoded     : %llu packets, %.0f/s\n", (unsigned long long)processed, processed / elapsed);
+	printf("   |-Dropped     : %llu packets (%.3f%%)\n", (unsigned long long)dropped,
+		processed + dropped ? 100.0 * dropped / (processed + dropped) : 0.0);
+	printf("   |-Latency     : p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+		latency.percentile(50) / 1e3, latency.percentile(90) / 1e3, latency.percentile(99) / 1e3,
+		latency.percentile(99.9) / 1e3, latency.getMax() / 1e3);
+	printf("   |-Connections : %u, table of %.1f MB\n", sniffer.getConnectionCount(),
+		sniffer.getConnectionMemory() / 1048576.0);
+	printf("   |-Pool        : %u packets, %.1f MB\n", generator.getPoolSize(), generator.getPoolBytes() / 1048576.0);
+	return dropped ? 2 : 0;
+}
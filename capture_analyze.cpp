@@ -0,0 +1,103 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Analyses a pcap file on several threads (capture_analyzer.h) and prints
+// its flows, in the order of their first packet, then the traffic counters:
+//
+//   capture_analyze [-j THREADS] [-i IDLE] [-c CHUNK_MB] [-q] FILE
+//
+// THREADS defaults to one per CPU, IDLE to 15 seconds and CHUNK_MB to 64.
+// -q only prints the counters. The output is the same whatever THREADS is;
+// the time taken and the throughput go to stderr.
+
+#include "capture_analyzer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+using namespace filter;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void usage(const char * program) {
+	fprintf(stderr, "Usage: %s [-j THREADS] [-i IDLE] [-c CHUNK_MB] [-q] FILE\n", program);
+}
+
+int main(int argc, char * argv[])
+{
+	unsigned int threads = 0;
+	unsigned int idle_timeout = 15;
+	unsigned int chunk_mb = CaptureAnalyzer::DEFAULT_CHUNK_SIZE >> 20;
+	bool quiet = false;
+
+	int option;
+	while ((option = getopt(argc, argv, "j:i:c:q")) != -1) {
+		bool ok = true;
+		switch (option) {
+			case 'j': threads = strtoul(optarg, NULL, 10); ok = threads > 0; break;
+			case 'i': idle_timeout = strtoul(optarg, NULL, 10); break;
+			case 'c': chunk_mb = strtoul(optarg, NULL, 10); ok = chunk_mb > 0; break;
+			case 'q': quiet = true; break;
+			default: ok = false;
+		}
+		if (!ok) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	CaptureAnalyzer analyzer(threads, idle_timeout, (size_t)chunk_mb << 20);
+	std::string error;
+	double start = now();
+	if (!analyzer.analyze(argv[optind], error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	double seconds = now() - start;
+
+	if (!quiet) {
+		const std::vector<FlowRecord> & flows = analyzer.getFlows();
+		char line[256];
+		for (unsigned int i = 0; i < flows.size(); i++) {
+			formatFlowRecord(flows[i], line, sizeof(line));
+			fputs(line, stdout);
+		}
+		fflush(stdout);
+	}
+	analyzer.print(std::cout);
+
+	fprintf(stderr, "%.2f seconds, %.0f MB/s, %.0f packets/s\n", seconds,
+		seconds > 0 ? analyzer.getBytes() / seconds / 1e6 : 0,
+		seconds > 0 ? analyzer.getPackets() / seconds : 0);
+	return 0;
+}
@@ -0,0 +1,353 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "capture_analyzer.h"
+#include "packet_summary.h"
+#include "packet_store.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+using namespace filter;
+
+enum {
+	PCAP_MAGIC_NSEC = 0xA1B23C4D,  // Nanosecond timestamps, PCAP_MAGIC for microseconds
+	PCAP_HEADER_SIZE = 24,
+	PCAP_RECORD_SIZE = 16,
+	MAX_PACKET_SIZE = 262144,  // Largest snaplen of libpcap
+	RECORD_CHAIN = 8,          // Valid record headers in a row to find a cut
+};
+
+struct CaptureAnalyzer::FileFormat {
+	bool swapped;
+	bool nanoseconds;
+	u_int32_t max_caplen;
+
+	inline u_int32_t get(const unsigned char * p) const {
+		u_int32_t v;
+		memcpy(&v, p, sizeof(v));
+		return swapped ? __builtin_bswap32(v) : v;
+	}
+};
+
+struct CaptureAnalyzer::ChunkFlow {
+	Connection key;
+	u_int32_t hash;
+	FlowRecord record;        // Without the times
+	u_int64_t first_us;
+	u_int64_t last_us;        // Of the last packet in the file, not the latest one
+};
+
+struct CaptureAnalyzer::Chunk {
+	Chunk() : begin(0), end(0), stop(0), packets(0), bytes(0) { }
+	size_t begin;             // Records starting in [begin, end)
+	size_t end;
+	size_t stop;              // End of the last record read
+	std::vector<ChunkFlow> flows;  // In the order of their first packet
+	TrafficCounters counters;
+	u_int64_t packets;
+	u_int64_t bytes;
+};
+
+struct CaptureAnalyzer::Worker {
+	const CaptureAnalyzer * analyzer;
+	const FileFormat * format;
+	std::vector<Chunk> * chunks;
+	unsigned int * next_chunk;
+	FlowTable<Connection, FlowIndex> open;   // Latest flow of each connection in the chunk
+	pthread_t thread;
+};
+
+CaptureAnalyzer::CaptureAnalyzer(unsigned int threads, unsigned int idle_timeout, size_t chunk_size) :
+		threads(threads), idle_timeout(idle_timeout), chunk_size(chunk_size ? chunk_size : DEFAULT_CHUNK_SIZE),
+		data(NULL), size(0), packets(0), bytes(0), ignored(0), chunk_count(0) {
+	if (!this->threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		this->threads = cpus > 0 ? (unsigned int)cpus : 1;
+	}
+}
+
+CaptureAnalyzer::~CaptureAnalyzer() {
+}
+
+bool CaptureAnalyzer::analyze(const char * path, std::string & error) {
+	flows.clear();
+	counters = TrafficCounters();
+	packets = bytes = ignored = 0;
+	chunk_count = 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		error = std::string("can't open ") + path + ": " + strerror(errno);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < PCAP_HEADER_SIZE) {
+		::close(fd);
+		error = std::string(path) + " is not a pcap file";
+		return false;
+	}
+	size = st.st_size;
+	void * mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED) {
+		error = std::string("can't map ") + path + ": " + strerror(errno);
+		return false;
+	}
+	data = (const unsigned char *)mapped;
+	madvise(mapped, size, MADV_SEQUENTIAL);
+
+	FileFormat format;
+	u_int32_t magic;
+	memcpy(&magic, data, sizeof(magic));
+	format.swapped = (magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC));
+	if (format.swapped) magic = __builtin_bswap32(magic);
+	format.nanoseconds = (magic == PCAP_MAGIC_NSEC);
+	u_int32_t snaplen = format.get(data + 16);
+	u_int32_t linktype = format.get(data + 20);
+	format.max_caplen = (snaplen && snaplen < MAX_PACKET_SIZE) ? snaplen : MAX_PACKET_SIZE;
+	if ((magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC) || linktype != PCAP_LINKTYPE_ETHERNET) {
+		munmap(mapped, size);
+		data = NULL;
+		error = std::string(path) + " is not a pcap file of Ethernet packets";
+		return false;
+	}
+
+	// Cut the file, on record boundaries
+	std::vector<Chunk> chunks(1);
+	chunks[0].begin = PCAP_HEADER_SIZE;
+	for (size_t target = PCAP_HEADER_SIZE + chunk_size; target < size; target += chunk_size) {
+		size_t offset;
+		if (!findRecord(format, target, offset) || offset >= size || offset <= chunks.back().begin) continue;
+		chunks.back().end = offset;
+		chunks.resize(chunks.size() + 1);
+		chunks.back().begin = offset;
+	}
+	chunks.back().end = size;
+
+	analyzeChunks(format, chunks, threads < chunks.size() ? threads : chunks.size());
+
+	// Every chunk must end where the next one starts, or a cut was wrong
+	bool consistent = true;
+	for (unsigned int i = 0; i + 1 < chunks.size(); i++) {
+		if (chunks[i].stop != chunks[i + 1].begin) consistent = false;
+	}
+	if (!consistent) {
+		chunks.clear();
+		chunks.resize(1);
+		chunks[0].begin = PCAP_HEADER_SIZE;
+		chunks[0].end = size;
+		analyzeChunks(format, chunks, 1);
+	}
+	chunk_count = chunks.size();
+	ignored = size - chunks.back().stop;
+
+	merge(chunks);
+
+	munmap(mapped, size);
+	data = NULL;
+	return true;
+}
+
+// First offset from which RECORD_CHAIN valid record headers follow each
+// other (or reach the end of the file), within the largest record
+bool CaptureAnalyzer::findRecord(const FileFormat & format, size_t from, size_t & offset) const {
+	size_t last = from + 2 * (PCAP_RECORD_SIZE + MAX_PACKET_SIZE);
+	u_int32_t max_fraction = format.nanoseconds ? 1000000000 : 1000000;
+	for (size_t start = from; start < last && start + PCAP_RECORD_SIZE <= size; start++) {
+		size_t o = start;
+		u_int32_t previous_sec = 0;
+		unsigned int n;
+		for (n = 0; n < RECORD_CHAIN && o != size; n++) {
+			if (o + PCAP_RECORD_SIZE > size) break;
+			const unsigned char * h = data + o;
+			u_int32_t sec = format.get(h);
+			u_int32_t fraction = format.get(h + 4);
+			u_int32_t caplen = format.get(h + 8);
+			u_int32_t len = format.get(h + 12);
+			if (fraction >= max_fraction || caplen > format.max_caplen || caplen > len || len > MAX_PACKET_SIZE || len == 0) break;
+			if (n > 0 && (sec > previous_sec + 3600 || sec + 3600 < previous_sec)) break;
+			previous_sec = sec;
+			o += PCAP_RECORD_SIZE + caplen;
+		}
+		if (n == RECORD_CHAIN || (n > 0 && o == size)) {
+			offset = start;
+			return true;
+		}
+	}
+	return false;
+}
+
+void CaptureAnalyzer::analyzeChunk(const FileFormat & format, Chunk & chunk, Worker & worker) const {
+	u_int64_t idle_us = (u_int64_t)idle_timeout * 1000000;
+	size_t offset = chunk.begin;
+	while (offset < chunk.end && offset + PCAP_RECORD_SIZE <= size) {
+		const unsigned char * h = data + offset;
+		u_int32_t caplen = format.get(h + 8);
+		u_int32_t len = format.get(h + 12);
+		if (caplen > format.max_caplen || offset + PCAP_RECORD_SIZE + caplen > size) break;
+		u_int32_t fraction = format.get(h + 4);
+		u_int64_t ts = (u_int64_t)format.get(h) * 1000000 + (format.nanoseconds ? fraction / 1000 : fraction);
+		const unsigned char * packet = h + PCAP_RECORD_SIZE;
+		offset += PCAP_RECORD_SIZE + caplen;
+
+		PacketSummary summary;
+		bool ip = decodePacketSummary(packet, caplen, summary, DECODE_TRANSPORT);
+		chunk.counters.update(summary, len);
+		chunk.packets++;
+		chunk.bytes += PCAP_RECORD_SIZE + caplen;
+		if (!ip) continue;
+
+		Connection key(summary.saddr, summary.sport, summary.daddr, summary.dport);
+		u_int32_t hash = key.hash();
+		bool created;
+		FlowIndex & index = worker.open.insert(key, hash, &created);
+		ChunkFlow * flow = created ? NULL : &chunk.flows[index.index];
+		if (flow && (int64_t)(ts - flow->last_us) > (int64_t)idle_us) {
+			flow->record.end_reason = FLOW_END_IDLE_TIMEOUT;
+			flow = NULL;
+		}
+		if (!flow) {
+			index.index = chunk.flows.size();
+			chunk.flows.resize(chunk.flows.size() + 1);
+			flow = &chunk.flows.back();
+			flow->key = key;
+			flow->hash = hash;
+			FlowRecord & record = flow->record;
+			record.saddr = summary.saddr;
+			record.daddr = summary.daddr;
+			record.sport = summary.sport;
+			record.dport = summary.dport;
+			record.protocol = summary.protocol;
+			record.tcp_flags = 0;
+			record.end_reason = FLOW_END_FORCED;
+			record.packets = 0;
+			record.bytes = 0;
+			record.start_ms = record.end_ms = 0;
+			flow->first_us = ts;
+		}
+		flow->last_us = ts;
+		flow->record.packets++;
+		flow->record.bytes += summary.ip_len;
+		flow->record.tcp_flags |= summary.tcp_flags;
+	}
+	chunk.stop = offset;
+}
+
+void * CaptureAnalyzer::run(void * arg) {
+	Worker & worker = *(Worker *)arg;
+	std::vector<Chunk> & chunks = *worker.chunks;
+	long page = sysconf(_SC_PAGESIZE);
+	for (;;) {
+		unsigned int i = __atomic_fetch_add(worker.next_chunk, 1, __ATOMIC_RELAXED);
+		if (i >= chunks.size()) break;
+		worker.open.clear();
+		worker.analyzer->analyzeChunk(*worker.format, chunks[i], worker);
+
+		// Done with these pages
+		size_t begin = (chunks[i].begin + page - 1) / page * page;
+		size_t end = chunks[i].stop / page * page;
+		if (end > begin) madvise((void *)(worker.analyzer->data + begin), end - begin, MADV_DONTNEED);
+	}
+	return NULL;
+}
+
+void CaptureAnalyzer::analyzeChunks(const FileFormat & format, std::vector<Chunk> & chunks, unsigned int thread_count) {
+	unsigned int next_chunk = 0;
+	std::vector<Worker *> workers(thread_count ? thread_count : 1);
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		workers[i] = new Worker();
+		workers[i]->analyzer = this;
+		workers[i]->format = &format;
+		workers[i]->chunks = &chunks;
+		workers[i]->next_chunk = &next_chunk;
+	}
+
+	// The calling thread is the first worker
+	unsigned int started = 0;
+	for (unsigned int i = 1; i < workers.size(); i++) {
+		if (pthread_create(&workers[i]->thread, NULL, run, workers[i]) != 0) break;
+		started++;
+	}
+	run(workers[0]);
+	for (unsigned int i = 1; i <= started; i++)
+		pthread_join(workers[i]->thread, NULL);
+
+	for (unsigned int i = 0; i < workers.size(); i++)
+		delete workers[i];
+}
+
+// Joins the chunks in file order. A flow continues the latest one of its
+// connection if its first packet came within idle_timeout of the last
+// packet of that one, as it would have in a single pass.
+void CaptureAnalyzer::merge(std::vector<Chunk> & chunks) {
+	int64_t idle_us = (int64_t)idle_timeout * 1000000;
+	FlowTable<Connection, FlowIndex> latest;
+	std::vector<u_int64_t> last_us;   // Of each flow
+	for (unsigned int c = 0; c < chunks.size(); c++) {
+		Chunk & chunk = chunks[c];
+		counters.merge(chunk.counters);
+		packets += chunk.packets;
+		bytes += chunk.bytes;
+
+		for (unsigned int i = 0; i < chunk.flows.size(); i++) {
+			const ChunkFlow & flow = chunk.flows[i];
+			bool created;
+			FlowIndex & index = latest.insert(flow.key, flow.hash, &created);
+			if (!created && (int64_t)(flow.first_us - last_us[index.index]) <= idle_us) {
+				FlowRecord & record = flows[index.index];
+				record.packets += flow.record.packets;
+				record.bytes += flow.record.bytes;
+				record.tcp_flags |= flow.record.tcp_flags;
+				record.end_reason = flow.record.end_reason;
+				record.end_ms = flow.last_us / 1000;
+				last_us[index.index] = flow.last_us;
+				continue;
+			}
+			if (!created) flows[index.index].end_reason = FLOW_END_IDLE_TIMEOUT;
+			index.index = flows.size();
+			flows.push_back(flow.record);
+			flows.back().start_ms = flow.first_us / 1000;
+			flows.back().end_ms = flow.last_us / 1000;
+			last_us.push_back(flow.last_us);
+		}
+		std::vector<ChunkFlow>().swap(chunk.flows);
+	}
+}
+
+void CaptureAnalyzer::print(std::ostream& out) const {
+	out << "Capture Analysis" << std::endl;
+	out << "   |-Packets : " << packets << " (" << bytes << " bytes)" << std::endl;
+	out << "   |-Flows   : " << flows.size() << std::endl;
+	out << "   |-Chunks  : " << chunk_count << " on " << threads << " threads" << std::endl;
+	if (ignored)
+		out << "   |-Ignored : " << ignored << " bytes at the end (truncated or invalid records)" << std::endl;
+	counters.print(out);
+}
@@ -0,0 +1,115 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef CAPTURE_ANALYZER_H_ED213A8E_CBE1_11F1_B69D_02FC00000001_
+#define CAPTURE_ANALYZER_H_ED213A8E_CBE1_11F1_B69D_02FC00000001_
+
+#include "ip_port_connection.h"
+#include "flow_table.h"
+#include "flow_exporter.h"
+#include "traffic_counters.h"
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+#include <iostream>
+
+namespace filter {
+
+// Offline analysis of a pcap file (Ethernet, microsecond or nanosecond
+// timestamps, either byte order) on several threads. The file is mapped and
+// cut into chunks of about chunk_size bytes, each one starting on a packet
+// record: the cut is moved forward to the first offset where a chain of
+// valid record headers starts. Worker threads take the chunks in turn and
+// build, for each one, its flow records and traffic counters. The chunks are
+// then merged in file order, so the result is the same whatever the number
+// of threads: a flow that goes on across a cut is continued by the first
+// record of the next chunk if its first packet came within idle_timeout of
+// the last one. Should a cut turn out not to be on a record boundary (the
+// previous chunk ends elsewhere), the file is analysed again in one chunk.
+//
+// A flow ends after idle_timeout seconds without packets; the flows still
+// going on at the end of the file end with FLOW_END_FORCED.
+
+class CaptureAnalyzer {
+public:
+	typedef IpPortConnection<in_addr_t,u_int16_t> Connection;
+
+	enum { DEFAULT_CHUNK_SIZE = 64 << 20 };
+
+	// threads 0 uses one per online CPU
+	CaptureAnalyzer(unsigned int threads = 0, unsigned int idle_timeout = 15, size_t chunk_size = DEFAULT_CHUNK_SIZE);
+	~CaptureAnalyzer();
+
+	// Returns false, with the reason in error, if the file can't be read
+	bool analyze(const char * path, std::string & error);
+
+	// In the order of their first packet in the file
+	inline const std::vector<FlowRecord> & getFlows() const { return flows; }
+	inline const TrafficCounters & getCounters() const { return counters; }
+	inline u_int64_t getPackets() const { return packets; }
+	inline u_int64_t getBytes() const { return bytes; }            // Captured, with the record headers
+	inline u_int64_t getIgnoredBytes() const { return ignored; }   // Truncated or invalid records at the end
+	inline unsigned int getChunkCount() const { return chunk_count; }
+	inline unsigned int getThreadCount() const { return threads; }
+
+	void print(std::ostream& out) const;
+
+private:
+	struct FileFormat;
+	struct Chunk;
+	struct ChunkFlow;
+	struct Worker;
+	struct FlowIndex {
+		u_int32_t index;
+		FlowIndex() : index(0) { }
+	};
+
+	static void * run(void * arg);
+	bool findRecord(const FileFormat & format, size_t from, size_t & offset) const;
+	void analyzeChunk(const FileFormat & format, Chunk & chunk, Worker & worker) const;
+	void analyzeChunks(const FileFormat & format, std::vector<Chunk> & chunks, unsigned int thread_count);
+	void merge(std::vector<Chunk> & chunks);
+
+	unsigned int threads;
+	unsigned int idle_timeout;
+	size_t chunk_size;
+
+	const unsigned char * data;   // Whole file, mapped
+	size_t size;
+
+	std::vector<FlowRecord> flows;
+	TrafficCounters counters;
+	u_int64_t packets;
+	u_int64_t bytes;
+	u_int64_t ignored;
+	unsigned int chunk_count;
+
+	// Can't be copied
+	CaptureAnalyzer(const CaptureAnalyzer &other);
+	CaptureAnalyzer &operator=(const CaptureAnalyzer &other);
+};
+
+} // namespace filter
+
+#endif // CAPTURE_ANALYZER_H_ED213A8E_CBE1_11F1_B69D_02FC00000001_
@@ -0,0 +1,186 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "checksum.h"
+
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <netinet/ip_icmp.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+using namespace filter;
+
+// Sums
+
+// The 32 bit lanes take two words per vector, so they can't overflow in
+// fewer than 32768 vectors; they are emptied into the result before that
+static const unsigned int SIMD_BLOCK_VECTORS = 16384;
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("avx2")))
+static unsigned int sumAvx2(const unsigned char * data, unsigned int len, u_int64_t & sum) {
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned int i = 0;
+	while (i + 32 <= len) {
+		__m256i acc = zero;
+		for (unsigned int n = 0; n < SIMD_BLOCK_VECTORS && i + 32 <= len; n++, i += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+			acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+			acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+		}
+		u_int32_t lanes[8];
+		_mm256_storeu_si256((__m256i *)lanes, acc);
+		for (int k = 0; k < 8; k++) sum += lanes[k];
+	}
+	return i;
+}
+
+__attribute__((target("sse2")))
+static unsigned int sumSse2(const unsigned char * data, unsigned int len, u_int64_t & sum) {
+	const __m128i zero = _mm_setzero_si128();
+	unsigned int i = 0;
+	while (i + 16 <= len) {
+		__m128i acc = zero;
+		for (unsigned int n = 0; n < SIMD_BLOCK_VECTORS && i + 16 <= len; n++, i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+		}
+		u_int32_t lanes[4];
+		_mm_storeu_si128((__m128i *)lanes, acc);
+		for (int k = 0; k < 4; k++) sum += lanes[k];
+	}
+	return i;
+}
+
+#endif
+
+u_int64_t filter::checksumAdd(const void * buffer, unsigned int len, u_int64_t sum, int simd) {
+	const unsigned char * data = (const unsigned char *)buffer;
+	unsigned int i = 0;
+
+#ifdef HAVE_X86_SIMD
+	// Short headers are not worth the vector setup
+	if (len >= 64) {
+		int level = getSimdLevel();
+		if (simd != SIMD_AUTO && simd < level) level = simd;
+		if (level >= SIMD_AVX2)
+			i = sumAvx2(data, len, sum);
+		else if (level >= SIMD_SSE42)
+			i = sumSse2(data, len, sum);
+	}
+#endif
+
+	// 32 bit words: their halves are the 16 bit words, which folding adds up
+	for (; i + 4 <= len; i += 4) {
+		u_int32_t word;
+		memcpy(&word, data + i, 4);
+		sum += word;
+	}
+	if (i + 2 <= len) {
+		u_int16_t word;
+		memcpy(&word, data + i, 2);
+		sum += word;
+		i += 2;
+	}
+	if (i < len) { // Odd length: the last byte is padded with a zero byte
+		u_int16_t word = 0;
+		memcpy(&word, data + i, 1);
+		sum += word;
+	}
+	return sum;
+}
+
+// Checksum Validator
+
+ChecksumValidator::ChecksumValidator(int s) : simd(s), unverified(0) {
+	memset(checked, 0, sizeof(checked));
+	memset(bad, 0, sizeof(bad));
+}
+
+unsigned int ChecksumValidator::validate(const PacketSummary & summary, const unsigned char * buffer, unsigned int caplen) {
+	if (!(summary.flags & SUMMARY_IP)) return 0;
+
+	unsigned int flags = 0;
+	const struct iphdr * iph = (const struct iphdr *)(buffer + summary.l3_offset);
+	unsigned int ip_header_len = summary.l4_offset - summary.l3_offset;
+	checked[CHECKSUM_IP]++;
+	if (checksumFold(checksumAdd(iph, ip_header_len, 0, simd)) != 0xFFFF) {
+		bad[CHECKSUM_IP]++;
+		flags |= SUMMARY_BAD_IP_CHECKSUM;
+	}
+
+	unsigned int protocol;
+	switch (summary.protocol) {
+		case IPPROTO_TCP: protocol = CHECKSUM_TCP; break;
+		case IPPROTO_UDP: protocol = CHECKSUM_UDP; break;
+		case IPPROTO_ICMP: protocol = CHECKSUM_ICMP; break;
+		default: return flags;
+	}
+
+	// The L4 checksum covers the whole datagram, which must be all here
+	unsigned int end = summary.l3_offset + summary.ip_len;
+	if ((summary.flags & SUMMARY_FRAGMENT) || (ntohs(iph->frag_off) & IP_MF)
+			|| summary.ip_len < ip_header_len || end > caplen) {
+		unverified++;
+		return flags | SUMMARY_L4_UNVERIFIED;
+	}
+	const unsigned char * l4 = buffer + summary.l4_offset;
+	unsigned int l4_len = end - summary.l4_offset;
+
+	u_int64_t sum = 0;
+	if (protocol == CHECKSUM_UDP) {
+		if (l4_len < sizeof(struct udphdr)) {
+			unverified++;
+			return flags | SUMMARY_L4_UNVERIFIED;
+		}
+		if (((const struct udphdr *)l4)->check == 0) return flags; // Checksum not used
+	}
+	if (protocol != CHECKSUM_ICMP) { // Pseudo header
+		sum = (u_int64_t)iph->saddr + iph->daddr + htons(summary.protocol) + htons(l4_len);
+	}
+
+	checked[protocol]++;
+	if (checksumFold(checksumAdd(l4, l4_len, sum, simd)) != 0xFFFF) {
+		bad[protocol]++;
+		flags |= SUMMARY_BAD_L4_CHECKSUM;
+	}
+	return flags;
+}
+
+void ChecksumValidator::print(std::ostream& out) const {
+	static const char * NAMES[CHECKSUM_PROTOCOLS] = { "IP", "TCP", "UDP", "ICMP" };
+	out << "Checksums" << std::endl;
+	for (unsigned int i = 0; i < CHECKSUM_PROTOCOLS; i++)
+		out << "   |-" << NAMES[i] << " : " << checked[i] << " checked, " << bad[i] << " bad" << std::endl;
+	out << "   |-Not verifiable : " << unverified << std::endl;
+}
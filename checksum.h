@@ -0,0 +1,83 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef CHECKSUM_H_B64099C6_CBDA_11F1_B7D0_02FC00000001_
+#define CHECKSUM_H_B64099C6_CBDA_11F1_B7D0_02FC00000001_
+
+#include "packet_summary.h"
+#include "packet_columns.h"
+
+#include <sys/types.h>
+#include <iostream>
+
+namespace filter {
+
+// Internet checksum (RFC 1071). checksumAdd() sums the 16 bit words of a
+// buffer in host byte order, with a wide accumulator, so the carries are
+// only folded at the end by checksumFold(). A header or a segment is valid
+// if the folded sum over it, checksum field included, is 0xFFFF. Buffers
+// summed separately must start at even offsets of the checksummed data.
+
+u_int64_t checksumAdd(const void * data, unsigned int len, u_int64_t sum = 0, int simd = SIMD_AUTO);
+
+inline u_int16_t checksumFold(u_int64_t sum) {
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+enum {
+	CHECKSUM_IP,
+	CHECKSUM_TCP,
+	CHECKSUM_UDP,
+	CHECKSUM_ICMP,
+	CHECKSUM_PROTOCOLS
+};
+
+// Verifies the IPv4 header checksum and the TCP, UDP or ICMP checksum
+// (with the pseudo header for TCP and UDP) of decoded packets, and counts
+// the packets checked and the bad ones for each protocol
+
+class ChecksumValidator {
+public:
+	ChecksumValidator(int simd = SIMD_AUTO);
+
+	// Returns SUMMARY_BAD_IP_CHECKSUM, SUMMARY_BAD_L4_CHECKSUM and SUMMARY_L4_UNVERIFIED flags
+	unsigned int validate(const PacketSummary & summary, const unsigned char * buffer, unsigned int caplen);
+
+	inline u_int64_t getChecked(unsigned int protocol) const { return checked[protocol]; }
+	inline u_int64_t getBad(unsigned int protocol) const { return bad[protocol]; }
+	inline u_int64_t getUnverified() const { return unverified; }
+
+	void print(std::ostream& out) const;
+
+private:
+	int simd;
+	u_int64_t checked[CHECKSUM_PROTOCOLS];
+	u_int64_t bad[CHECKSUM_PROTOCOLS];
+	u_int64_t unverified;     // L4 checksum not checked: fragment or truncated capture
+};
+
+} // namespace filter
+
+#endif // CHECKSUM_H_B64099C6_CBDA_11F1_B7D0_02FC00000001_
@@ -0,0 +1,286 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "config_reloader.h"
+#include "sniffer.h"
+#include "packet_filter.h"
+#include "pattern_matcher.h"
+#include "prefix_table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace filter;
+
+// Configuration File
+
+static bool fileVersion(const std::string & path, SnifferConfig::FileVersion & version) {
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) return false;
+	version.mtime_sec = st.st_mtim.tv_sec;
+	version.mtime_nsec = st.st_mtim.tv_nsec;
+	version.device = st.st_dev;
+	version.inode = st.st_ino;
+	version.size = st.st_size;
+	return true;
+}
+
+// Parses "FIRST SECOND", in seconds
+static bool parseSeconds(const char * text, unsigned int & first, unsigned int & second) {
+	unsigned long values[2];
+	for (int i = 0; i < 2; i++) {
+		char * end;
+		while (isspace((unsigned char)*text)) text++;
+		if (!isdigit((unsigned char)*text)) return false;
+		errno = 0;
+		values[i] = strtoul(text, &end, 10);
+		if (errno != 0 || values[i] > 0xFFFFFFFFul) return false;
+		text = end;
+	}
+	if (*text) return false;
+	first = (unsigned int)values[0];
+	second = (unsigned int)values[1];
+	return true;
+}
+
+bool SnifferConfig::load(const char * path, std::string & error) {
+	FILE * file = fopen(path, "r");
+	if (!file) {
+		error = std::string("can't open ") + path + ": " + strerror(errno);
+		return false;
+	}
+
+	char line[4096];
+	char message[256];
+	unsigned int number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), file)) {
+		number++;
+		size_t len = strlen(line);
+		while (len > 0 && isspace((unsigned char)line[len-1])) line[--len] = 0;
+		char * keyword = line;
+		while (isspace((unsigned char)*keyword)) keyword++;
+		if (*keyword == 0 || *keyword == '#') continue;
+
+		char * value = keyword;
+		while (*value && !isspace((unsigned char)*value)) value++;
+		if (*value) *value++ = 0;
+		while (isspace((unsigned char)*value)) value++;
+
+		if (strcmp(keyword, "filter") == 0 && *value) {
+			filter = value;
+		} else if (strcmp(keyword, "patterns") == 0 && *value) {
+			patterns = value;
+			if (!fileVersion(patterns, patterns_version)) {
+				snprintf(message, sizeof(message), "line %u: can't read ", number);
+				error = message + patterns;
+				ok = false;
+			}
+		} else if (strcmp(keyword, "prefixes") == 0 && *value) {
+			prefixes = value;
+			if (!fileVersion(prefixes, prefixes_version)) {
+				snprintf(message, sizeof(message), "line %u: can't read ", number);
+				error = message + prefixes;
+				ok = false;
+			}
+		} else if (strcmp(keyword, "print_packets") == 0 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0)) {
+			print_packets = (strcmp(value, "on") == 0);
+		} else if (strcmp(keyword, "flow_timeouts") == 0 && parseSeconds(value, idle_timeout, active_timeout)) {
+		} else if (strcmp(keyword, "tcp_timeouts") == 0 && parseSeconds(value, syn_timeout, close_linger)) {
+		} else {
+			snprintf(message, sizeof(message), "line %u: invalid setting \"%.64s\"", number, keyword);
+			error = message;
+			ok = false;
+		}
+	}
+	fclose(file);
+	return ok;
+}
+
+// Reloads
+
+// Written to by the SIGHUP handler. Only write(), which is async-signal-safe.
+static int signal_fd = -1;
+
+static void signalHandler(int) {
+	int saved_errno = errno;
+	if (signal_fd >= 0) {
+		ssize_t r = write(signal_fd, "r", 1);
+		(void)r;   // Full pipe: a reload is already pending
+	}
+	errno = saved_errno;
+}
+
+ConfigReloader::ConfigReloader(Sniffer & sniffer, const char * path) :
+		sniffer(sniffer), path(path), applied(false), running(false), reloads(0), failures(0) {
+	if (pipe(wakeup) != 0) {
+		wakeup[0] = wakeup[1] = -1;
+	} else {
+		// Requests never block: when the pipe is full one is pending anyway
+		fcntl(wakeup[1], F_SETFL, fcntl(wakeup[1], F_GETFL) | O_NONBLOCK);
+	}
+}
+
+ConfigReloader::~ConfigReloader() {
+	stop();
+	if (signal_fd == wakeup[1] && signal_fd >= 0) {
+		signal(SIGHUP, SIG_DFL);
+		signal_fd = -1;
+	}
+	if (wakeup[0] >= 0) close(wakeup[0]);
+	if (wakeup[1] >= 0) close(wakeup[1]);
+}
+
+bool ConfigReloader::reload() {
+	SnifferConfig config;
+	std::string error;
+	if (!config.load(path.c_str(), error)) {
+		fprintf(stderr, "%s: %s, configuration not changed\n", path.c_str(), error.c_str());
+		__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	// Build everything before applying anything, only what changed
+	bool new_filter = !applied || config.filter != current.filter;
+	bool new_patterns = !applied || config.patterns != current.patterns || config.patterns_version != current.patterns_version;
+	bool new_prefixes = !applied || config.prefixes != current.prefixes || config.prefixes_version != current.prefixes_version;
+
+	PacketFilter * filter = NULL;
+	PatternMatcher * matcher = NULL;
+	PrefixTable * prefixes = NULL;
+	bool ok = true;
+	if (new_filter && !config.filter.empty()) {
+		filter = PacketFilter::compile(config.filter.c_str(), error);
+		if (!filter) {
+			error = "filter: " + error;
+			ok = false;
+		}
+	}
+	if (ok && new_patterns && !config.patterns.empty()) {
+		PatternSet set;
+		if (!set.loadFile(config.patterns.c_str())) {
+			error = "invalid patterns in " + config.patterns;
+			ok = false;
+		} else if (!(matcher = set.compile())) {
+			error = "too many patterns in " + config.patterns;
+			ok = false;
+		}
+	}
+	if (ok && new_prefixes && !config.prefixes.empty()) {
+		prefixes = PrefixTable::open(config.prefixes.c_str());
+		if (!prefixes) {
+			error = "invalid prefix table " + config.prefixes;
+			ok = false;
+		}
+	}
+	if (!ok) {
+		delete filter;
+		delete matcher;
+		delete prefixes;
+		fprintf(stderr, "%s: %s, configuration not changed\n", path.c_str(), error.c_str());
+		__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	// Each of these waits for the capture thread to let go of the old version
+	if (new_filter) sniffer.setPacketFilter(filter);
+	if (new_patterns) sniffer.setPatternMatcher(matcher);
+	if (new_prefixes) sniffer.setPrefixTable(prefixes);
+	sniffer.setPrintPackets(config.print_packets);
+	sniffer.setFlowTimeouts(config.idle_timeout, config.active_timeout);
+	sniffer.setTcpTimeouts(config.syn_timeout, config.close_linger);
+
+	current = config;
+	applied = true;
+	__atomic_add_fetch(&reloads, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+bool ConfigReloader::start() {
+	if (running || wakeup[0] < 0) return false;
+	if (pthread_create(&thread, NULL, run, this) != 0) return false;
+	running = true;
+	return true;
+}
+
+void ConfigReloader::stop() {
+	if (!running) return;
+	// Blocking write, so that it's not lost on a full pipe
+	int flags = fcntl(wakeup[1], F_GETFL);
+	fcntl(wakeup[1], F_SETFL, flags & ~O_NONBLOCK);
+	ssize_t r = write(wakeup[1], "q", 1);
+	(void)r;
+	fcntl(wakeup[1], F_SETFL, flags);
+	pthread_join(thread, NULL);
+	running = false;
+}
+
+void ConfigReloader::requestReload() {
+	if (wakeup[1] < 0) return;
+	ssize_t r = write(wakeup[1], "r", 1);
+	(void)r;
+}
+
+void ConfigReloader::requestReload(void * reloader) {
+	static_cast<ConfigReloader *>(reloader)->requestReload();
+}
+
+bool ConfigReloader::handleSignals() {
+	if (wakeup[1] < 0 || (signal_fd >= 0 && signal_fd != wakeup[1])) return false;
+	signal_fd = wakeup[1];
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = signalHandler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	if (sigaction(SIGHUP, &action, NULL) != 0) {
+		signal_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+void * ConfigReloader::run(void * arg) {
+	static_cast<ConfigReloader *>(arg)->reloadLoop();
+	return NULL;
+}
+
+void ConfigReloader::reloadLoop() {
+	char requests[64];
+	for (;;) {
+		ssize_t n = read(wakeup[0], requests, sizeof(requests));
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return;
+		// Requests that came together are served by one reload
+		if (memchr(requests, 'q', n)) return;
+		reload();
+	}
+}
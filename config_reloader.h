@@ -0,0 +1,137 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef CONFIG_RELOADER_H_9B06D750_CBE0_11F1_92CE_02FC00000001_
+#define CONFIG_RELOADER_H_9B06D750_CBE0_11F1_92CE_02FC00000001_
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+
+namespace filter {
+
+class Sniffer;
+
+// Settings read from a configuration file, one per line (lines starting
+// with '#' are comments). Settings left out take their default values, so removing a line
+// removes the filter, patterns or prefixes.
+//
+//   filter EXPRESSION        BPF filter on the packets (packet_filter.h)
+//   patterns PATH            patterns to look for (PatternSet::loadFile())
+//   prefixes PATH            prefix table built by prefix_build
+//   print_packets on|off     (on)
+//   flow_timeouts IDLE ACTIVE    seconds (15 1800)
+//   tcp_timeouts SYN LINGER      seconds (5 2)
+
+struct SnifferConfig {
+	SnifferConfig() : print_packets(true), idle_timeout(15), active_timeout(1800),
+			syn_timeout(5), close_linger(2) { }
+
+	// Returns false, with the line and the reason in error, if the file can't be read or is not valid
+	bool load(const char * path, std::string & error);
+
+	// What tells the versions of a file apart, to reload it when it changes.
+	// A file replaced by rename() (prefix_build) gets another inode, and the
+	// time has nanoseconds, for the files rewritten within the same second.
+	struct FileVersion {
+		FileVersion() : mtime_sec(0), mtime_nsec(0), device(0), inode(0), size(0) { }
+		time_t mtime_sec;
+		long mtime_nsec;
+		dev_t device;
+		ino_t inode;
+		off_t size;
+		inline bool operator!=(const FileVersion & other) const {
+			return mtime_sec != other.mtime_sec || mtime_nsec != other.mtime_nsec
+				|| device != other.device || inode != other.inode || size != other.size;
+		}
+	};
+
+	std::string filter;
+	std::string patterns;
+	std::string prefixes;
+	bool print_packets;
+	unsigned int idle_timeout;
+	unsigned int active_timeout;
+	unsigned int syn_timeout;
+	unsigned int close_linger;
+	FileVersion patterns_version;
+	FileVersion prefixes_version;
+};
+
+// Applies a configuration file to a sniffer, and applies it again whenever
+// asked to (SIGHUP, or the "reload" command of the FlowQueryServer) while
+// the capture goes on. Reloads are done on a thread of their own: the file is
+// read and everything that changed is built (filter program, pattern
+// matcher, prefix table) before anything is applied, and then handed to the
+// sniffer, which swaps it in atomically and deletes the old version once the
+// capture thread is done with it. The capture handle and the connection
+// table are left alone. If anything fails, the previous configuration stays
+// in place.
+
+class ConfigReloader {
+public:
+	ConfigReloader(Sniffer & sniffer, const char * path);
+	~ConfigReloader();
+
+	// Loads and applies the configuration right away, from the calling thread.
+	// Meant for the first load, before start().
+	bool reload();
+
+	// Reloads from a thread of its own when requested
+	bool start();
+	void stop();
+
+	// Can be called from any thread (not from signal handlers)
+	void requestReload();
+	// Same, as a FlowQueryServer::ReloadCallback
+	static void requestReload(void * reloader);
+
+	// Reload on SIGHUP. Only one reloader can handle the signal.
+	bool handleSignals();
+
+	inline u_int64_t getReloads() const { return __atomic_load_n(&reloads, __ATOMIC_RELAXED); }
+	inline u_int64_t getFailures() const { return __atomic_load_n(&failures, __ATOMIC_RELAXED); }
+
+private:
+	static void * run(void * arg);
+	void reloadLoop();
+
+	Sniffer & sniffer;
+	std::string path;
+	SnifferConfig current;   // Applied last
+	bool applied;            // Something was applied already
+	int wakeup[2];           // Pipe to the reload thread: 'r' to reload, 'q' to quit
+	pthread_t thread;
+	bool running;
+	u_int64_t reloads;
+	u_int64_t failures;
+
+	// Can't be copied
+	ConfigReloader(const ConfigReloader &other);
+	ConfigReloader &operator=(const ConfigReloader &other);
+};
+
+} // namespace filter
+
+#endif // CONFIG_RELOADER_H_9B06D750_CBE0_11F1_92CE_02FC00000001_
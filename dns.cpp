@@ -0,0 +1,274 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "dns.h"
+#include "ip_port_connection.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+using namespace filter;
+
+// Helper Functions
+
+static inline unsigned char lowerCase(unsigned char c) {
+	return (unsigned char)(c - 'A') < 26 ? c | 0x20 : c;
+}
+
+const char * filter::dnsRcodeName(unsigned int rcode) {
+	static const char * names[DNS_RCODES] = {
+		"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED", "YXDOMAIN", "YXRRSET",
+		"NXRRSET", "NOTAUTH", "NOTZONE", "RCODE11", "RCODE12", "RCODE13", "RCODE14", "RCODE15",
+	};
+	return names[rcode & 0x0F];
+}
+
+const char * filter::dnsTypeName(unsigned int type) {
+	switch (type) {
+		case 1:   return "A";
+		case 2:   return "NS";
+		case 5:   return "CNAME";
+		case 6:   return "SOA";
+		case 12:  return "PTR";
+		case 15:  return "MX";
+		case 16:  return "TXT";
+		case 28:  return "AAAA";
+		case 33:  return "SRV";
+		case 41:  return "OPT";
+		case 255: return "ANY";
+		default:  return "Unknown";
+	}
+}
+
+// Name Reader
+
+DnsNameReader::DnsNameReader(const unsigned char * message, unsigned int len, unsigned int offset)
+		: msg(message), msg_len(len), pos(offset), end_offset(offset), name_len(0),
+		jumps(0), jumped(false), done(false), error(false) {
+}
+
+bool DnsNameReader::next(const unsigned char *& label, unsigned int & label_len) {
+	if (done || error) return false;
+	while (pos < msg_len) {
+		unsigned int c = msg[pos];
+
+		if ((c & 0xC0) == 0xC0) { // Compression pointer
+			if (pos + 1 >= msg_len) break;
+			unsigned int target = ((c & 0x3F) << 8) | msg[pos + 1];
+			if (!jumped) end_offset = pos + 2;
+			jumped = true;
+			// Only backwards, and not too many times, so loops are not possible
+			if (target >= pos || ++jumps > 64) break;
+			pos = target;
+			continue;
+		}
+		if (c & 0xC0) break; // Reserved label types
+
+		if (c == 0) { // Root label: end of the name
+			if (!jumped) end_offset = pos + 1;
+			done = true;
+			return false;
+		}
+
+		name_len += c + 1;
+		if (pos + 1 + c > msg_len || name_len + 1 > DNS_MAX_NAME_LEN) break;
+		label = msg + pos + 1;
+		label_len = c;
+		pos += c + 1;
+		return true;
+	}
+	error = true;
+	return false;
+}
+
+bool DnsNameReader::skip(const unsigned char * message, unsigned int len, unsigned int & offset) {
+	DnsNameReader reader(message, len, offset);
+	const unsigned char * label;
+	unsigned int label_len;
+	while (reader.next(label, label_len));
+	if (reader.failed()) return false;
+	offset = reader.end();
+	return true;
+}
+
+static void appendLabel(std::string & name, const unsigned char * label, unsigned int len) {
+	for (unsigned int i = 0; i < len; i++) {
+		unsigned char c = label[i];
+		if (c > 32 && c < 127 && c != '.' && c != '\\') {
+			name += (char)c;
+		} else {
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\%03u", c);
+			name += escaped;
+		}
+	}
+	name += '.';
+}
+
+std::string DnsNameReader::toString(const unsigned char * message, unsigned int len, unsigned int offset) {
+	DnsNameReader reader(message, len, offset);
+	const unsigned char * label;
+	unsigned int label_len;
+	std::string name;
+	while (reader.next(label, label_len))
+		appendLabel(name, label, label_len);
+	if (reader.failed()) return "<malformed>";
+	if (name.empty()) name = ".";
+	return name;
+}
+
+// Name Cache
+
+DnsNameCache::DnsNameCache(unsigned int capacity) : evictions(0) {
+	unsigned int sets = 1;
+	while (sets * WAYS < capacity) sets <<= 1;
+	set_mask = sets - 1;
+	entries = new Entry[sets * WAYS];
+	memset(entries, 0, sizeof(Entry) * sets * WAYS);
+	names = new unsigned char[sets * WAYS * DNS_MAX_NAME_LEN];
+}
+
+DnsNameCache::~DnsNameCache() {
+	delete[] entries;
+	delete[] names;
+}
+
+u_int32_t DnsNameCache::intern(const unsigned char * message, unsigned int len, unsigned int offset) {
+	const unsigned char * label;
+	unsigned int label_len;
+
+	// Hash the name as it is in the packet, ignoring case (FNV-1a)
+	u_int32_t hash = 2166136261u;
+	unsigned int name_len = 1;
+	DnsNameReader reader(message, len, offset);
+	while (reader.next(label, label_len)) {
+		hash = (hash ^ label_len) * 16777619u;
+		for (unsigned int i = 0; i < label_len; i++)
+			hash = (hash ^ lowerCase(label[i])) * 16777619u;
+		name_len += label_len + 1;
+	}
+	if (reader.failed()) return NONE;
+	hash = hashMix32(hash);
+
+	u_int32_t first = (hash & set_mask) * WAYS;
+	for (u_int32_t slot = first; slot < first + WAYS; slot++) {
+		Entry & entry = entries[slot];
+		if (entry.len != name_len || entry.hash != hash) continue;
+
+		// Compare with the stored name, label by label
+		const unsigned char * stored = names + slot * DNS_MAX_NAME_LEN;
+		DnsNameReader again(message, len, offset);
+		bool same = true;
+		while (same && again.next(label, label_len)) {
+			same = (*stored++ == label_len);
+			for (unsigned int i = 0; same && i < label_len; i++)
+				same = (*stored++ == lowerCase(label[i]));
+		}
+		if (same) {
+			entry.referenced = 1;
+			return slot;
+		}
+	}
+
+	// Not found: take a free slot, or one that hasn't been used recently
+	u_int32_t victim = NONE;
+	for (unsigned int round = 0; round < 2 && victim == NONE; round++) {
+		for (u_int32_t slot = first; slot < first + WAYS; slot++) {
+			if (!entries[slot].len || !entries[slot].referenced) {
+				victim = slot;
+				break;
+			}
+			entries[slot].referenced = 0;
+		}
+	}
+	if (entries[victim].len) evictions++;
+
+	Entry & entry = entries[victim];
+	memset(&entry, 0, sizeof(entry));
+	entry.hash = hash;
+	entry.len = name_len;
+	entry.referenced = 1;
+
+	unsigned char * stored = names + victim * DNS_MAX_NAME_LEN;
+	DnsNameReader copy(message, len, offset);
+	while (copy.next(label, label_len)) {
+		*stored++ = label_len;
+		for (unsigned int i = 0; i < label_len; i++)
+			*stored++ = lowerCase(label[i]);
+	}
+	*stored = 0;
+	return victim;
+}
+
+std::string DnsNameCache::getName(u_int32_t slot) const {
+	const unsigned char * stored = names + slot * DNS_MAX_NAME_LEN;
+	if (!entries[slot].len) return "";
+	return DnsNameReader::toString(stored, entries[slot].len, 0);
+}
+
+// Statistics
+
+void DnsStatistics::update(const unsigned char * payload, unsigned int len) {
+	messages++;
+	if (len < DNS_HEADER_LEN) {
+		malformed++;
+		return;
+	}
+
+	const dnshdr * hdr = (const dnshdr *) payload;
+	bool response = dnsIsResponse(hdr);
+	unsigned int rcode = dnsRcode(hdr);
+	if (response) rcodes[rcode]++;
+	if (!hdr->qdcount) return;
+
+	u_int32_t slot = names.intern(payload, len, DNS_HEADER_LEN);
+	if (slot == DnsNameCache::NONE) {
+		malformed++;
+		return;
+	}
+	DnsNameCache::Entry & entry = names[slot];
+	if (response) {
+		entry.responses++;
+		if (rcode) entry.failures++;
+	} else {
+		entry.queries++;
+	}
+}
+
+void DnsStatistics::print(std::ostream& out, u_int64_t min_queries) const {
+	out << "DNS Statistics" << std::endl;
+	out << "   |-Messages  : " << messages << std::endl;
+	out << "   |-Malformed : " << malformed << std::endl;
+	for (unsigned int i = 0; i < DNS_RCODES; i++) {
+		if (rcodes[i])
+			out << "   |-" << dnsRcodeName(i) << " : " << rcodes[i] << std::endl;
+	}
+	for (u_int32_t slot = 0; slot < names.capacity(); slot++) {
+		const DnsNameCache::Entry & entry = names[slot];
+		if (!entry.len || entry.queries < min_queries) continue;
+		out << "   |-" << names.getName(slot) << " : " << entry.queries << " queries, "
+			<< entry.responses << " responses, " << entry.failures << " failed" << std::endl;
+	}
+}
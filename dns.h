@@ -0,0 +1,157 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef DNS_H_B6151182_CBD7_11F1_B0FD_02FC00000001_
+#define DNS_H_B6151182_CBD7_11F1_B0FD_02FC00000001_
+
+#include <sys/types.h>
+#include <iostream>
+#include <string>
+
+namespace filter {
+
+// DNS messages are parsed in place: names are walked label by label straight
+// from the packet, following the compression pointers, and never copied.
+
+enum {
+	DNS_HEADER_LEN = 12,
+	DNS_MAX_NAME_LEN = 255,  // Wire format, including the length bytes
+	DNS_RCODES = 16,
+};
+
+struct dnshdr {
+	u_int16_t id;
+	u_int16_t flags;
+	u_int16_t qdcount;
+	u_int16_t ancount;
+	u_int16_t nscount;
+	u_int16_t arcount;
+};
+
+inline bool dnsIsResponse(const dnshdr * h) { return (((const unsigned char *)h)[2] & 0x80) != 0; }
+inline unsigned int dnsOpcode(const dnshdr * h) { return (((const unsigned char *)h)[2] >> 3) & 0x0F; }
+inline unsigned int dnsRcode(const dnshdr * h) { return ((const unsigned char *)h)[3] & 0x0F; }
+
+const char * dnsRcodeName(unsigned int rcode);
+const char * dnsTypeName(unsigned int type);
+
+// Walks the labels of a (possibly compressed) name inside a message
+class DnsNameReader {
+public:
+	DnsNameReader(const unsigned char * message, unsigned int len, unsigned int offset);
+
+	// Returns false at the end of the name, or if the name is malformed
+	bool next(const unsigned char *& label, unsigned int & label_len);
+
+	inline bool failed() const { return error; }
+	// Offset just past the name where it started (before any pointer)
+	inline unsigned int end() const { return end_offset; }
+
+	// Reads the whole name. Return false if it's malformed.
+	static bool skip(const unsigned char * message, unsigned int len, unsigned int & offset);
+	static std::string toString(const unsigned char * message, unsigned int len, unsigned int offset);
+
+private:
+	const unsigned char * msg;
+	unsigned int msg_len;
+	unsigned int pos;
+	unsigned int end_offset;
+	unsigned int name_len;
+	unsigned int jumps;
+	bool jumped;
+	bool done;
+	bool error;
+};
+
+// Bounded cache of interned names: each distinct name (compared ignoring
+// case) is stored once, and repeated names only cost a hash and a compare
+// against the packet, with no allocations. The table is organised in sets of
+// WAYS slots; when a set is full, a name that hasn't been seen recently is
+// replaced (CLOCK), together with its counters.
+
+class DnsNameCache {
+public:
+	static const u_int32_t NONE = 0xFFFFFFFF;
+	enum { WAYS = 8 };
+
+	struct Entry {
+		u_int64_t queries;
+		u_int64_t responses;
+		u_int64_t failures;  // Responses with rcode != 0
+		u_int32_t hash;
+		u_int8_t len;        // Of the name, 0 if the slot is free
+		u_int8_t referenced;
+	};
+
+	DnsNameCache(unsigned int capacity = 65536);
+	~DnsNameCache();
+
+	// Returns the slot of the name, adding it if needed; NONE if the name is malformed
+	u_int32_t intern(const unsigned char * message, unsigned int len, unsigned int offset);
+
+	inline unsigned int capacity() const { return set_mask * WAYS + WAYS; }
+	inline Entry & operator[](u_int32_t slot) { return entries[slot]; }
+	inline const Entry & operator[](u_int32_t slot) const { return entries[slot]; }
+	// Name of a slot in dotted notation
+	std::string getName(u_int32_t slot) const;
+
+	inline u_int64_t getEvictions() const { return evictions; }
+
+private:
+	Entry * entries;
+	unsigned char * names;  // DNS_MAX_NAME_LEN bytes per slot, lowercase wire format
+	unsigned int set_mask;
+	u_int64_t evictions;
+
+	// Can't be copied
+	DnsNameCache(const DnsNameCache &other);
+	DnsNameCache &operator=(const DnsNameCache &other);
+};
+
+// Per query name and per response code counters, updated from the UDP payload
+// of every DNS packet
+
+class DnsStatistics {
+public:
+	DnsStatistics(unsigned int capacity = 65536) : names(capacity), messages(0), malformed(0) {
+		for (unsigned int i = 0; i < DNS_RCODES; i++) rcodes[i] = 0;
+	}
+
+	void update(const unsigned char * payload, unsigned int len);
+
+	// Response codes, and the names with at least min_queries queries
+	void print(std::ostream& out, u_int64_t min_queries = 1) const;
+
+	inline u_int64_t getRcodeCount(unsigned int rcode) const { return rcodes[rcode & 0x0F]; }
+	inline const DnsNameCache & getNames() const { return names; }
+
+private:
+	DnsNameCache names;
+	u_int64_t rcodes[DNS_RCODES];
+	u_int64_t messages;
+	u_int64_t malformed;
+};
+
+} // namespace filter
+
+#endif // DNS_H_B6151182_CBD7_11F1_B0FD_02FC00000001_
@@ -0,0 +1,120 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "duplicate_filter.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <net/ethernet.h>
+
+using namespace filter;
+
+// Bytes hashed after the IP header: enough for the transport header and the
+// start of the payload, the rest rarely tells two packets apart
+static const unsigned int HASHED_AFTER_IP = 48;
+static const unsigned int HASHED_NOT_IP = 64;
+
+static const u_int64_t HASH_MULTIPLIER = 0x9E3779B97F4A7C15ull;
+
+static inline u_int64_t hashWord(u_int64_t h, u_int64_t word) {
+	h ^= word;
+	h *= HASH_MULTIPLIER;
+	return h ^ (h >> 29);
+}
+
+static inline u_int64_t hashBytes(u_int64_t h, const unsigned char * p, unsigned int len) {
+	u_int64_t word;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&word, p, 8);
+		h = hashWord(h, word);
+	}
+	if (len) {
+		word = 0;
+		memcpy(&word, p, len);
+		h = hashWord(h, word);
+	}
+	return h;
+}
+
+u_int64_t DuplicateFilter::fingerprint(const unsigned char * data, unsigned int caplen) {
+	// Skip the link layer header, and the VLAN tags
+	unsigned int offset = sizeof(struct ethhdr);
+	if (caplen < offset) return hashBytes(caplen, data, caplen);
+	u_int16_t ethertype = (data[12] << 8) | data[13];
+	while ((ethertype == ETH_P_8021Q || ethertype == ETH_P_8021AD) && caplen >= offset + 4) {
+		ethertype = (data[offset + 2] << 8) | data[offset + 3];
+		offset += 4;
+	}
+	const unsigned char * p = data + offset;
+	unsigned int len = caplen - offset;
+	u_int64_t h = hashWord(caplen - offset, ethertype);
+
+	unsigned int ihl = (ethertype == ETH_P_IP && len >= 20 && (p[0] >> 4) == 4) ? (p[0] & 0x0F) * 4 : 0;
+	if (ihl < 20 || ihl > len) {
+		return hashBytes(h, p, len < HASHED_NOT_IP ? len : HASHED_NOT_IP);
+	}
+
+	// IPv4 header without TTL (byte 8) and checksum (bytes 10 and 11)
+	u_int64_t word;
+	memcpy(&word, p, 8);
+	h = hashWord(h, word);
+	memcpy(&word, p + 12, 8);
+	h = hashWord(h, word ^ p[9]);
+	h = hashBytes(h, p + 20, ihl - 20); // Options
+	len -= ihl;
+	return hashBytes(h, p + ihl, len < HASHED_AFTER_IP ? len : HASHED_AFTER_IP);
+}
+
+DuplicateFilter::DuplicateFilter(unsigned int window, unsigned int size) : window_us(window > 0x7FFFFFFF ? 0x7FFFFFFF : window), hits(0), misses(0) {
+	u_int32_t entries = 64;
+	while (entries < size && entries < 0x10000000u) entries <<= 1;
+	mask = entries - 1;
+	table = (Entry *)calloc(entries, sizeof(Entry));
+	if (!table) abort();
+}
+
+DuplicateFilter::~DuplicateFilter() {
+	free(table);
+}
+
+bool DuplicateFilter::isDuplicate(const unsigned char * data, unsigned int caplen, const struct timeval & ts) {
+	u_int64_t h = fingerprint(data, caplen);
+	u_int32_t check = (h >> 32) | 1; // Never 0, the check of the empty entries
+	u_int32_t now = (u_int32_t)ts.tv_sec * 1000000u + ts.tv_usec;
+	Entry & entry = table[h & mask];
+	int32_t delta = (int32_t)(now - entry.time_us); // Negative if time went back
+	if (entry.check == check && delta <= (int32_t)window_us && delta >= -(int32_t)window_us) {
+		hits++;
+		return true;
+	}
+	entry.check = check;
+	entry.time_us = now;
+	misses++;
+	return false;
+}
+
+void DuplicateFilter::print(std::ostream& out) const {
+	out << "Duplicate Packets" << std::endl;
+	out << "   |-Dropped : " << hits << std::endl;
+	out << "   |-Unique  : " << misses << std::endl;
+}
@@ -0,0 +1,84 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef DUPLICATE_FILTER_H_24B4AC24_CBDD_11F1_9D1F_02FC00000001_
+#define DUPLICATE_FILTER_H_24B4AC24_CBDD_11F1_9D1F_02FC00000001_
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <iostream>
+
+namespace filter {
+
+// Drops the second copy of the packets seen twice within a short window, as
+// happens with mirror (SPAN) ports that copy both the ingress and the egress
+// traffic. Packets are identified by a hash of their invariant parts: the
+// link layer header (MAC addresses, VLAN tags), the TTL and the IP checksum,
+// which change from one copy to the other, are left out.
+//
+// The hashes are kept in a direct mapped table, each one with the time the
+// packet was seen, so an entry stands for a packet only during the window and
+// nothing has to be cleared as time goes by. A lookup touches a single cache
+// line.
+
+class DuplicateFilter {
+public:
+	// Packets are duplicates if seen again within window_us microseconds.
+	// table_size entries, rounded up to a power of two; it should be well
+	// above the number of packets in a window.
+	DuplicateFilter(unsigned int window_us = 1000, unsigned int table_size = 8192);
+	~DuplicateFilter();
+
+	// Returns true if the packet is a copy of one seen within the window,
+	// before or after it, so that times going back a little (e.g. from
+	// several capture queues) don't let the copies through.
+	bool isDuplicate(const unsigned char * data, unsigned int caplen, const struct timeval & ts);
+
+	inline u_int64_t getHits() const { return hits; }       // Duplicates dropped
+	inline u_int64_t getMisses() const { return misses; }   // Packets let through
+
+	void print(std::ostream& out) const;
+
+	// Hash of the invariant parts of a packet
+	static u_int64_t fingerprint(const unsigned char * data, unsigned int caplen);
+
+private:
+	struct Entry {
+		u_int32_t check;          // High half of the fingerprint
+		u_int32_t time_us;        // When it was seen, wraps around
+	};
+
+	Entry * table;
+	u_int32_t mask;
+	u_int32_t window_us;
+	u_int64_t hits;
+	u_int64_t misses;
+
+	// Can't be copied
+	DuplicateFilter(const DuplicateFilter &other);
+	DuplicateFilter &operator=(const DuplicateFilter &other);
+};
+
+} // namespace filter
+
+#endif // DUPLICATE_FILTER_H_24B4AC24_CBDD_11F1_9D1F_02FC00000001_
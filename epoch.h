@@ -0,0 +1,78 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef EPOCH_H_56698FCE_CBD7_11F1_9975_02FC00000001_
+#define EPOCH_H_56698FCE_CBD7_11F1_9975_02FC00000001_
+
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace filter {
+
+// Lets other threads know when the capture thread might be holding pointers
+// to shared objects, so that an object replaced with an atomic pointer swap
+// can be deleted once the capture thread can no longer be using it:
+//
+//   capture thread:                  other thread:
+//     epoch.enter();                   old = __atomic_exchange_n(&ptr, new_one, __ATOMIC_SEQ_CST);
+//     p = __atomic_load_n(&ptr, ...);  epoch.synchronize();
+//     ... use p ...                    delete old;
+//     epoch.leave();
+//
+// The counter is odd while the capture thread is inside. There is a single
+// reader, so entering and leaving never wait for anything.
+//
+// The roles can also be reversed, with the capture thread replacing objects
+// read by another thread. The capture thread can't wait there, so it takes a
+// mark() after the swap instead, and deletes the old object later, once
+// passed(mark) is true.
+
+class Epoch {
+public:
+	Epoch() : counter(0) { }
+
+	inline void enter() { __atomic_add_fetch(&counter, 1, __ATOMIC_SEQ_CST); }
+	inline void leave() { __atomic_add_fetch(&counter, 1, __ATOMIC_RELEASE); }
+
+	// Wait until the reader has left the section it was in, if any
+	void synchronize() const {
+		u_int64_t start = __atomic_load_n(&counter, __ATOMIC_SEQ_CST);
+		if (!(start & 1)) return;
+		while (__atomic_load_n(&counter, __ATOMIC_ACQUIRE) == start)
+			usleep(100);
+	}
+
+	inline u_int64_t mark() const { return __atomic_load_n(&counter, __ATOMIC_SEQ_CST); }
+
+	// The reader has left the section it was in when the mark was taken, if any
+	inline bool passed(u_int64_t mark) const {
+		return !(mark & 1) || __atomic_load_n(&counter, __ATOMIC_ACQUIRE) != mark;
+	}
+
+private:
+	u_int64_t counter;
+};
+
+} // namespace filter
+
+#endif // EPOCH_H_56698FCE_CBD7_11F1_9975_02FC00000001_
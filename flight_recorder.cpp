@@ -0,0 +1,200 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "flight_recorder.h"
+#include "packet_store.h"
+
+#include <string.h>
+#include <unistd.h>
+
+using namespace filter;
+
+FlightRecorder::FlightRecorder(unsigned int max_packets, unsigned int max_bytes, unsigned int snaplen, size_t memory_limit) :
+		max_packets(max_packets ? max_packets : 1), max_bytes(max_bytes), snaplen(snaplen),
+		unrecorded(0), dumps(0), dump_errors(0), dumps_dropped(0), dump_requests(DUMP_REQUESTS) {
+	// A ring holds at least one packet
+	if (this->max_bytes < sizeof(PcapRecordHeader) + 64) this->max_bytes = sizeof(PcapRecordHeader) + 64;
+	if (this->snaplen + sizeof(PcapRecordHeader) > this->max_bytes) this->snaplen = this->max_bytes - sizeof(PcapRecordHeader);
+	size_t rings = memory_limit / (this->max_bytes + sizeof(RingState));
+	max_rings = rings > 0x7FFFFFFF ? 0x7FFFFFFF : (unsigned int)rings;
+	ring_ids.reserve(max_rings < 65536 ? max_rings : 65536);
+}
+
+FlightRecorder::~FlightRecorder() {
+	for (unsigned int i = 0; i < slabs.size(); i++)
+		delete[] slabs[i];
+}
+
+bool FlightRecorder::start(const Connection & key, u_int32_t hash) {
+	if (free_rings.empty()) {
+		unsigned int allocated = states.size();
+		if (allocated >= max_rings) {
+			unrecorded++;
+			return false;
+		}
+		unsigned int count = max_rings - allocated < RING_SLAB ? max_rings - allocated : RING_SLAB;
+		slabs.push_back(new unsigned char[(size_t)count * max_bytes]);
+		states.resize(allocated + count);
+		for (unsigned int i = count; i > 0; i--)
+			free_rings.push_back(allocated + i - 1);
+	}
+
+	bool created;
+	RingId & ring = ring_ids.insert(key, hash, &created);
+	if (!created) { // Ended with a dump pending, and back already
+		states[ring.id].stopped = 0;
+		return true;
+	}
+	ring.id = free_rings.back();
+	free_rings.pop_back();
+	RingState & state = states[ring.id];
+	state.head = state.used = state.packets = state.stopped = 0;
+	return true;
+}
+
+void FlightRecorder::stop(const Connection & key, u_int32_t hash) {
+	RingId * ring = ring_ids.find(key, hash);
+	if (!ring) return;
+	for (unsigned int i = 0; i < triggers.size(); i++) {
+		if (triggers[i].hash == hash && triggers[i].key == key) {
+			states[ring->id].stopped = 1;
+			return;
+		}
+	}
+	free_rings.push_back(ring->id);
+	ring_ids.erase(key, hash);
+}
+
+bool FlightRecorder::trigger(const Connection & key, u_int32_t hash, const char * reason, const struct timeval & time) {
+	if (!ring_ids.find(key, hash)) return false;
+	if (triggers.size() >= DUMP_REQUESTS) {
+		dumps_dropped++;
+		return false;
+	}
+	Trigger trigger;
+	trigger.key = key;
+	trigger.hash = hash;
+	trigger.reason = reason;
+	trigger.time = time;
+	triggers.push_back(trigger);
+	return true;
+}
+
+void FlightRecorder::clearTriggers() {
+	for (unsigned int i = 0; i < triggers.size(); i++) {
+		RingId * ring = ring_ids.find(triggers[i].key, triggers[i].hash);
+		if (ring && states[ring->id].stopped) {
+			free_rings.push_back(ring->id);
+			ring_ids.erase(triggers[i].key, triggers[i].hash);
+		}
+	}
+	triggers.clear();
+}
+
+void FlightRecorder::readRing(u_int32_t id, u_int32_t offset, void * data, unsigned int size) const {
+	const unsigned char * base = ring(id);
+	unsigned int first = max_bytes - offset < size ? max_bytes - offset : size;
+	memcpy(data, base + offset, first);
+	memcpy((unsigned char *)data + first, base, size - first);
+}
+
+void FlightRecorder::writeRing(u_int32_t id, u_int32_t offset, const void * data, unsigned int size) {
+	unsigned char * base = ring(id);
+	unsigned int first = max_bytes - offset < size ? max_bytes - offset : size;
+	memcpy(base + offset, data, first);
+	memcpy(base, (const unsigned char *)data + first, size - first);
+}
+
+void FlightRecorder::add(const Connection & key, u_int32_t hash, const PacketRecord & packet) {
+	RingId * ring = ring_ids.find(key, hash);
+	if (!ring) return;
+	RingState & state = states[ring->id];
+
+	PcapRecordHeader header;
+	header.ts_sec = packet.ts.tv_sec;
+	header.ts_usec = packet.ts.tv_usec;
+	header.caplen = packet.caplen < snaplen ? packet.caplen : snaplen;
+	header.len = packet.len;
+	unsigned int size = sizeof(header) + header.caplen;
+
+	// Drop the oldest packets until this one fits
+	while (state.packets && (state.packets >= max_packets || state.used + size > max_bytes)) {
+		PcapRecordHeader oldest;
+		readRing(ring->id, state.head, &oldest, sizeof(oldest));
+		unsigned int oldest_size = sizeof(oldest) + oldest.caplen;
+		state.head = (state.head + oldest_size) % max_bytes;
+		state.used -= oldest_size;
+		state.packets--;
+	}
+	if (state.packets == 0) state.head = 0;
+
+	u_int32_t tail = (state.head + state.used) % max_bytes;
+	writeRing(ring->id, tail, &header, sizeof(header));
+	writeRing(ring->id, (tail + sizeof(header)) % max_bytes, packet.data, header.caplen);
+	state.used += size;
+	state.packets++;
+}
+
+int FlightRecorder::write(const Connection & key, u_int32_t hash, FILE * out) {
+	RingId * ring = ring_ids.find(key, hash);
+	if (!ring) return -1;
+	const RingState & state = states[ring->id];
+
+	PcapFileHeader file_header;
+	initPcapFileHeader(file_header, snaplen);
+	bool ok = fwrite(&file_header, sizeof(file_header), 1, out) == 1;
+
+	std::vector<unsigned char> record(sizeof(PcapRecordHeader) + snaplen);
+	u_int32_t offset = state.head;
+	for (unsigned int i = 0; ok && i < state.packets; i++) {
+		PcapRecordHeader header;
+		readRing(ring->id, offset, &header, sizeof(header));
+		unsigned int size = sizeof(header) + header.caplen;
+		readRing(ring->id, offset, &record[0], size);
+		ok = fwrite(&record[0], 1, size, out) == size;
+		offset = (offset + size) % max_bytes;
+	}
+	return ok ? (int)state.packets : -1;
+}
+
+bool FlightRecorder::dump(const Connection & key, u_int32_t hash, const char * path) {
+	if (!ring_ids.find(key, hash)) return false;
+	FILE * out = fopen(path, "wb");
+	bool ok = out && write(key, hash, out) >= 0;
+	if (out) ok = (fclose(out) == 0) && ok;
+	if (!ok) {
+		if (out) unlink(path);
+		dump_errors++;
+		return false;
+	}
+	dumps++;
+	return true;
+}
+
+void FlightRecorder::print(std::ostream& out) const {
+	out << "Flight Recorder" << std::endl;
+	out << "   |-Connections : " << ring_ids.size() << " (up to " << max_rings << ")" << std::endl;
+	out << "   |-Memory      : " << getMemory() << " bytes" << std::endl;
+	out << "   |-Unrecorded  : " << unrecorded << " connections" << std::endl;
+	out << "   |-Dumps       : " << dumps << " (" << dump_errors << " failed, " << dumps_dropped << " dropped)" << std::endl;
+}
@@ -0,0 +1,156 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef FLIGHT_RECORDER_H_39AC7C20_CBE1_11F1_9528_02FC00000001_
+#define FLIGHT_RECORDER_H_39AC7C20_CBE1_11F1_9528_02FC00000001_
+
+#include "ip_port_connection.h"
+#include "flow_table.h"
+#include "packet_batch.h"
+#include "spsc_ring.h"
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <vector>
+#include <iostream>
+
+namespace filter {
+
+// Keeps the last packets of each connection (at most max_packets of them,
+// and max_bytes including a 16 byte header per packet), truncated to
+// snaplen, so that they can be written out as a pcap file once something
+// interesting happens on the connection: by then, the packets that led to
+// it are long gone from the capture buffers.
+//
+// Each connection gets a ring of max_bytes, taken from slabs of RING_SLAB
+// rings allocated as needed, up to memory_limit overall. Rings are given
+// back when the connection ends and reused by the next ones; connections
+// started while all the memory is taken are not recorded.
+//
+// Dumps are queued, by trigger() on the capture thread or requestDump()
+// from another one, and written once the packets being decoded are done,
+// so the packet that fired them doesn't wait for the disk. A connection
+// that ends meanwhile keeps its ring until then.
+//
+// Everything is done by the capture thread, except requestDump().
+
+class FlightRecorder {
+public:
+	typedef IpPortConnection<in_addr_t,u_int16_t> Connection;
+
+	struct Trigger {
+		Connection key;
+		u_int32_t hash;
+		const char * reason;   // Static string
+		struct timeval time;   // Of the packet that fired it
+	};
+
+	enum {
+		RING_SLAB = 64,        // Rings allocated at once
+		DUMP_REQUESTS = 64,    // Dumps pending at most, of each kind
+	};
+
+	FlightRecorder(unsigned int max_packets = 64, unsigned int max_bytes = 16384,
+		unsigned int snaplen = 256, size_t memory_limit = 64 << 20);
+	~FlightRecorder();
+
+	// Take a ring for a new connection. Returns false if there is no memory left.
+	bool start(const Connection & key, u_int32_t hash);
+	// Keep a packet of a connection that has a ring, dropping its oldest ones to make room
+	void add(const Connection & key, u_int32_t hash, const PacketRecord & packet);
+	// Give back the ring of a connection, once its pending dumps are written
+	void stop(const Connection & key, u_int32_t hash);
+
+	// Write the packets kept for a connection as a pcap file, oldest first.
+	// Returns the number of packets, -1 if the connection has no ring or on
+	// write errors.
+	int write(const Connection & key, u_int32_t hash, FILE * out);
+	// Same, to a new file. Returns false if there is nothing to write or it can't be written.
+	bool dump(const Connection & key, u_int32_t hash, const char * path);
+
+	// Ask the capture thread to dump a connection. Can be called from one
+	// other thread at a time; returns false if too many are pending.
+	inline bool requestDump(const Connection & key) { return dump_requests.push(key); }
+	inline bool nextDumpRequest(Connection & key) { return dump_requests.pop(key); }
+
+	// Queue a dump of a connection. Returns false if it has no ring, or if
+	// too many are pending (counted as dropped).
+	bool trigger(const Connection & key, u_int32_t hash, const char * reason, const struct timeval & time);
+	inline const std::vector<Trigger> & getTriggers() const { return triggers; }
+	// Once they are written, giving back the rings of the connections that ended
+	void clearTriggers();
+
+	inline bool hasPendingDumps() const { return !triggers.empty() || dump_requests.size() != 0; }
+
+	inline unsigned int getRingCount() const { return ring_ids.size(); }
+	inline unsigned int getMaxRings() const { return max_rings; }
+	inline size_t getMemory() const { return (size_t)states.size() * (max_bytes + sizeof(RingState)); }
+	inline u_int64_t getUnrecorded() const { return unrecorded; }
+
+	void print(std::ostream& out) const;
+
+private:
+	struct RingId {
+		u_int32_t id;
+		RingId() : id(0) { }
+	};
+	struct RingState {
+		u_int32_t head;        // Offset of the oldest packet
+		u_int32_t used;        // Bytes
+		u_int32_t packets;
+		u_int32_t stopped;     // Connection ended with a dump pending
+	};
+
+	inline unsigned char * ring(u_int32_t id) const {
+		return slabs[id / RING_SLAB] + (size_t)(id % RING_SLAB) * max_bytes;
+	}
+	// Copy in and out of a ring, wrapping around its end
+	void readRing(u_int32_t id, u_int32_t offset, void * data, unsigned int size) const;
+	void writeRing(u_int32_t id, u_int32_t offset, const void * data, unsigned int size);
+
+	unsigned int max_packets;
+	unsigned int max_bytes;
+	unsigned int snaplen;
+	unsigned int max_rings;
+
+	FlowTable<Connection, RingId> ring_ids;
+	std::vector<unsigned char *> slabs;
+	std::vector<RingState> states;          // By id
+	std::vector<u_int32_t> free_rings;
+	u_int64_t unrecorded;     // Connections started without a ring
+	u_int64_t dumps;
+	u_int64_t dump_errors;
+	u_int64_t dumps_dropped;
+
+	SpscRing<Connection> dump_requests;
+	std::vector<Trigger> triggers;
+
+	// Can't be copied
+	FlightRecorder(const FlightRecorder &other);
+	FlightRecorder &operator=(const FlightRecorder &other);
+};
+
+} // namespace filter
+
+#endif // FLIGHT_RECORDER_H_39AC7C20_CBE1_11F1_9528_02FC00000001_
@@ -0,0 +1,345 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "flow_exporter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+using namespace filter;
+
+// Helper Functions
+
+static inline unsigned char * put8(unsigned char * p, u_int8_t v) {
+	*p = v;
+	return p + 1;
+}
+
+static inline unsigned char * put16(unsigned char * p, u_int16_t v) {
+	p[0] = v >> 8; p[1] = v;
+	return p + 2;
+}
+
+static inline unsigned char * put32(unsigned char * p, u_int32_t v) {
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+	return p + 4;
+}
+
+static inline unsigned char * put64(unsigned char * p, u_int64_t v) {
+	return put32(put32(p, v >> 32), v);
+}
+
+static u_int64_t nowMilliseconds() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (u_int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// Fields of the records, as (IPFIX information element, NetFlow v9 type, length)
+
+static const unsigned int TEMPLATE_ID = 256;
+
+static const u_int16_t IPFIX_FIELDS[][2] = {
+	{ 8, 4 },    // sourceIPv4Address
+	{ 12, 4 },   // destinationIPv4Address
+	{ 7, 2 },    // sourceTransportPort
+	{ 11, 2 },   // destinationTransportPort
+	{ 4, 1 },    // protocolIdentifier
+	{ 6, 2 },    // tcpControlBits
+	{ 2, 8 },    // packetDeltaCount
+	{ 1, 8 },    // octetDeltaCount
+	{ 152, 8 },  // flowStartMilliseconds
+	{ 153, 8 },  // flowEndMilliseconds
+	{ 136, 1 },  // flowEndReason
+};
+
+static const u_int16_t NETFLOW_V9_FIELDS[][2] = {
+	{ 8, 4 },    // IPV4_SRC_ADDR
+	{ 12, 4 },   // IPV4_DST_ADDR
+	{ 7, 2 },    // L4_SRC_PORT
+	{ 11, 2 },   // L4_DST_PORT
+	{ 4, 1 },    // PROTOCOL
+	{ 6, 1 },    // TCP_FLAGS
+	{ 2, 8 },    // IN_PKTS
+	{ 1, 8 },    // IN_BYTES
+	{ 22, 4 },   // FIRST_SWITCHED (uptime)
+	{ 21, 4 },   // LAST_SWITCHED (uptime)
+};
+
+static const unsigned int IPFIX_HEADER_LEN = 16;
+static const unsigned int NETFLOW_V9_HEADER_LEN = 20;
+
+// Flow Record Formats
+
+void filter::packFlowRecord(const FlowRecord & record, u_int8_t tag, unsigned char * buffer) {
+	unsigned char * p = buffer;
+	p = put32(p, ntohl(record.saddr));
+	p = put32(p, ntohl(record.daddr));
+	p = put16(p, record.sport);
+	p = put16(p, record.dport);
+	p = put8(p, record.protocol);
+	p = put8(p, record.tcp_flags);
+	p = put8(p, record.end_reason);
+	p = put8(p, tag);
+	p = put64(p, record.packets);
+	p = put64(p, record.bytes);
+	p = put64(p, record.start_ms);
+	p = put64(p, record.end_ms);
+}
+
+void filter::formatFlowRecord(const FlowRecord & record, char * line, size_t size) {
+	char saddr[INET_ADDRSTRLEN], daddr[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &record.saddr, saddr, sizeof(saddr));
+	inet_ntop(AF_INET, &record.daddr, daddr, sizeof(daddr));
+	snprintf(line, size, "%s:%u -> %s:%u proto %u packets %llu bytes %llu start %llu.%03u last %llu.%03u\n",
+		saddr, record.sport, daddr, record.dport, record.protocol,
+		(unsigned long long)record.packets, (unsigned long long)record.bytes,
+		(unsigned long long)(record.start_ms / 1000), (unsigned int)(record.start_ms % 1000),
+		(unsigned long long)(record.end_ms / 1000), (unsigned int)(record.end_ms % 1000));
+}
+
+// Flow Exporter
+
+FlowExporter::FlowExporter(Format f, unsigned int m, unsigned int queue_size)
+		: format(f), mtu(m), queue(queue_size), sock(-1), running(false), stopping(false),
+		domain(0), refresh_datagrams(20), refresh_seconds(60), flush_ms(100),
+		since_template(0), template_ms(0), pending(0), current(NULL), current_len(0),
+		set_offset(0), current_records(0), current_ms(0),
+		sequence(0), exported(0), dropped(0), datagrams(0), send_errors(0) {
+	start_ms = nowMilliseconds();
+
+	// The template set never changes, encode it once
+	const u_int16_t (*fields)[2] = (format == IPFIX) ? IPFIX_FIELDS : NETFLOW_V9_FIELDS;
+	unsigned int count = (format == IPFIX) ? sizeof(IPFIX_FIELDS) / sizeof(IPFIX_FIELDS[0])
+		: sizeof(NETFLOW_V9_FIELDS) / sizeof(NETFLOW_V9_FIELDS[0]);
+	templ_len = 8 + count * 4;
+	unsigned char * p = templ;
+	p = put16(p, format == IPFIX ? 2 : 0); // Template set ID
+	p = put16(p, templ_len);
+	p = put16(p, TEMPLATE_ID);
+	p = put16(p, count);
+	record_len = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		p = put16(p, fields[i][0]);
+		p = put16(p, fields[i][1]);
+		record_len += fields[i][1];
+	}
+
+	unsigned int min_mtu = NETFLOW_V9_HEADER_LEN + templ_len + 4 + record_len + 3;
+	if (mtu < min_mtu) mtu = min_mtu;
+	buffers = new unsigned char[BURST * mtu];
+}
+
+FlowExporter::~FlowExporter() {
+	stop();
+	if (sock >= 0) close(sock);
+	delete[] buffers;
+}
+
+bool FlowExporter::open(const char * host, u_int16_t port) {
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	char service[8];
+	snprintf(service, sizeof(service), "%u", port);
+	struct addrinfo * result;
+	if (getaddrinfo(host, service, &hints, &result) != 0) return false;
+
+	if (sock >= 0) close(sock);
+	sock = -1;
+	for (struct addrinfo * ai = result; ai != NULL && sock < 0; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0) continue;
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+			close(sock);
+			sock = -1;
+		}
+	}
+	freeaddrinfo(result);
+	return sock >= 0;
+}
+
+bool FlowExporter::start() {
+	if (running || sock < 0) return false;
+	__atomic_store_n(&stopping, false, __ATOMIC_RELEASE);
+	if (pthread_create(&thread, NULL, run, this) != 0) return false;
+	running = true;
+	return true;
+}
+
+void FlowExporter::stop() {
+	if (!running) return;
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	running = false;
+}
+
+bool FlowExporter::push(const FlowRecord & record) {
+	if (queue.push(record)) return true;
+	__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+void * FlowExporter::run(void * arg) {
+	((FlowExporter *)arg)->sendLoop();
+	return NULL;
+}
+
+void FlowExporter::sendLoop() {
+	while (1) {
+		bool stop_now = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+
+		FlowRecord record;
+		bool idle = true;
+		while (queue.pop(record)) {
+			addRecord(record);
+			__atomic_add_fetch(&exported, 1, __ATOMIC_RELAXED);
+			idle = false;
+		}
+
+		if (current && (stop_now || nowMilliseconds() - current_ms >= flush_ms))
+			finishDatagram();
+		if (pending)
+			sendPending();
+
+		if (stop_now && !queue.size()) break;
+		if (idle) usleep(1000);
+	}
+}
+
+void FlowExporter::beginDatagram(u_int64_t now_ms) {
+	current = buffers + pending * mtu;
+	current_len = (format == IPFIX) ? IPFIX_HEADER_LEN : NETFLOW_V9_HEADER_LEN;
+	current_records = 0;
+	current_ms = now_ms;
+
+	if (template_ms == 0 || since_template >= refresh_datagrams || now_ms - template_ms >= refresh_seconds * 1000ull) {
+		memcpy(current + current_len, templ, templ_len);
+		current_len += templ_len;
+		since_template = 0;
+		template_ms = now_ms;
+		if (format == NETFLOW_V9) current_records++; // The template counts as a record
+	}
+
+	set_offset = current_len;
+	put16(current + set_offset, TEMPLATE_ID); // Data set, length filled later
+	current_len += 4;
+}
+
+void FlowExporter::addRecord(const FlowRecord & record) {
+	if (current && current_len + record_len + 3 > mtu) finishDatagram();
+	if (!current) beginDatagram(nowMilliseconds());
+
+	unsigned char * p = current + current_len;
+	p = put32(p, ntohl(record.saddr));
+	p = put32(p, ntohl(record.daddr));
+	p = put16(p, record.sport);
+	p = put16(p, record.dport);
+	p = put8(p, record.protocol);
+	if (format == IPFIX) {
+		p = put16(p, record.tcp_flags);
+		p = put64(p, record.packets);
+		p = put64(p, record.bytes);
+		p = put64(p, record.start_ms);
+		p = put64(p, record.end_ms);
+		p = put8(p, record.end_reason);
+	} else {
+		p = put8(p, record.tcp_flags);
+		p = put64(p, record.packets);
+		p = put64(p, record.bytes);
+		p = put32(p, record.start_ms > start_ms ? record.start_ms - start_ms : 0);
+		p = put32(p, record.end_ms > start_ms ? record.end_ms - start_ms : 0);
+	}
+	current_len += record_len;
+	current_records++;
+}
+
+void FlowExporter::finishDatagram() {
+	if (format == NETFLOW_V9) { // Flow sets are padded to 4 bytes
+		while ((current_len - set_offset) & 3) current[current_len++] = 0;
+	}
+	put16(current + set_offset + 2, current_len - set_offset);
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	unsigned char * p = current;
+	if (format == IPFIX) {
+		p = put16(p, 10);
+		p = put16(p, current_len);
+		p = put32(p, tv.tv_sec);
+		p = put32(p, sequence);      // Data records sent before this message
+		p = put32(p, domain);
+		sequence += current_records;
+	} else {
+		p = put16(p, 9);
+		p = put16(p, current_records);
+		p = put32(p, (u_int32_t)(nowMilliseconds() - start_ms));
+		p = put32(p, tv.tv_sec);
+		p = put32(p, sequence);      // Datagrams sent before this one
+		p = put32(p, domain);
+		sequence++;
+	}
+
+	lengths[pending++] = current_len;
+	current = NULL;
+	since_template++;
+	if (pending == BURST) sendPending();
+}
+
+void FlowExporter::sendPending() {
+	struct mmsghdr messages[BURST];
+	struct iovec iov[BURST];
+	memset(messages, 0, sizeof(messages));
+	for (unsigned int i = 0; i < pending; i++) {
+		iov[i].iov_base = buffers + i * mtu;
+		iov[i].iov_len = lengths[i];
+		messages[i].msg_hdr.msg_iov = &iov[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	unsigned int sent = 0;
+	while (sent < pending) {
+		int n = sendmmsg(sock, messages + sent, pending - sent, 0);
+		if (n <= 0) { // Datagrams that can't be sent are lost
+			__atomic_add_fetch(&send_errors, pending - sent, __ATOMIC_RELAXED);
+			break;
+		}
+		sent += n;
+		__atomic_add_fetch(&datagrams, n, __ATOMIC_RELAXED);
+	}
+	pending = 0;
+
+	if (current && current != buffers) { // Datagram still being filled goes to the first buffer
+		memmove(buffers, current, current_len);
+		current = buffers;
+	}
+}
@@ -0,0 +1,157 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef FLOW_EXPORTER_H_399ECD0E_CBD8_11F1_9C2B_02FC00000001_
+#define FLOW_EXPORTER_H_399ECD0E_CBD8_11F1_9C2B_02FC00000001_
+
+#include "spsc_ring.h"
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+namespace filter {
+
+// Reasons for the end of a flow record (IPFIX flowEndReason)
+enum {
+	FLOW_END_IDLE_TIMEOUT = 1,
+	FLOW_END_ACTIVE_TIMEOUT = 2,
+	FLOW_END_OF_FLOW = 3,           // FIN or RST
+	FLOW_END_FORCED = 4,            // End of capture
+	FLOW_END_LACK_OF_RESOURCES = 5, // Evicted from the connection table
+};
+
+struct FlowRecord {
+	in_addr_t saddr;          // Initiator, network byte order
+	in_addr_t daddr;          // Network byte order
+	u_int16_t sport;          // Host byte order
+	u_int16_t dport;          // Host byte order
+	u_int8_t protocol;
+	u_int8_t tcp_flags;       // All the flags seen
+	u_int8_t end_reason;      // FLOW_END_*
+	u_int64_t packets;        // Since the previous record of the flow
+	u_int64_t bytes;
+	u_int64_t start_ms;       // Milliseconds since the epoch
+	u_int64_t end_ms;
+};
+
+// Fixed size binary form of a record: all fields in network byte order, in
+// the order of FlowRecord, with tag in the padding byte after end_reason
+enum { PACKED_FLOW_RECORD_SIZE = 48 };
+void packFlowRecord(const FlowRecord & record, u_int8_t tag, unsigned char * buffer);
+
+// One line of text, ended with '\n'
+void formatFlowRecord(const FlowRecord & record, char * line, size_t size);
+
+// Sends flow records to a collector as IPFIX (RFC 7011) or NetFlow v9
+// (RFC 3954) over UDP. push() only copies the record into a queue, so the
+// capture thread never waits; the records are encoded and sent from a thread
+// of their own, packed into datagrams of up to mtu bytes, with up to
+// BURST datagrams sent by a single sendmmsg() call.
+
+class FlowExporter {
+public:
+	enum Format {
+		NETFLOW_V9 = 9,
+		IPFIX = 10,
+	};
+
+	enum { BURST = 32 };
+
+	FlowExporter(Format format = IPFIX, unsigned int mtu = 1400, unsigned int queue_size = 65536);
+	~FlowExporter();
+
+	// Collector address, returns false if it can't be resolved
+	bool open(const char * host, u_int16_t port);
+	// Start and stop the sending thread. stop() sends what is still queued.
+	bool start();
+	void stop();
+
+	// Returns false, and counts the record as dropped, if the queue is full
+	bool push(const FlowRecord & record);
+
+	inline void setObservationDomain(u_int32_t id) { domain = id; }
+	// Templates are sent again after this many datagrams or seconds
+	inline void setTemplateRefresh(unsigned int datagrams, unsigned int seconds) {
+		refresh_datagrams = datagrams; refresh_seconds = seconds;
+	}
+	// Maximum time a record waits for the datagram to be filled
+	inline void setFlushInterval(unsigned int ms) { flush_ms = ms; }
+
+	inline u_int64_t getExported() const { return __atomic_load_n(&exported, __ATOMIC_RELAXED); }
+	inline u_int64_t getDropped() const { return __atomic_load_n(&dropped, __ATOMIC_RELAXED); }
+	inline u_int64_t getDatagrams() const { return __atomic_load_n(&datagrams, __ATOMIC_RELAXED); }
+	inline u_int64_t getSendErrors() const { return __atomic_load_n(&send_errors, __ATOMIC_RELAXED); }
+
+private:
+	static void * run(void * arg);
+	void sendLoop();
+	void beginDatagram(u_int64_t now_ms);
+	void addRecord(const FlowRecord & record);
+	void finishDatagram();
+	void sendPending();
+
+	Format format;
+	unsigned int mtu;
+	SpscRing<FlowRecord> queue;
+	int sock;
+	pthread_t thread;
+	bool running;
+	bool stopping;
+
+	u_int32_t domain;
+	unsigned int refresh_datagrams;
+	unsigned int refresh_seconds;
+	unsigned int flush_ms;
+	u_int64_t start_ms;             // For the NetFlow v9 uptime
+
+	unsigned char templ[64];        // Encoded template set, built once
+	unsigned int templ_len;
+	unsigned int record_len;
+	unsigned int since_template;    // Datagrams sent since the last template
+	u_int64_t template_ms;
+
+	unsigned char * buffers;        // BURST datagrams of mtu bytes
+	unsigned int lengths[BURST];
+	unsigned int pending;           // Datagrams ready to be sent
+	unsigned char * current;        // Datagram being filled, NULL if none
+	unsigned int current_len;
+	unsigned int set_offset;        // Start of the data set in the current datagram
+	unsigned int current_records;
+	u_int64_t current_ms;           // When the current datagram was started
+
+	u_int32_t sequence;
+	// Read from any thread, always accessed atomically
+	u_int64_t exported;
+	u_int64_t dropped;
+	u_int64_t datagrams;
+	u_int64_t send_errors;
+
+	// Can't be copied
+	FlowExporter(const FlowExporter &other);
+	FlowExporter &operator=(const FlowExporter &other);
+};
+
+} // namespace filter
+
+#endif // FLOW_EXPORTER_H_399ECD0E_CBD8_11F1_9C2B_02FC00000001_
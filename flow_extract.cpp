@@ -0,0 +1,91 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Writes the packets of one connection, read back from a packet store
+// directory, to the standard output as a pcap file:
+//
+//   flow_extract DIRECTORY ADDRESS:PORT ADDRESS:PORT [FROM [TO]] > flow.pcap
+//
+// FROM and TO are seconds since the epoch.
+
+#include "packet_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+using namespace filter;
+
+static bool parseEndpoint(const char * text, in_addr_t & addr, u_int16_t & port) {
+	char host[64];
+	const char * colon = strrchr(text, ':');
+	if (!colon || (size_t)(colon - text) >= sizeof(host)) return false;
+	memcpy(host, text, colon - text);
+	host[colon - text] = '\0';
+	struct in_addr in;
+	if (inet_aton(host, &in) == 0) return false;
+	char * end;
+	long value = strtol(colon + 1, &end, 10);
+	if (*end != '\0' || value < 0 || value > 65535) return false;
+	addr = in.s_addr;
+	port = value;
+	return true;
+}
+
+static void writePacket(const PacketRecord & packet, void * context) {
+	FILE * out = (FILE *)context;
+	PcapRecordHeader header;
+	header.ts_sec = packet.ts.tv_sec;
+	header.ts_usec = packet.ts.tv_usec;
+	header.caplen = packet.caplen;
+	header.len = packet.len;
+	fwrite(&header, sizeof(header), 1, out);
+	fwrite(packet.data, 1, packet.caplen, out);
+}
+
+int main(int argc, char * argv[])
+{
+	in_addr_t saddr, daddr;
+	u_int16_t sport, dport;
+	if (argc < 4 || argc > 6 || !parseEndpoint(argv[2], saddr, sport) || !parseEndpoint(argv[3], daddr, dport)) {
+		fprintf(stderr, "Usage: %s DIRECTORY ADDRESS:PORT ADDRESS:PORT [FROM [TO]] > flow.pcap\n", argv[0]);
+		return 1;
+	}
+	u_int64_t from_us = argc > 4 ? strtoull(argv[4], NULL, 10) * 1000000 : 0;
+	u_int64_t to_us = argc > 5 ? strtoull(argv[5], NULL, 10) * 1000000 + 999999 : ~(u_int64_t)0;
+
+	PacketStoreReader reader;
+	if (!reader.open(argv[1])) {
+		fprintf(stderr, "Can't open %s\n", argv[1]);
+		return 1;
+	}
+
+	PcapFileHeader header;
+	initPcapFileHeader(header, 65535);
+	fwrite(&header, sizeof(header), 1, stdout);
+	PacketStoreReader::Connection key(saddr, sport, daddr, dport);
+	unsigned int found = reader.extract(key, from_us, to_us, writePacket, stdout);
+	fprintf(stderr, "%u packets from %u segments\n", found, reader.getSegmentCount());
+	return fflush(stdout) == 0 ? 0 : 1;
+}
@@ -0,0 +1,345 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "flow_query.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+using namespace filter;
+
+// Responses are sent in blocks of this size
+static const unsigned int OUTPUT_BUFFER_SIZE = 65536;
+static const unsigned int MAX_COMMAND_LENGTH = 256;
+// How often the server thread checks if it has to stop
+static const int POLL_TIMEOUT_MS = 200;
+// Clients served at once; more wait to be accepted
+static const unsigned int MAX_CLIENTS = 16;
+// Clients that send nothing for this long are dropped
+static const u_int64_t CLIENT_IDLE_MS = 30000;
+// Clients that don't read a response within this time are dropped
+static const u_int64_t SEND_TIMEOUT_MS = 2000;
+
+static u_int64_t monotonicMilliseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Responses go to non blocking sockets: waiting for the client to read
+// them is bounded by a deadline, after which the client is given up
+class FlowQueryServer::Output {
+public:
+	Output(int f) : fd(f), len(0), failed(false) {
+		deadline = monotonicMilliseconds() + SEND_TIMEOUT_MS;
+	}
+
+	void line(const char * format, ...) __attribute__((format(printf, 2, 3))) {
+		for (int attempt = 0; attempt < 2; attempt++) {
+			va_list args;
+			va_start(args, format);
+			int n = vsnprintf(buffer + len, OUTPUT_BUFFER_SIZE - len, format, args);
+			va_end(args);
+			if (n < 0) return;
+			if (len + n < OUTPUT_BUFFER_SIZE) {
+				len += n;
+				return;
+			}
+			flush(); // Didn't fit, send what we have and try again
+		}
+	}
+
+	void flush() {
+		unsigned int sent = 0;
+		while (sent < len && !failed) {
+			ssize_t n = send(fd, buffer + sent, len - sent, MSG_NOSIGNAL);
+			if (n > 0) {
+				sent += n;
+			} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				u_int64_t now = monotonicMilliseconds();
+				struct pollfd p;
+				p.fd = fd;
+				p.events = POLLOUT;
+				if (now >= deadline || poll(&p, 1, (int)(deadline - now)) < 0) failed = true;
+			} else {
+				failed = true;
+			}
+		}
+		len = 0;
+	}
+
+	inline bool hasFailed() const { return failed; }
+
+private:
+	int fd;
+	u_int64_t deadline;
+	char buffer[OUTPUT_BUFFER_SIZE];
+	unsigned int len;
+	bool failed;
+};
+
+// Flow Query Server
+
+FlowQueryServer::FlowQueryServer() : sock(-1), running(false), stopping(false), queries(0),
+		reload_callback(NULL), reload_context(NULL),
+		current(NULL), retired(NULL), retired_mark(0) {
+}
+
+FlowQueryServer::~FlowQueryServer() {
+	stop();
+	if (sock >= 0) {
+		close(sock);
+		unlink(path.c_str());
+	}
+	delete current;
+	delete retired;
+}
+
+bool FlowQueryServer::open(const char * socket_path) {
+	struct sockaddr_un address;
+	if (strlen(socket_path) >= sizeof(address.sun_path)) return false;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return false;
+	unlink(socket_path);
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 4) != 0) {
+		close(fd);
+		return false;
+	}
+
+	if (sock >= 0) {
+		close(sock);
+		unlink(path.c_str());
+	}
+	sock = fd;
+	path = socket_path;
+	return true;
+}
+
+bool FlowQueryServer::start() {
+	if (running || sock < 0) return false;
+	__atomic_store_n(&stopping, false, __ATOMIC_RELEASE);
+	if (pthread_create(&thread, NULL, run, this) != 0) return false;
+	running = true;
+	return true;
+}
+
+void FlowQueryServer::stop() {
+	if (!running) return;
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	running = false;
+}
+
+bool FlowQueryServer::publish(FlowSnapshot * snapshot) {
+	if (retired) {
+		if (!readers.passed(retired_mark)) return false;
+		delete retired;
+	}
+	retired = __atomic_exchange_n(&current, snapshot, __ATOMIC_SEQ_CST);
+	retired_mark = readers.mark();
+	return true;
+}
+
+void * FlowQueryServer::run(void * arg) {
+	((FlowQueryServer *)arg)->serveLoop();
+	return NULL;
+}
+
+struct FlowQueryServer::Client {
+	int fd;
+	unsigned int len;
+	u_int64_t last_ms;       // Last command received
+	char command[MAX_COMMAND_LENGTH];
+};
+
+// Clients are served in turn from a single poll() set, so that one that
+// stays idle or reads slowly doesn't hold up the others
+void FlowQueryServer::serveLoop() {
+	std::vector<Client *> clients;
+	std::vector<struct pollfd> fds;
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		fds.resize(clients.size() + 1);
+		for (unsigned int i = 0; i < clients.size(); i++) {
+			fds[i].fd = clients[i]->fd;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+		// The listening socket goes last, only while there is room for another client
+		struct pollfd & listener = fds[clients.size()];
+		listener.fd = clients.size() < MAX_CLIENTS ? sock : -1;
+		listener.events = POLLIN;
+		listener.revents = 0;
+		if (poll(&fds[0], fds.size(), POLL_TIMEOUT_MS) < 0 && errno != EINTR) continue;
+
+		u_int64_t now = monotonicMilliseconds();
+		unsigned int kept = 0;
+		for (unsigned int i = 0; i < clients.size(); i++) {
+			Client * client = clients[i];
+			bool keep;
+			if (fds[i].revents) keep = serveClient(*client, now);
+			else keep = now - client->last_ms < CLIENT_IDLE_MS;
+			if (keep) {
+				clients[kept++] = client;
+			} else {
+				close(client->fd);
+				delete client;
+			}
+		}
+		clients.resize(kept);
+
+		if (listener.revents & POLLIN) {
+			int fd = accept(sock, NULL, NULL);
+			if (fd >= 0) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				Client * client = new Client();
+				client->fd = fd;
+				client->len = 0;
+				client->last_ms = now;
+				clients.push_back(client);
+			}
+		}
+	}
+	for (unsigned int i = 0; i < clients.size(); i++) {
+		close(clients[i]->fd);
+		delete clients[i];
+	}
+}
+
+// Reads what the client sent and answers the complete commands. Returns
+// false when the client is gone or has to be dropped.
+bool FlowQueryServer::serveClient(Client & client, u_int64_t now) {
+	ssize_t n = read(client.fd, client.command + client.len, sizeof(client.command) - 1 - client.len);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return true;
+	if (n <= 0) return false;
+	client.len += n;
+	client.last_ms = now;
+
+	Output out(client.fd);
+	char * command = client.command;
+	char * end;
+	while ((end = (char *)memchr(command, '\n', client.len)) != NULL && !out.hasFailed()) {
+		*end = 0;
+		if (end > command && end[-1] == '\r') end[-1] = 0;
+		query(command, out);
+		client.len -= end + 1 - command;
+		memmove(command, end + 1, client.len);
+	}
+	if (client.len == sizeof(client.command) - 1) { // No end of line in sight
+		out.line("error: command too long\n\n");
+		out.flush();
+		client.len = 0;
+	}
+	return !out.hasFailed();
+}
+
+void FlowQueryServer::query(const char * command, Output & out) {
+	__atomic_add_fetch(&queries, 1, __ATOMIC_RELAXED);
+
+	readers.enter();
+	const FlowSnapshot * snapshot = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+	unsigned int count = DEFAULT_TOP;
+	if (strcmp(command, "reload") == 0) {
+		if (reload_callback) {
+			reload_callback(reload_context);
+			out.line("reload requested\n");
+		} else {
+			out.line("error: nothing to reload\n");
+		}
+	} else if (!snapshot) {
+		out.line("error: no snapshot yet\n");
+	} else if (strcmp(command, "count") == 0) {
+		queryCount(*snapshot, out);
+	} else if (strncmp(command, "ip ", 3) == 0) {
+		queryAddress(*snapshot, command + 3, out);
+	} else if (strcmp(command, "top") == 0 || sscanf(command, "top %u", &count) == 1) {
+		queryTop(*snapshot, count, out);
+	} else {
+		out.line("error: unknown command\n");
+	}
+	readers.leave();
+
+	out.line("\n");
+	out.flush();
+}
+
+void FlowQueryServer::queryCount(const FlowSnapshot & snapshot, Output & out) {
+	out.line("flows %zu time %llu.%03u\n", snapshot.flows.size(),
+		(unsigned long long)(snapshot.time_ms / 1000), (unsigned int)(snapshot.time_ms % 1000));
+}
+
+void FlowQueryServer::queryAddress(const FlowSnapshot & snapshot, const char * address, Output & out) {
+	struct in_addr addr;
+	if (inet_pton(AF_INET, address, &addr) != 1) {
+		out.line("error: bad address\n");
+		return;
+	}
+
+	char line[256];
+	for (size_t i = 0; i < snapshot.flows.size() && !out.hasFailed(); i++) {
+		const FlowRecord & flow = snapshot.flows[i];
+		if (flow.saddr != addr.s_addr && flow.daddr != addr.s_addr) continue;
+		formatFlowRecord(flow, line, sizeof(line));
+		out.line("%s", line);
+	}
+}
+
+void FlowQueryServer::queryTop(const FlowSnapshot & snapshot, unsigned int count, Output & out) {
+	// Keep the largest ones seen in a min-heap of at most count flows
+	typedef std::pair<u_int64_t, size_t> Item;
+	std::priority_queue<Item, std::vector<Item>, std::greater<Item> > heap;
+	for (size_t i = 0; i < snapshot.flows.size() && count; i++) {
+		u_int64_t bytes = snapshot.flows[i].bytes;
+		if (heap.size() < count) heap.push(Item(bytes, i));
+		else if (bytes > heap.top().first) {
+			heap.pop();
+			heap.push(Item(bytes, i));
+		}
+	}
+
+	std::vector<size_t> top;
+	for (; !heap.empty(); heap.pop()) top.push_back(heap.top().second);
+	char line[256];
+	for (size_t i = top.size(); i-- > 0; ) {
+		formatFlowRecord(snapshot.flows[top[i]], line, sizeof(line));
+		out.line("%s", line);
+	}
+}
@@ -0,0 +1,119 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef FLOW_QUERY_H_FD8E7A56_CBD9_11F1_AD99_02FC00000001_
+#define FLOW_QUERY_H_FD8E7A56_CBD9_11F1_AD99_02FC00000001_
+
+#include "flow_exporter.h"
+#include "epoch.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+namespace filter {
+
+// Copy of the connection table at some point, as flow records (end_reason is 0)
+struct FlowSnapshot {
+	u_int64_t time_ms;    // When it was completed
+	std::vector<FlowRecord> flows;
+};
+
+// Answers queries about the connections on a Unix domain socket, from a
+// thread of its own. The capture thread never shares the connection table
+// with it: it copies the table into a FlowSnapshot a few entries at a time
+// and publish()es it when done. Queries read the latest snapshot, which is
+// only deleted once no query is using it, so they never make the capture
+// thread wait, however long they take. Several clients are served at
+// once; idle ones are dropped after a while, and so are the ones that don't
+// read their responses.
+//
+// Commands are text lines; each response ends with an empty line:
+//
+//   count          number of connections
+//   ip ADDRESS     connections of an IPv4 address
+//   top [N]        N connections with most bytes (10 by default)
+//   reload         reread the configuration (see setReloadCallback())
+
+class FlowQueryServer {
+public:
+	enum { DEFAULT_TOP = 10 };
+
+	typedef void (*ReloadCallback)(void * context);
+
+	FlowQueryServer();
+	~FlowQueryServer();
+
+	// Listen on this path, replacing whatever was there
+	bool open(const char * path);
+	bool start();
+	void stop();
+
+	// Called by the capture thread. Returns false, without taking the
+	// snapshot, if the previous one is still being read; try again later.
+	bool publish(FlowSnapshot * snapshot);
+
+	inline u_int64_t getQueries() const { return __atomic_load_n(&queries, __ATOMIC_RELAXED); }
+
+	// Called from the server thread for the "reload" command, e.g. with
+	// ConfigReloader::requestReload. Must be set before start().
+	inline void setReloadCallback(ReloadCallback callback, void * context) {
+		reload_callback = callback;
+		reload_context = context;
+	}
+
+private:
+	static void * run(void * arg);
+	void serveLoop();
+	struct Client;
+	bool serveClient(Client & client, u_int64_t now);
+
+	class Output;
+	void query(const char * command, Output & out);
+	void queryCount(const FlowSnapshot & snapshot, Output & out);
+	void queryAddress(const FlowSnapshot & snapshot, const char * address, Output & out);
+	void queryTop(const FlowSnapshot & snapshot, unsigned int count, Output & out);
+
+	int sock;
+	std::string path;
+	pthread_t thread;
+	bool running;
+	bool stopping;
+	u_int64_t queries;           // Read from any thread, always accessed atomically
+	ReloadCallback reload_callback;
+	void * reload_context;
+
+	FlowSnapshot * current;   // Latest snapshot, swapped atomically
+	FlowSnapshot * retired;   // Previous one, deleted once readers passed retired_mark
+	u_int64_t retired_mark;
+	Epoch readers;            // Server thread is reading a snapshot
+
+	// Can't be copied
+	FlowQueryServer(const FlowQueryServer &other);
+	FlowQueryServer &operator=(const FlowQueryServer &other);
+};
+
+} // namespace filter
+
+#endif // FLOW_QUERY_H_FD8E7A56_CBD9_11F1_AD99_02FC00000001_
@@ -0,0 +1,320 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef FLOW_TABLE_H_4E67EEC0_CBD6_11F1_A596_02FC00000001_
+#define FLOW_TABLE_H_4E67EEC0_CBD6_11F1_A596_02FC00000001_
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+namespace filter {
+
+// Open addressing hash table (linear probing, power of two size) used to keep
+// the state of the connections. Lookups are split in two steps, so that the
+// bucket of a key can be prefetched long before it is actually needed:
+//
+//   u_int32_t h = key.hash();
+//   table.prefetch(h);
+//   ... (work on other packets) ...
+//   VALUE & v = table.insert(key, h);
+//
+// KEY must provide operator== and a hash() method; both KEY and VALUE must be
+// default constructible and assignable.
+//
+// The table can also be kept to a fixed number of entries: reserve() the
+// slots for them up front, and evict() an entry whenever it's full before
+// inserting a new one. Victims are chosen by CLOCK (second chance): every
+// lookup marks the entry as referenced, and the hand of the clock spares
+// referenced entries once, clearing the mark.
+
+template <typename KEY, typename VALUE>
+class FlowTable {
+public:
+	struct Entry {
+		KEY first;
+		VALUE second;
+	};
+
+private:
+	struct Slot {
+		Entry entry;
+		u_int32_t hash;
+		bool used;
+		bool referenced; // For CLOCK eviction
+	};
+
+public:
+	enum { EVICTION_WINDOW = 32 };
+
+	class const_iterator {
+	public:
+		const_iterator() : slot(NULL), last(NULL) { }
+		const_iterator(const Slot *s, const Slot *l) : slot(s), last(l) { skip(); }
+		inline const Entry & operator*() const { return slot->entry; }
+		inline const Entry * operator->() const { return &slot->entry; }
+		inline const_iterator & operator++() { ++slot; skip(); return *this; }
+		inline const_iterator operator++(int) { const_iterator old = *this; ++*this; return old; }
+		inline bool operator==(const const_iterator &other) const { return slot == other.slot; }
+		inline bool operator!=(const const_iterator &other) const { return slot != other.slot; }
+	private:
+		inline void skip() { while (slot != last && !slot->used) ++slot; }
+		const Slot *slot;
+		const Slot *last;
+	};
+
+	FlowTable(unsigned int initial_capacity = 1024) : slots(NULL), mask(0), count(0), hand(0), clock(0) {
+		unsigned int capacity = 16;
+		while (capacity < initial_capacity) capacity <<= 1;
+		allocate(capacity);
+	}
+
+	~FlowTable() {
+		delete[] slots;
+	}
+
+	inline unsigned int size() const { return count; }
+	inline unsigned int capacity() const { return mask + 1; }
+	inline bool empty() const { return count == 0; }
+
+	// Memory used by each slot of the table
+	static inline unsigned int slotSize() { return sizeof(Slot); }
+
+	// Largest number of entries that can be kept without the table using
+	// more than the given memory
+	static unsigned int maxEntries(size_t bytes) {
+		size_t capacity = 16;
+		while (capacity * 2 * sizeof(Slot) <= bytes && capacity < 0x80000000u) capacity <<= 1;
+		return capacity / 4 * 3;
+	}
+
+	// Grow the table now, so that it can hold size entries without growing again
+	void reserve(unsigned int size) {
+		while ((u_int64_t)size * 4 > (u_int64_t)(mask + 1) * 3) grow();
+	}
+
+	inline const_iterator begin() const { return const_iterator(slots, slots + mask + 1); }
+	inline const_iterator end() const { return const_iterator(slots + mask + 1, slots + mask + 1); }
+
+	// Start loading the bucket where a key with the given hash would be
+	inline void prefetch(u_int32_t hash) const {
+		__builtin_prefetch(&slots[hash & mask], 1);
+	}
+
+	VALUE * find(const KEY &key, u_int32_t hash) {
+		Slot * slot = lookup(key, hash);
+		if (!slot->used) return NULL;
+		slot->referenced = true;
+		return &slot->entry.second;
+	}
+
+	inline VALUE * find(const KEY &key) {
+		return find(key, key.hash());
+	}
+
+	// Find the value for a key, adding a default constructed one if missing
+	inline VALUE & insert(const KEY &key, u_int32_t hash, bool *created = NULL) {
+		return insertAt(lookup(key, hash), key, hash, created);
+	}
+
+	// Same, with the table kept to limit entries (0 for no limit): if the key
+	// is missing and the table is full, an entry is evict()ed first. Keys
+	// already in the table cost a single lookup.
+	template <typename VISITOR>
+	VALUE & insert(const KEY &key, u_int32_t hash, unsigned int limit, VISITOR &visitor, bool *created = NULL) {
+		Slot * slot = lookup(key, hash);
+		if (!slot->used && limit && count >= limit && evict(visitor))
+			slot = lookup(key, hash); // Entries may have been shifted into the chain
+		return insertAt(slot, key, hash, created);
+	}
+
+	inline VALUE & operator[](const KEY &key) {
+		return insert(key, key.hash());
+	}
+
+	bool erase(const KEY &key, u_int32_t hash) {
+		Slot * slot = lookup(key, hash);
+		if (!slot->used) return false;
+		remove(slot - slots);
+		return true;
+	}
+
+	inline bool erase(const KEY &key) {
+		return erase(key, key.hash());
+	}
+
+	void clear() {
+		for (unsigned int i = 0; i <= mask; i++) slots[i].used = false;
+		count = 0;
+		hand = clock = 0;
+	}
+
+	// Look at up to budget slots, starting where the previous call stopped,
+	// and remove the entries for which visitor(key, value) returns true. This
+	// spreads a full scan of the table (e.g. looking for expired connections)
+	// over many calls. Returns the number of entries removed.
+	template <typename VISITOR>
+	unsigned int sweep(unsigned int budget, VISITOR &visitor) {
+		unsigned int removed = 0;
+		while (budget-- && count) {
+			Slot & slot = slots[hand];
+			if (slot.used && visitor(slot.entry.first, slot.entry.second)) {
+				remove(hand);
+				removed++;
+				continue; // Another entry may have been shifted into this slot
+			}
+			hand = (hand + 1) & mask;
+		}
+		return removed;
+	}
+
+	// Call visitor(key, value) for the entries in the next budget slots from
+	// position, and move position past them. Returns true, with position back
+	// to 0, once the end of the table is reached. Entries inserted or removed
+	// in between calls may be seen twice or missed.
+	template <typename VISITOR>
+	bool scan(unsigned int &position, unsigned int budget, VISITOR &visitor) const {
+		unsigned int end = position + budget;
+		if (end > mask + 1 || end < position) end = mask + 1;
+		for (unsigned int i = position; i < end; i++) {
+			if (slots[i].used) visitor(slots[i].entry.first, slots[i].entry.second);
+		}
+		position = (end > mask) ? 0 : end;
+		return position == 0;
+	}
+
+	// Remove one entry to make room for another. visitor.expendable(key, value)
+	// tells whether an entry should go before any other (it's looked for in
+	// the next EVICTION_WINDOW entries of the clock); otherwise the first
+	// entry not referenced since the hand last passed is taken.
+	// visitor.evicted(key, value) is called for the victim before removing it.
+	// Returns false if the table is empty.
+	template <typename VISITOR>
+	bool evict(VISITOR &visitor) {
+		if (!count) return false;
+		unsigned int victim = mask + 1;
+		unsigned int seen = 0;
+		while (1) {
+			Slot & slot = slots[clock];
+			if (slot.used) {
+				if (seen < EVICTION_WINDOW && visitor.expendable(slot.entry.first, slot.entry.second)) {
+					victim = clock;
+					break;
+				}
+				if (!slot.referenced && victim > mask) {
+					victim = clock;
+					if (seen >= EVICTION_WINDOW) break;
+				}
+				slot.referenced = false;
+				seen++;
+			}
+			if (victim <= mask && seen >= EVICTION_WINDOW) break;
+			clock = (clock + 1) & mask;
+		}
+		visitor.evicted(slots[victim].entry.first, slots[victim].entry.second);
+		remove(victim);
+		clock = victim; // Another entry may have been shifted into this slot
+		return true;
+	}
+
+private:
+	inline Slot * lookup(const KEY &key, u_int32_t hash) const {
+		unsigned int i = hash & mask;
+		while (slots[i].used) {
+			if (slots[i].hash == hash && slots[i].entry.first == key)
+				break;
+			i = (i + 1) & mask;
+		}
+		return &slots[i];
+	}
+
+	// slot is where lookup() stopped for the key
+	VALUE & insertAt(Slot * slot, const KEY &key, u_int32_t hash, bool *created) {
+		if (created) *created = !slot->used;
+		if (slot->used) {
+			slot->referenced = true;
+			return slot->entry.second;
+		}
+		if ((count + 1) * 4 > (mask + 1) * 3) { // Keep load factor under 3/4
+			grow();
+			slot = lookup(key, hash);
+		}
+		slot->entry.first = key;
+		slot->entry.second = VALUE();
+		slot->hash = hash;
+		slot->used = true;
+		slot->referenced = true;
+		count++;
+		return slot->entry.second;
+	}
+
+	// Backward shift deletion: no tombstones are ever left in the table
+	void remove(unsigned int i) {
+		unsigned int j = i;
+		while (1) {
+			j = (j + 1) & mask;
+			if (!slots[j].used) break;
+			unsigned int k = slots[j].hash & mask; // Home bucket of the entry in j
+			if ( (j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)) ) {
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+		slots[i].used = false;
+		count--;
+	}
+
+	void allocate(unsigned int capacity) {
+		slots = new Slot[capacity];
+		for (unsigned int i = 0; i < capacity; i++) slots[i].used = slots[i].referenced = false;
+		mask = capacity - 1;
+	}
+
+	void grow() {
+		Slot * old_slots = slots;
+		unsigned int old_capacity = mask + 1;
+		allocate(old_capacity * 2);
+		for (unsigned int i = 0; i < old_capacity; i++) {
+			if (!old_slots[i].used) continue;
+			unsigned int j = old_slots[i].hash & mask;
+			while (slots[j].used) j = (j + 1) & mask;
+			slots[j] = old_slots[i];
+		}
+		delete[] old_slots;
+		clock = 0;
+	}
+
+	Slot * slots;
+	unsigned int mask;
+	unsigned int count;
+	unsigned int hand;  // Next slot to be looked at by sweep()
+	unsigned int clock; // Next slot to be looked at by evict()
+
+	// Can't be copied
+	FlowTable(const FlowTable &other);
+	FlowTable &operator=(const FlowTable &other);
+};
+
+} // namespace filter
+
+#endif // FLOW_TABLE_H_4E67EEC0_CBD6_11F1_A596_02FC00000001_
@@ -22,6 +22,9 @@
 // THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "headers.h"
+#include "dns.h"
+#include "tls.h"
+#include "checksum.h"
 
 #include <iostream>
 #include <iomanip>
@@ -120,36 +123,12 @@ static void printRawData (std::ostream& out, const void * pointer, int size)
 
 // Basic Types
 
-inline MacAddress::MacAddress() {
-	memset(address, 0, sizeof(address));
-}
-
-inline MacAddress::MacAddress(const unsigned char * v) {
-	memcpy(address, v, sizeof(address));
-}
-
 const unsigned char * MacAddress::operator=(const unsigned char * v) {
 	memcpy(address, v, sizeof(address));
 	return address;
 }
 
-bool MacAddress::less (const unsigned char * other, bool equal) const {
-	for (int i = 0; i < ETH_ALEN ; i++)
-		if (address[i] < other[i])
-			return true;
-		else if (address[i] > other[i])
-			return false;
-	return equal;
-}
-
-bool MacAddress::equal (const unsigned char * other) const {
-	for (int i = ETH_ALEN-1; i >= 0 ; i--)
-		if (address[i] != other[i])
-			return false;
-	return true;
-}
-
-std::ostream& operator<< (std::ostream& out, const MacAddress & v) {
+std::ostream& filter::operator<< (std::ostream& out, const MacAddress & v) {
 	const unsigned char *address = v;
 	printWithFormat(out, "%.2X:%.2X:%.2X:%.2X:%.2X:%.2X",
 		address[0], address[1], address[2], address[3], address[4], address[5] );
@@ -171,10 +150,10 @@ inline Ip6Address::Ip6Address(const struct in6_addr & a) {
 	memcpy(&address, &a, sizeof(address));
 }
 
-std::ostream& operator<< (std::ostream& out, const Ip6Address & v) {
+std::ostream& filter::operator<< (std::ostream& out, const Ip6Address & v) {
 	const uint16_t *bytes = ( const uint16_t* ) &v.getAddress();
-	printWithFormat( out, "%x:%x:%x:%x:%x:%x:%x:%x", bytes[0], bytes[1], bytes[2],
-		bytes[3], bytes[4], bytes[5], bytes[6], bytes[7] );
+	printWithFormat( out, "%x:%x:%x:%x:%x:%x:%x:%x", ntohs(bytes[0]), ntohs(bytes[1]), ntohs(bytes[2]),
+		ntohs(bytes[3]), ntohs(bytes[4]), ntohs(bytes[5]), ntohs(bytes[6]), ntohs(bytes[7]) );
 	return out;
 }
 
@@ -189,10 +168,64 @@ void AbstractHeader::print(std::ostream& where) const {
 	printRawData(where, data, data_len);
 }
 
-unsigned int AbstractHeader::next_id = 0;
+// Dissector Registry
 
-template<typename DERIVED>
-unsigned int HeaderAux<DERIVED>::id = 0;
+HeaderFactory DissectorRegistry::ethertypes[65536];
+HeaderFactory DissectorRegistry::ip_protocols[256];
+HeaderFactory DissectorRegistry::tcp_ports[65536];
+HeaderFactory DissectorRegistry::udp_ports[65536];
+
+void DissectorRegistry::registerEthertype(u_int16_t ethertype, HeaderFactory factory) {
+	ethertypes[ethertype] = factory;
+}
+
+void DissectorRegistry::registerIpProtocol(u_int8_t protocol, HeaderFactory factory) {
+	ip_protocols[protocol] = factory;
+}
+
+void DissectorRegistry::registerTcpPort(u_int16_t port, HeaderFactory factory) {
+	tcp_ports[port] = factory;
+}
+
+void DissectorRegistry::registerUdpPort(u_int16_t port, HeaderFactory factory) {
+	udp_ports[port] = factory;
+}
+
+HeaderFactory DissectorRegistry::getTcpPorts(u_int16_t sport, u_int16_t dport) {
+	HeaderFactory low = tcp_ports[sport < dport ? sport : dport];
+	return low ? low : tcp_ports[sport < dport ? dport : sport];
+}
+
+HeaderFactory DissectorRegistry::getUdpPorts(u_int16_t sport, u_int16_t dport) {
+	HeaderFactory low = udp_ports[sport < dport ? sport : dport];
+	return low ? low : udp_ports[sport < dport ? dport : sport];
+}
+
+// The tables are plain zero initialized arrays, so they can be used from
+// static constructors in other files. Dissectors registered that way must not
+// be overwritten by the built in ones.
+static struct BuiltinDissectors {
+	BuiltinDissectors() {
+		if (!DissectorRegistry::getEthertype(ETH_P_IP))
+			DissectorRegistry::registerEthertype(ETH_P_IP, IpHeader::createHeader);
+		if (!DissectorRegistry::getEthertype(ETH_P_ARP))
+			DissectorRegistry::registerEthertype(ETH_P_ARP, ArpHeader::createHeader);
+
+		if (!DissectorRegistry::getIpProtocol(IPPROTO_ICMP))
+			DissectorRegistry::registerIpProtocol(IPPROTO_ICMP, IcmpHeader::createHeader);
+		if (!DissectorRegistry::getIpProtocol(IPPROTO_IGMP))
+			DissectorRegistry::registerIpProtocol(IPPROTO_IGMP, IgmpHeader::createHeader);
+		if (!DissectorRegistry::getIpProtocol(IPPROTO_TCP))
+			DissectorRegistry::registerIpProtocol(IPPROTO_TCP, TcpHeader::createHeader);
+		if (!DissectorRegistry::getIpProtocol(IPPROTO_UDP))
+			DissectorRegistry::registerIpProtocol(IPPROTO_UDP, UdpHeader::createHeader);
+
+		if (!DissectorRegistry::getUdpPort(53))
+			DissectorRegistry::registerUdpPort(53, DnsHeader::createHeader);
+		if (!DissectorRegistry::getTcpPort(443))
+			DissectorRegistry::registerTcpPort(443, TlsHeader::createHeader);
+	}
+} builtin_dissectors;
 
 // Ethernet Header
 
@@ -202,14 +235,9 @@ AbstractHeader * EthernetHeader::createNextHeader() const {
 	const unsigned char * payload = data + ethhdrlen;
 	unsigned int payload_size = data_len - ethhdrlen;
 
-	switch (htons(eth->h_proto)) {
-		case ETH_P_IP: // IP Protocol
-			return IpHeader::createHeader(payload, payload_size);
-		case ETH_P_ARP: // ARP Protocol
-			return ArpHeader::createHeader(payload, payload_size);
-		default:
-			return UnknownHeader::createHeader(payload, payload_size);
-	}
+	HeaderFactory factory = DissectorRegistry::getEthertype(ntohs(eth->h_proto));
+	if (!factory) factory = UnknownHeader::createHeader;
+	return factory(payload, payload_size);
 }
 
 void EthernetHeader::print(std::ostream& where) const {
@@ -234,7 +262,7 @@ void EthernetHeader::print(std::ostream& where) const {
 		default:         where << "  (Unknown)" <<  std::endl;
 	}
 	where << "Ethernet Header (Raw Data)" << std::endl;
-	printRawData(where, &eth, ethhdrlen);
+	printRawData(where, eth, ethhdrlen);
 }
 
 // IP Header
@@ -245,27 +273,9 @@ AbstractHeader * IpHeader::createNextHeader() const {
 	const unsigned char * payload = data + iphdrlen;
 	unsigned int payload_size = data_len - iphdrlen;
 
-	switch (iph->protocol) {
-		case 1: // ICMP Protocol
-			return IcmpHeader::createHeader(payload, payload_size);
-			break;
-
-		case 2: // IGMP Protocol
-			return IgmpHeader::createHeader(payload, payload_size);
-			break;
-
-		case 6: // TCP Protocol
-			return TcpHeader::createHeader(payload, payload_size);
-			break;
-
-		case 17: // UDP Protocol
-			return UdpHeader::createHeader(payload, payload_size);
-			break;
-
-		default: // Other Protocols
-			return UnknownHeader::createHeader(payload, payload_size);
-			break;
-	}
+	HeaderFactory factory = DissectorRegistry::getIpProtocol(iph->protocol);
+	if (!factory) factory = UnknownHeader::createHeader;
+	return factory(payload, payload_size);
 }
 
 void IpHeader::print(std::ostream& where) const {
@@ -292,12 +302,15 @@ void IpHeader::print(std::ostream& where) const {
 	//where << "   |-More Fragment Field   : " <<(unsigned int)iphdr->ip_more_fragment << std::endl;
 	where << "   |-TTL      : " << (unsigned int)iph->ttl << std::endl;
 	where << "   |-Protocol : " << (unsigned int)iph->protocol << std::endl;
-	where << "   |-Checksum : " << ntohs(iph->check) << std::endl;
+	where << "   |-Checksum : " << ntohs(iph->check);
+	if (iphdrlen >= sizeof(struct iphdr) && iphdrlen <= data_len && checksumFold(checksumAdd(iph, iphdrlen)) != 0xFFFF)
+		where << " (bad)";
+	where << std::endl;
 	where << "   |-Source IP        : " << inet_ntoa(src.sin_addr) << std::endl;
 	where << "   |-Destination IP   : " << inet_ntoa(dst.sin_addr) << std::endl;
 
 	where << "IP Header (Raw Data)" << std::endl;
-	printRawData(where, &iph, iphdrlen);
+	printRawData(where, iph, iphdrlen);
 }
 
 // TCP Header
@@ -308,7 +321,9 @@ AbstractHeader * TcpHeader::createNextHeader() const {
 	const unsigned char * payload = data + tcphdrlen;
 	unsigned int payload_size = data_len - tcphdrlen;
 	if (!payload_size) return NULL;
-	else return PayloadData::createHeader(payload, payload_size);
+	HeaderFactory factory = DissectorRegistry::getTcpPorts(ntohs(tcph->source), ntohs(tcph->dest));
+	if (!factory) factory = PayloadData::createHeader;
+	return factory(payload, payload_size);
 }
 
 void TcpHeader::print(std::ostream& where) const {
@@ -335,18 +350,20 @@ void TcpHeader::print(std::ostream& where) const {
 	where << "   |-Urgent Pointer : " << tcph->urg_ptr << std::endl;
 
 	where << "TCP Header (Raw Data)" << std::endl;
-	printRawData(where, &tcph, tcphdrlen);
+	printRawData(where, tcph, tcphdrlen);
 }
 
 // UDP Header
 
 AbstractHeader * UdpHeader::createNextHeader() const {
-	//const struct udphdr *udph = (const struct udphdr*) data;
+	const struct udphdr *udph = (const struct udphdr*) data;
 	unsigned short udphdrlen = sizeof(struct udphdr);
 	const unsigned char * payload = data + udphdrlen;
 	unsigned int payload_size = data_len - udphdrlen;
 	if (!payload_size) return NULL;
-	else return PayloadData::createHeader(payload, payload_size);
+	HeaderFactory factory = DissectorRegistry::getUdpPorts(ntohs(udph->source), ntohs(udph->dest));
+	if (!factory) factory = PayloadData::createHeader;
+	return factory(payload, payload_size);
 }
 
 void UdpHeader::print(std::ostream& where) const {
@@ -360,7 +377,7 @@ void UdpHeader::print(std::ostream& where) const {
 	where << "   |-UDP Checksum     : " << ntohs(udph->check) << std::endl;
 
 	where << "UDP Header (Raw Data)" << std::endl;
-	printRawData(where, &udph, udphdrlen);
+	printRawData(where, udph, udphdrlen);
 }
 
 // ICMP Header
@@ -404,7 +421,7 @@ void IcmpHeader::print(std::ostream& where) const {
 	//where <<  "   |-Sequence : " << ntohs(icmph->sequence) << std::endl;
 
 	where << "ICMP Header (Raw Data)" << std::endl;
-	printRawData(where, &icmph, icmphdrlen);
+	printRawData(where, icmph, icmphdrlen);
 }
 
 void ArpHeader::print(std::ostream& where) const {
@@ -467,8 +484,94 @@ void ArpEthIpHeader::print(std::ostream& where) const {
 		eth_ipv4->ar_tha[3], eth_ipv4->ar_tha[4], eth_ipv4->ar_tha[5] );
 	where << std::endl;
 
-	printWithFormat(where, "   |-Sender IP        : %u.%u.%u.%u",
+	printWithFormat(where, "   |-Target IP        : %u.%u.%u.%u",
 		eth_ipv4->ar_tpa[0], eth_ipv4->ar_tpa[1], eth_ipv4->ar_tpa[2], eth_ipv4->ar_tpa[3]);
 	where << std::endl;
 }
 
+
+// DNS Header
+
+AbstractHeader * DnsHeader::createHeader(const void * buffer, unsigned int len) {
+	if (len < DNS_HEADER_LEN) return new PayloadData(buffer, len);
+	return new DnsHeader(buffer, len);
+}
+
+void DnsHeader::print(std::ostream& where) const {
+	const struct dnshdr * dnsh = (const struct dnshdr *) data;
+
+	where << "DNS Header" << std::endl;
+	where << "   |-Identification   : " << ntohs(dnsh->id) << std::endl;
+	where << "   |-Type             : " << (dnsIsResponse(dnsh) ? "Response" : "Query") << std::endl;
+	where << "   |-Opcode           : " << dnsOpcode(dnsh) << std::endl;
+	where << "   |-Response Code    : " << dnsRcode(dnsh) << "  (" << dnsRcodeName(dnsRcode(dnsh)) << ")" << std::endl;
+	where << "   |-Questions        : " << ntohs(dnsh->qdcount) << std::endl;
+	where << "   |-Answers          : " << ntohs(dnsh->ancount) << std::endl;
+	where << "   |-Authority        : " << ntohs(dnsh->nscount) << std::endl;
+	where << "   |-Additional       : " << ntohs(dnsh->arcount) << std::endl;
+
+	unsigned int offset = DNS_HEADER_LEN;
+	for (unsigned int i = 0; i < ntohs(dnsh->qdcount); i++) {
+		unsigned int name = offset;
+		if (!DnsNameReader::skip(data, data_len, offset) || offset + 4 > data_len) {
+			where << "   |-(Malformed)" << std::endl;
+			return;
+		}
+		unsigned int type = data[offset] << 8 | data[offset + 1];
+		offset += 4;
+		where << "   |-Question         : " << DnsNameReader::toString(data, data_len, name)
+			<< "  (" << dnsTypeName(type) << ")" << std::endl;
+	}
+
+	for (unsigned int i = 0; i < ntohs(dnsh->ancount); i++) {
+		unsigned int name = offset;
+		if (!DnsNameReader::skip(data, data_len, offset) || offset + 10 > data_len) {
+			where << "   |-(Malformed)" << std::endl;
+			return;
+		}
+		unsigned int type = data[offset] << 8 | data[offset + 1];
+		unsigned int ttl = data[offset + 4] << 24 | data[offset + 5] << 16 | data[offset + 6] << 8 | data[offset + 7];
+		unsigned int rdlength = data[offset + 8] << 8 | data[offset + 9];
+		offset += 10;
+		if (offset + rdlength > data_len) {
+			where << "   |-(Malformed)" << std::endl;
+			return;
+		}
+
+		where << "   |-Answer           : " << DnsNameReader::toString(data, data_len, name)
+			<< "  (" << dnsTypeName(type) << ", TTL " << ttl << ")";
+		if (type == 1 && rdlength == 4) {
+			printWithFormat(where, " %u.%u.%u.%u", data[offset], data[offset + 1], data[offset + 2], data[offset + 3]);
+		} else if (type == 28 && rdlength == 16) {
+			where << " " << Ip6Address(*(const struct in6_addr *)(data + offset));
+		} else if (type == 2 || type == 5 || type == 12) {
+			where << " " << DnsNameReader::toString(data, data_len, offset);
+		}
+		where << std::endl;
+		offset += rdlength;
+	}
+}
+
+// TLS Header
+
+AbstractHeader * TlsHeader::createHeader(const void * buffer, unsigned int len) {
+	TlsClientHello hello;
+	if (tlsParseClientHello((const unsigned char *)buffer, len, hello) == TLS_NOT_HELLO)
+		return new PayloadData(buffer, len);
+	return new TlsHeader(buffer, len);
+}
+
+void TlsHeader::print(std::ostream& where) const {
+	TlsClientHello hello;
+	int result = tlsParseClientHello(data, data_len, hello);
+
+	where << "TLS ClientHello" << std::endl;
+	printWithFormat(where, "   |-Version          : %u.%u", hello.version >> 8, hello.version & 0xFF);
+	where << std::endl;
+	if (hello.server_name)
+		where << "   |-Server Name      : " << std::string((const char *)hello.server_name, hello.server_name_len) << std::endl;
+	if (hello.alpn)
+		where << "   |-Protocol         : " << std::string((const char *)hello.alpn, hello.alpn_len) << std::endl;
+	if (result == TLS_HELLO_PARTIAL)
+		where << "   |-(Continues in the next segment)" << std::endl;
+}
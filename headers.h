@@ -27,6 +27,8 @@
 #include <iostream>
 #include <typeinfo>
 
+#include <string.h>
+#include <arpa/inet.h>
 #include <net/ethernet.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/udp.h>
@@ -38,16 +40,31 @@ namespace filter {
 
 // Basic Types
 
+// MAC address packed in the low 48 bits of an integer, first byte highest,
+// so that the integers compare like the addresses do
+inline u_int64_t macKey(const unsigned char * mac) {
+	u_int32_t high;
+	u_int16_t low;
+	memcpy(&high, mac, 4);
+	memcpy(&low, mac + 4, 2);
+	return (u_int64_t)ntohl(high) << 16 | ntohs(low);
+}
+
 class MacAddress {
 private: 
 	unsigned char address[ETH_ALEN];
 public:
-	inline MacAddress();
-	inline MacAddress(const unsigned char * v);
+	inline MacAddress() { memset(address, 0, sizeof(address)); }
+	inline MacAddress(const unsigned char * v) { memcpy(address, v, sizeof(address)); }
 	inline operator const unsigned char * () const { return address; }
 	const unsigned char * operator=(const unsigned char * v);
-	bool less (const unsigned char * other, bool equal) const;
-	bool equal (const unsigned char * other) const;
+	inline bool less (const unsigned char * other, bool equal) const {
+		u_int64_t a = macKey(address), b = macKey(other);
+		return a < b || (equal && a == b);
+	}
+	inline bool equal (const unsigned char * other) const {
+		return macKey(address) == macKey(other);
+	}
 	inline bool operator< (const unsigned char * other) const {
 		return less (other, false);
 	}
@@ -159,6 +176,9 @@ public:
 		return next;
 	}
 
+	inline const unsigned char * getData() const { return data; }
+	inline unsigned int getDataLength() const { return data_len; }
+
 	// Extract relevant info from headers
 	virtual const unsigned char * getMacAddress() const { return NULL; }
 	virtual const in_addr_t getIpAddress() const { return 0; }
@@ -172,8 +192,6 @@ protected:
 	AbstractHeader * prev;
 	AbstractHeader * next;
 
-	static unsigned int next_id;
-
 private:
 	// Can't be copied
 	AbstractHeader(const AbstractHeader &other);
@@ -185,17 +203,30 @@ inline std::ostream& operator<< (std::ostream& out, const AbstractHeader& hd) {
 	return out;
 }
 
-template <typename DERIVED>
+// Type IDs of the headers, fixed at compile time
+
+enum {
+	UNKNOWN_HEADER_ID = 1,
+	ETHERNET_HEADER_ID,
+	IP_HEADER_ID,
+	TCP_HEADER_ID,
+	UDP_HEADER_ID,
+	ICMP_HEADER_ID,
+	IGMP_HEADER_ID,
+	ARP_HEADER_ID,
+	PAYLOAD_DATA_ID,
+	DNS_HEADER_ID,
+	TLS_HEADER_ID,
+};
+
+template <typename DERIVED, unsigned int TYPE_ID>
 class HeaderAux : public AbstractHeader {
 public:
 	inline HeaderAux(const void * buffer, unsigned int len)
-			: AbstractHeader(buffer, len) {
-		if (id ==0) { id = ++next_id; }
-	}
+			: AbstractHeader(buffer, len) { }
 
 	static unsigned int ID() {
-		if (id ==0) { id = ++next_id; }
-		return id;
+		return TYPE_ID;
 	}
 
 	virtual const char * getTypeName() const {
@@ -203,19 +234,48 @@ public:
 	}
 
 	virtual unsigned int getTypeID() const {
-		return id;
+		return TYPE_ID;
 	}
+};
+
+// Dissectors for the next header, indexed by the values of the fields of the
+// previous one: ethertype, IP protocol, and TCP or UDP port for the
+// application layer. Registering a dissector replaces the one that was there
+// before. Registration is meant to be done at startup; lookups are a single
+// load from a table and don't need any locking.
+
+typedef AbstractHeader * (*HeaderFactory)(const void * buffer, unsigned int len);
+
+class DissectorRegistry {
+public:
+	static void registerEthertype(u_int16_t ethertype, HeaderFactory factory);
+	static void registerIpProtocol(u_int8_t protocol, HeaderFactory factory);
+	static void registerTcpPort(u_int16_t port, HeaderFactory factory);
+	static void registerUdpPort(u_int16_t port, HeaderFactory factory);
+
+	// Return NULL if there is no dissector registered
+	static inline HeaderFactory getEthertype(u_int16_t ethertype) { return ethertypes[ethertype]; }
+	static inline HeaderFactory getIpProtocol(u_int8_t protocol) { return ip_protocols[protocol]; }
+	static inline HeaderFactory getTcpPort(u_int16_t port) { return tcp_ports[port]; }
+	static inline HeaderFactory getUdpPort(u_int16_t port) { return udp_ports[port]; }
+
+	// Look for an application layer dissector: the lowest port is tried first
+	static HeaderFactory getTcpPorts(u_int16_t sport, u_int16_t dport);
+	static HeaderFactory getUdpPorts(u_int16_t sport, u_int16_t dport);
 
 private:
-	static unsigned int id;
+	static HeaderFactory ethertypes[65536];
+	static HeaderFactory ip_protocols[256];
+	static HeaderFactory tcp_ports[65536];
+	static HeaderFactory udp_ports[65536];
 };
 
 // Headers for different protocols
 
-class EthernetHeader : public HeaderAux<EthernetHeader> {
+class EthernetHeader : public HeaderAux<EthernetHeader, ETHERNET_HEADER_ID> {
 public:
 	EthernetHeader(const void * buffer, unsigned int len)
-			: HeaderAux<EthernetHeader>(buffer, len) { }
+			: HeaderAux<EthernetHeader, ETHERNET_HEADER_ID>(buffer, len) { }
 	virtual const char * getHeaderName() const { return "Ethernet"; }
 	virtual const unsigned int getLayers() const { return PHYSICAL_LAYER + DATA_LINK_LAYER; }
 	virtual void print(std::ostream& where) const;
@@ -226,24 +286,27 @@ protected:
 	virtual AbstractHeader * createNextHeader() const;
 };
 
-class IpHeader : public HeaderAux<IpHeader> {
+class IpHeader : public HeaderAux<IpHeader, IP_HEADER_ID> {
 public:
 	IpHeader(const void * buffer, unsigned int len)
-			: HeaderAux<IpHeader>(buffer, len) { }
+			: HeaderAux<IpHeader, IP_HEADER_ID>(buffer, len) { }
 	virtual const char * getHeaderName() const { return "IP"; }
 	virtual const unsigned int getLayers() const { return NETWORK_LAYER; }
 	virtual void print(std::ostream& where) const;
 	static AbstractHeader * createHeader(const void * buffer, unsigned int len) {
 		return new IpHeader(buffer, len);
 	}
+	// Network byte order, e.g. for PrefixTable::lookup()
+	inline in_addr_t getSourceAddress() const { return ((const struct iphdr *)data)->saddr; }
+	inline in_addr_t getDestinationAddress() const { return ((const struct iphdr *)data)->daddr; }
 protected:
 	virtual AbstractHeader * createNextHeader() const;
 };
 
-class TcpHeader : public HeaderAux<TcpHeader> {
+class TcpHeader : public HeaderAux<TcpHeader, TCP_HEADER_ID> {
 public:
 	TcpHeader(const void * buffer, unsigned int len)
-			: HeaderAux<TcpHeader>(buffer, len) { }
+			: HeaderAux<TcpHeader, TCP_HEADER_ID>(buffer, len) { }
 	virtual const char * getHeaderName() const { return "TCP"; }
 	virtual const unsigned int getLayers() const { return TRANSPORT_LAYER; }
 	virtual void print(std::ostream& where) const;
@@ -254,10 +317,10 @@ protected:
 	virtual AbstractHeader * createNextHeader() const;
 };
 
-class UdpHeader : public HeaderAux<UdpHeader> {
+class UdpHeader : public HeaderAux<UdpHeader, UDP_HEADER_ID> {
 public:
 	UdpHeader(const void * buffer, unsigned int len)
-			: HeaderAux<UdpHeader>(buffer, len) { }
+			: HeaderAux<UdpHeader, UDP_HEADER_ID>(buffer, len) { }
 	virtual const char * getHeaderName() const { return "UDP"; }
 	virtual const unsigned int getLayers() const { return TRANSPORT_LAYER; }
 	virtual void print(std::ostream& where) const;
@@ -268,10 +331,10 @@ protected:
 	virtual AbstractHeader * createNextHeader() const;
 };
 
-class IcmpHeader : public HeaderAux<IcmpHeader> {
+class IcmpHeader : public HeaderAux<IcmpHeader, ICMP_HEADER_ID> {
 public:
 	IcmpHeader(const void * buffer, unsigned int len)
-			: HeaderAux<IcmpHeader>(buffer, len) { }
+			: HeaderAux<IcmpHeader, ICMP_HEADER_ID>(buffer, len) { }
 	virtual const char * getHeaderName() const { return "ICMP"; }
 	virtual const unsigned int getLayers() const { return NETWORK_LAYER; }
 	virtual void print(std::ostream& where) const;
@@ -282,10 +345,10 @@ protected:
 	virtual AbstractHeader * createNextHeader() const;
 };
 
-class IgmpHeader : public HeaderAux<IgmpHeader> {
+class IgmpHeader : public HeaderAux<IgmpHeader, IGMP_HEADER_ID> {
 public:
 	IgmpHeader(const void * buffer, unsigned int len)
-			: HeaderAux<IgmpHeader>(buffer, len) { }
+			: HeaderAux<IgmpHeader, IGMP_HEADER_ID>(buffer, len) { }
 	virtual const char * getHeaderName() const { return "IGMP"; }
 	virtual const unsigned int getLayers() const { return NETWORK_LAYER; }
 	static AbstractHeader * createHeader(const void * buffer, unsigned int len) {
@@ -293,10 +356,10 @@ public:
 	}
 };
 
-class ArpHeader : public HeaderAux<ArpHeader> {
+class ArpHeader : public HeaderAux<ArpHeader, ARP_HEADER_ID> {
 public:
 	ArpHeader(const void * buffer, unsigned int len)
-			: HeaderAux<ArpHeader>(buffer, len) { }
+			: HeaderAux<ArpHeader, ARP_HEADER_ID>(buffer, len) { }
 	virtual const char * getHeaderName() const { return "ARP"; }
 	virtual const unsigned int getLayers() const { return DATA_LINK_LAYER + NETWORK_LAYER; }
 	virtual void print(std::ostream& where) const;
@@ -319,10 +382,10 @@ public:
 	virtual void print(std::ostream& where) const;
 };
 
-class UnknownHeader : public HeaderAux<UnknownHeader> {
+class UnknownHeader : public HeaderAux<UnknownHeader, UNKNOWN_HEADER_ID> {
 public:
 	UnknownHeader(const void * buffer, unsigned int len)
-			: HeaderAux<UnknownHeader>(buffer, len) { }
+			: HeaderAux<UnknownHeader, UNKNOWN_HEADER_ID>(buffer, len) { }
 	virtual const char * getHeaderName() const { return "Unknown"; }
 	virtual const unsigned int getLayers() const { return 0; }
 	static AbstractHeader * createHeader(const void * buffer, unsigned int len) {
@@ -330,10 +393,10 @@ public:
 	}
 };
 
-class PayloadData : public HeaderAux<PayloadData> {
+class PayloadData : public HeaderAux<PayloadData, PAYLOAD_DATA_ID> {
 public:
 	PayloadData(const void * buffer, unsigned int len)
-			: HeaderAux<PayloadData>(buffer, len) { }
+			: HeaderAux<PayloadData, PAYLOAD_DATA_ID>(buffer, len) { }
 	virtual const char * getHeaderName() const { return "Data"; }
 	virtual const unsigned int getLayers() const { return PAYLOAD_DATA; }
 	static AbstractHeader * createHeader(const void * buffer, unsigned int len) {
@@ -341,6 +404,27 @@ public:
 	}
 };
 
+class DnsHeader : public HeaderAux<DnsHeader, DNS_HEADER_ID> {
+public:
+	DnsHeader(const void * buffer, unsigned int len)
+			: HeaderAux<DnsHeader, DNS_HEADER_ID>(buffer, len) { }
+	virtual const char * getHeaderName() const { return "DNS"; }
+	virtual const unsigned int getLayers() const { return APPLICATION_LAYER; }
+	virtual void print(std::ostream& where) const;
+	static AbstractHeader * createHeader(const void * buffer, unsigned int len);
+};
+
+// Only the start of a ClientHello is dissected, other segments are payload data
+class TlsHeader : public HeaderAux<TlsHeader, TLS_HEADER_ID> {
+public:
+	TlsHeader(const void * buffer, unsigned int len)
+			: HeaderAux<TlsHeader, TLS_HEADER_ID>(buffer, len) { }
+	virtual const char * getHeaderName() const { return "TLS"; }
+	virtual const unsigned int getLayers() const { return APPLICATION_LAYER; }
+	virtual void print(std::ostream& where) const;
+	static AbstractHeader * createHeader(const void * buffer, unsigned int len);
+};
+
 } // namespace filter
 
 #endif // HEADERS_H_25E85D1E_4C87_11E2_BB32_7BDCB76BDF0B_
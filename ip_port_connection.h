@@ -31,6 +31,25 @@
 
 namespace filter {
 
+// Hashing of connection endpoints. The connection hash is the sum of the
+// hashes of both endpoints, so it doesn't depend on the packet direction
+// and can be computed without ordering the endpoints first.
+
+inline u_int32_t hashMix32(u_int32_t h) {
+	h ^= h >> 16; h *= 0x85EBCA6B;
+	h ^= h >> 13; h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	return h;
+}
+
+inline u_int32_t hashEndpoint(u_int32_t addr, u_int32_t port) {
+	return hashMix32(addr ^ (port * 0x9E3779B1));
+}
+
+inline u_int32_t hashConnection(u_int32_t saddr, u_int32_t sport, u_int32_t daddr, u_int32_t dport) {
+	return hashMix32(hashEndpoint(saddr, sport) + hashEndpoint(daddr, dport));
+}
+
 // IPv4 would be: IpPort<in_addr_t,u_int16_t>
 template <typename NETID, typename PORT>
 struct IpPort {
@@ -89,8 +108,15 @@ struct IpPortConnection {
 	IpPort<NETID, PORT> low;
 	IpPort<NETID, PORT> high;
 
+	IpPortConnection () {
+	}
+
 	IpPortConnection (const NETID &saddr, const PORT &sport, const NETID &daddr, const PORT &dport);
 
+	u_int32_t hash() const {
+		return hashConnection(low.addr, low.port, high.addr, high.port);
+	}
+
 	bool less (const IpPortConnection<NETID, PORT> &other, bool equal) const {
 		if ( low < other.low ) return true; // Check Lover ConnID First
 		if ( low > other.low ) return false;
@@ -21,15 +21,46 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
 // THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+// Asks for the device to sniff, then captures from it:
+//
+//   sniffer [-c CONFIG] [-s SOCKET]
+//
+// CONFIG is a configuration file (see config_reloader.h), read again on
+// SIGHUP. SOCKET is the path of a Unix domain socket for queries on the
+// connections (see flow_query.h), where "reload" also rereads CONFIG.
+
 #include "sniffer.h"
+#include "config_reloader.h"
 
 #include <pcap.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+static void usage(const char * program) {
+	fprintf(stderr, "Usage: %s [-c CONFIG] [-s SOCKET]\n", program);
+}
 
-int main()
+int main(int argc, char * argv[])
 {
+	const char * config_path = NULL;
+	const char * socket_path = NULL;
+	int option;
+	while ((option = getopt(argc, argv, "c:s:")) != -1) {
+		switch (option) {
+			case 'c': config_path = optarg; break;
+			case 's': socket_path = optarg; break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
 	pcap_if_t* alldevsp;
 	pcap_if_t* device;
 	char errbuf[100];
@@ -65,8 +96,34 @@ int main()
 	devname = devs[n];
 
 	filter::Sniffer sniffer;
+
+	// Settings are applied before the capture starts, and again on SIGHUP
+	filter::ConfigReloader * reloader = NULL;
+	if (config_path) {
+		reloader = new filter::ConfigReloader(sniffer, config_path);
+		if (!reloader->reload()) exit(1);
+		if (!reloader->start() || !reloader->handleSignals())
+			fprintf(stderr, "Can't reload %s on SIGHUP\n", config_path);
+	}
+
+	filter::FlowQueryServer * server = NULL;
+	if (socket_path) {
+		server = new filter::FlowQueryServer();
+		if (!server->open(socket_path)) {
+			fprintf(stderr, "Can't listen on %s\n", socket_path);
+			exit(1);
+		}
+		if (reloader) server->setReloadCallback(filter::ConfigReloader::requestReload, reloader);
+		server->start();
+		sniffer.setQueryServer(server);
+	}
+
 	sniffer.loop(devname);
 
+	sniffer.setQueryServer(NULL);
+	delete server;
+	delete reloader;
+
 	return 0;
 }
 
@@ -0,0 +1,108 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "neighbour_table.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include <arpa/inet.h>
+
+using namespace filter;
+
+static void printMac(std::ostream& out, u_int64_t mac) {
+	char text[18];
+	snprintf(text, sizeof(text), "%.2X:%.2X:%.2X:%.2X:%.2X:%.2X",
+		(unsigned int)(mac >> 40) & 0xFF, (unsigned int)(mac >> 32) & 0xFF, (unsigned int)(mac >> 24) & 0xFF,
+		(unsigned int)(mac >> 16) & 0xFF, (unsigned int)(mac >> 8) & 0xFF, (unsigned int)mac & 0xFF);
+	out << text;
+}
+
+static void printAddress(std::ostream& out, in_addr_t addr) {
+	char text[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &addr, text, sizeof(text));
+	out << text;
+}
+
+static bool byAddress(const NeighbourTable::Entry * a, const NeighbourTable::Entry * b) {
+	return ntohl(a->addr) < ntohl(b->addr);
+}
+
+// Neighbour Table
+
+NeighbourTable::NeighbourTable(unsigned int capacity) : count(0), changes(0), evictions(0) {
+	unsigned int size = PROBE_LIMIT;
+	while (size < capacity) size <<= 1;
+	entries = new Entry[size];
+	memset(entries, 0, sizeof(Entry) * size);
+	mask = size - 1;
+}
+
+NeighbourTable::~NeighbourTable() {
+	delete[] entries;
+}
+
+const NeighbourTable::Entry * NeighbourTable::find(in_addr_t addr) const {
+	u_int32_t i = hashMix32(addr) & mask;
+	for (unsigned int probe = 0; probe < PROBE_LIMIT; probe++, i = (i + 1) & mask) {
+		if (entries[i].addr == addr) return &entries[i];
+		if (!entries[i].addr) break;
+	}
+	return NULL;
+}
+
+void NeighbourTable::print(std::ostream& out) const {
+	std::vector<const Entry *> sorted;
+	sorted.reserve(count);
+	for (u_int32_t i = 0; i <= mask; i++) {
+		if (entries[i].addr) sorted.push_back(&entries[i]);
+	}
+	std::sort(sorted.begin(), sorted.end(), byAddress);
+
+	out << "Neighbours" << std::endl;
+	out << "   |-Addresses : " << count << " (" << evictions << " evicted)" << std::endl;
+	out << "   |-Changes   : " << changes << std::endl;
+	for (size_t i = 0; i < sorted.size(); i++) {
+		const Entry & entry = *sorted[i];
+		out << "   |-";
+		printAddress(out, entry.addr);
+		out << " : ";
+		printMac(out, entry.getMac());
+		out << ((entry.getSources() & FROM_ARP) ? " ARP" : "") << ((entry.getSources() & FROM_IP) ? " IP" : "");
+		if (entry.getChanges())
+			out << ", changed " << entry.getChanges() << " times";
+		out << std::endl;
+	}
+}
+
+void NeighbourTable::printChange(std::ostream& out, in_addr_t addr, u_int64_t previous_mac, u_int64_t mac, unsigned int source) {
+	out << "NEIGHBOUR ";
+	printAddress(out, addr);
+	out << " changed from ";
+	printMac(out, previous_mac);
+	out << " to ";
+	printMac(out, mac);
+	out << (source == FROM_ARP ? " (ARP)" : " (IP)") << std::endl;
+}
@@ -0,0 +1,137 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef NEIGHBOUR_TABLE_H_BCBEBF08_CBDF_11F1_959D_02FC00000001_
+#define NEIGHBOUR_TABLE_H_BCBEBF08_CBDF_11F1_959D_02FC00000001_
+
+#include "ip_port_connection.h"
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <iostream>
+
+namespace filter {
+
+// Results of NeighbourTable::update()
+enum {
+	NEIGHBOUR_NEW = 0,      // First time the address is seen (or it had been evicted)
+	NEIGHBOUR_SAME = 1,     // Seen again with the same MAC address
+	NEIGHBOUR_CHANGED = 2,  // Seen with another MAC address
+};
+
+// IPv4 to MAC address cache, learnt from ARP and from the source addresses
+// of the frames. Entries are 16 bytes, with the MAC address packed in an
+// integer (macKey(), headers.h) so that it's compared in one instruction,
+// and live in an open addressing table: an address is always found within
+// PROBE_LIMIT slots of its hash, and when those are all taken, the one seen
+// least recently is replaced. An update touches one or two cache lines and
+// never allocates, so it can be done for every frame.
+
+class NeighbourTable {
+public:
+	enum {
+		FROM_ARP = 0x01,  // Sender of an ARP request or reply
+		FROM_IP = 0x02,   // Source of an IP packet (for hosts behind a router, its MAC address)
+	};
+	enum { PROBE_LIMIT = 8 };
+
+	static const u_int64_t MAC_MASK = 0xFFFFFFFFFFFFull;
+
+	struct Entry {
+		u_int64_t mac;        // macKey() in the low 48 bits, then FROM_* and the number of changes
+		in_addr_t addr;       // Network byte order, 0 if the slot is free
+		u_int32_t last_seen;  // Seconds
+
+		inline u_int64_t getMac() const { return mac & MAC_MASK; }
+		inline unsigned int getSources() const { return (mac >> 48) & 0xFF; }
+		inline unsigned int getChanges() const { return mac >> 56; } // Saturated
+	};
+
+	// Number of entries, rounded up to a power of two
+	NeighbourTable(unsigned int capacity = 4096);
+	~NeighbourTable();
+
+	// Records that addr was seen with mac. Returns NEIGHBOUR_*, and with
+	// NEIGHBOUR_CHANGED, the MAC address it had before in previous_mac.
+	inline int update(in_addr_t addr, u_int64_t mac, unsigned int source, u_int32_t now, u_int64_t & previous_mac) {
+		u_int32_t i = hashMix32(addr) & mask;
+		Entry * victim = NULL;
+		for (unsigned int probe = 0; probe < PROBE_LIMIT; probe++, i = (i + 1) & mask) {
+			Entry & entry = entries[i];
+			if (entry.addr == addr) {
+				entry.last_seen = now;
+				if (entry.getMac() == mac) {
+					entry.mac |= (u_int64_t)source << 48;
+					return NEIGHBOUR_SAME;
+				}
+				previous_mac = entry.getMac();
+				u_int64_t times = entry.getChanges();
+				if (times < 0xFF) times++;
+				entry.mac = mac | (u_int64_t)source << 48 | times << 56;
+				changes++;
+				return NEIGHBOUR_CHANGED;
+			}
+			if (!entry.addr) {
+				victim = &entry;
+				break;
+			}
+			if (!victim || entry.last_seen < victim->last_seen) victim = &entry;
+		}
+		if (victim->addr) evictions++;
+		else count++;
+		victim->addr = addr;
+		victim->mac = mac | (u_int64_t)source << 48;
+		victim->last_seen = now;
+		return NEIGHBOUR_NEW;
+	}
+
+	// NULL if the address is not in the table
+	const Entry * find(in_addr_t addr) const;
+
+	inline unsigned int size() const { return count; }
+	inline unsigned int capacity() const { return mask + 1; }
+	inline const Entry & operator[](unsigned int slot) const { return entries[slot]; }
+
+	inline u_int64_t getChanges() const { return changes; }
+	inline u_int64_t getEvictions() const { return evictions; }
+
+	// Every address with its MAC address, sorted by address
+	void print(std::ostream& out) const;
+	// "NEIGHBOUR 192.168.1.1 changed from 02:00:00:00:00:01 to 02:00:00:00:00:02 (ARP)"
+	static void printChange(std::ostream& out, in_addr_t addr, u_int64_t previous_mac, u_int64_t mac, unsigned int source);
+
+private:
+	Entry * entries;
+	u_int32_t mask;
+	unsigned int count;
+	u_int64_t changes;
+	u_int64_t evictions;
+
+	// Can't be copied
+	NeighbourTable(const NeighbourTable &other);
+	NeighbourTable &operator=(const NeighbourTable &other);
+};
+
+} // namespace filter
+
+#endif // NEIGHBOUR_TABLE_H_BCBEBF08_CBDF_11F1_959D_02FC00000001_
@@ -0,0 +1,79 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "packet_batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+using namespace filter;
+
+// Packets are copied at cache line boundaries, so that prefetching the first
+// lines of a packet never pulls in the tail of the previous one
+static const unsigned int ARENA_ALIGN = 64;
+
+PacketBatch::PacketBatch(unsigned int capacity, unsigned int snap)
+		: records(NULL), count(0), max_count(0), arena(NULL), arena_used(0), arena_size(0), snaplen(snap) {
+	resize(capacity);
+}
+
+PacketBatch::~PacketBatch() {
+	delete[] records;
+	free(arena);
+}
+
+void PacketBatch::resize(unsigned int capacity) {
+	if (capacity < 1) capacity = 1;
+	delete[] records;
+	free(arena);
+	records = new PacketRecord[capacity];
+	max_count = capacity;
+	arena_size = capacity * ((snaplen + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1));
+	arena = NULL; // Allocated on the first copy, batches of references don't need it
+	clear();
+}
+
+bool PacketBatch::add(const struct timeval & ts, const unsigned char * data, unsigned int caplen, unsigned int len) {
+	if (full()) return false;
+	if (!arena) {
+		if (posix_memalign((void **)&arena, ARENA_ALIGN, arena_size) != 0) {
+			arena = NULL;
+			return false;
+		}
+	}
+	if (caplen > snaplen) caplen = snaplen;
+	unsigned char * copy = arena + arena_used;
+	memcpy(copy, data, caplen);
+	arena_used += (caplen + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	return addRef(ts, copy, caplen, len);
+}
+
+bool PacketBatch::addRef(const struct timeval & ts, const unsigned char * data, unsigned int caplen, unsigned int len) {
+	if (full()) return false;
+	PacketRecord & record = records[count++];
+	record.data = data;
+	record.caplen = caplen;
+	record.len = len;
+	record.ts = ts;
+	return true;
+}
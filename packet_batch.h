@@ -0,0 +1,82 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef PACKET_BATCH_H_4E67F1E0_CBD6_11F1_A596_02FC00000001_
+#define PACKET_BATCH_H_4E67F1E0_CBD6_11F1_A596_02FC00000001_
+
+#include <sys/time.h>
+
+namespace filter {
+
+struct PacketRecord {
+	const unsigned char * data;
+	unsigned int caplen;      // Bytes available in data
+	unsigned int len;         // Length of the packet on the wire
+	struct timeval ts;
+};
+
+// Group of packets that are decoded together by Sniffer::newPackets(). The
+// packets can either be copied into the batch (needed with pcap_dispatch(),
+// as libpcap doesn't guarantee that the data will still be valid after the
+// callback returns) or be referenced in place when the caller keeps the
+// buffers alive, as with the blocks of a memory mapped ring.
+
+class PacketBatch {
+public:
+	enum { DEFAULT_CAPACITY = 32 };
+
+	PacketBatch(unsigned int capacity = DEFAULT_CAPACITY, unsigned int snaplen = 65536);
+	~PacketBatch();
+
+	inline unsigned int size() const { return count; }
+	inline unsigned int capacity() const { return max_count; }
+	inline bool full() const { return count >= max_count; }
+	inline void clear() { count = 0; arena_used = 0; }
+
+	inline const PacketRecord & operator[](unsigned int i) const { return records[i]; }
+
+	// Both return false if the batch is already full
+	bool add(const struct timeval & ts, const unsigned char * data, unsigned int caplen, unsigned int len);
+	bool addRef(const struct timeval & ts, const unsigned char * data, unsigned int caplen, unsigned int len);
+
+	// Drops the packets in the batch
+	void resize(unsigned int capacity);
+
+private:
+	PacketRecord * records;
+	unsigned int count;
+	unsigned int max_count;
+
+	unsigned char * arena;
+	unsigned int arena_used;
+	unsigned int arena_size;
+	unsigned int snaplen;
+
+	// Can't be copied
+	PacketBatch(const PacketBatch &other);
+	PacketBatch &operator=(const PacketBatch &other);
+};
+
+} // namespace filter
+
+#endif // PACKET_BATCH_H_4E67F1E0_CBD6_11F1_A596_02FC00000001_
@@ -0,0 +1,448 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "packet_columns.h"
+#include "ip_port_connection.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+using namespace filter;
+
+// Columns
+
+PacketColumns::PacketColumns()
+		: saddr(NULL), daddr(NULL), hash(NULL), sport(NULL), dport(NULL),
+		ethertype(NULL), ip_len(NULL), l3_offset(NULL), l4_offset(NULL),
+		payload_offset(NULL), protocol(NULL), tcp_flags(NULL), flags(NULL),
+		block(NULL), count(0), max_count(0) {
+}
+
+PacketColumns::~PacketColumns() {
+	free(block);
+}
+
+void PacketColumns::reserve(unsigned int capacity) {
+	if (capacity <= max_count) return;
+	capacity = (capacity + 7) & ~7u; // Whole vectors, every column stays 32 byte aligned
+	free(block);
+	if (posix_memalign((void **)&block, 32, capacity * (3 * 4 + 7 * 2 + 3 * 1)) != 0) abort();
+
+	unsigned char * p = block;
+	saddr = (u_int32_t *)p;          p += capacity * 4;
+	daddr = (u_int32_t *)p;          p += capacity * 4;
+	hash = (u_int32_t *)p;           p += capacity * 4;
+	sport = (u_int16_t *)p;          p += capacity * 2;
+	dport = (u_int16_t *)p;          p += capacity * 2;
+	ethertype = (u_int16_t *)p;      p += capacity * 2;
+	ip_len = (u_int16_t *)p;         p += capacity * 2;
+	l3_offset = (u_int16_t *)p;      p += capacity * 2;
+	l4_offset = (u_int16_t *)p;      p += capacity * 2;
+	payload_offset = (u_int16_t *)p; p += capacity * 2;
+	protocol = (u_int8_t *)p;        p += capacity;
+	tcp_flags = (u_int8_t *)p;       p += capacity;
+	flags = (u_int8_t *)p;
+	max_count = capacity;
+	count = 0;
+}
+
+void PacketColumns::get(unsigned int i, PacketSummary & summary) const {
+	summary.saddr = saddr[i];
+	summary.daddr = daddr[i];
+	summary.sport = sport[i];
+	summary.dport = dport[i];
+	summary.ethertype = ethertype[i];
+	summary.ip_len = ip_len[i];
+	summary.l3_offset = l3_offset[i];
+	summary.l4_offset = l4_offset[i];
+	summary.payload_offset = payload_offset[i];
+	summary.protocol = protocol[i];
+	summary.tcp_flags = tcp_flags[i];
+	summary.flags = flags[i];
+}
+
+void PacketColumns::set(unsigned int i, const PacketSummary & summary) {
+	saddr[i] = summary.saddr;
+	daddr[i] = summary.daddr;
+	hash[i] = (summary.flags & SUMMARY_IP) ?
+		hashConnection(summary.saddr, summary.sport, summary.daddr, summary.dport) : 0;
+	sport[i] = summary.sport;
+	dport[i] = summary.dport;
+	ethertype[i] = summary.ethertype;
+	ip_len[i] = summary.ip_len;
+	l3_offset[i] = summary.l3_offset;
+	l4_offset[i] = summary.l4_offset;
+	payload_offset[i] = summary.payload_offset;
+	protocol[i] = summary.protocol;
+	tcp_flags[i] = summary.tcp_flags;
+	flags[i] = summary.flags;
+}
+
+// Scalar code, also used for the packets that the vector code can't handle
+// (not IPv4, truncated, ...) and for the tail of the batch
+
+static void extractScalar(const PacketBatch & batch, PacketColumns & columns, unsigned int first, unsigned int last,
+		int depth = DECODE_TRANSPORT) {
+	PacketSummary summary;
+	for (unsigned int i = first; i < last; i++) {
+		decodePacketSummary(batch[i].data, batch[i].caplen, summary, depth);
+		columns.set(i, summary);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+// The vector code only handles the common case: Ethernet + IPv4, with the
+// whole IP header captured, and with the whole TCP or UDP header captured if
+// there is one. Fields are loaded as little endian 32 bit words:
+//
+//   offset 12: ethertype(2) version+ihl tos
+//   offset 16: tot_len(2) id(2)
+//   offset 20: frag_off(2) ttl protocol
+//   offset 26: saddr
+//   offset 30: daddr
+//   offset l4: source(2) dest(2)
+//   offset l4+12: doff+res flags window(2)
+
+static const unsigned int MIN_IP_FRAME = 14 + 20;
+static const int ETHERTYPE_IP_LE = 0x0008;
+static const int FRAG_OFFSET_MASK_LE = 0xFF1F; // IP_OFFMASK in network byte order
+
+static inline u_int32_t load32(const unsigned char * p) {
+	u_int32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// AVX2: 8 packets at a time
+
+__attribute__((target("avx2")))
+static inline __m256i gatherAvx2(const __m256i ptr[2], __m256i offset, __m256i mask) {
+	__m256i addr_lo = _mm256_add_epi64(ptr[0], _mm256_cvtepu32_epi64(_mm256_castsi256_si128(offset)));
+	__m256i addr_hi = _mm256_add_epi64(ptr[1], _mm256_cvtepu32_epi64(_mm256_extracti128_si256(offset, 1)));
+	__m128i lo = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int *)0, addr_lo, _mm256_castsi256_si128(mask), 1);
+	__m128i hi = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int *)0, addr_hi, _mm256_extracti128_si256(mask, 1), 1);
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i mixAvx2(__m256i h) {
+	h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+	h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x85EBCA6B));
+	h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+	h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0xC2B2AE35));
+	h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+	return h;
+}
+
+// Same as hashConnection()
+__attribute__((target("avx2")))
+static inline __m256i hashAvx2(__m256i saddr, __m256i sport, __m256i daddr, __m256i dport) {
+	__m256i golden = _mm256_set1_epi32(0x9E3779B1);
+	__m256i src = mixAvx2(_mm256_xor_si256(saddr, _mm256_mullo_epi32(sport, golden)));
+	__m256i dst = mixAvx2(_mm256_xor_si256(daddr, _mm256_mullo_epi32(dport, golden)));
+	return mixAvx2(_mm256_add_epi32(src, dst));
+}
+
+// Swap the bytes of the low 16 bits of every lane, clear the high ones
+__attribute__((target("avx2")))
+static inline __m256i swap16Avx2(__m256i v) {
+	const __m256i shuffle = _mm256_setr_epi8(
+		1, 0, -1, -1, 5, 4, -1, -1, 9, 8, -1, -1, 13, 12, -1, -1,
+		1, 0, -1, -1, 5, 4, -1, -1, 9, 8, -1, -1, 13, 12, -1, -1);
+	return _mm256_shuffle_epi8(v, shuffle);
+}
+
+__attribute__((target("avx2")))
+static inline void store16Avx2(u_int16_t * dst, __m256i v) {
+	__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+	_mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(packed));
+}
+
+__attribute__((target("avx2")))
+static inline void store8Avx2(u_int8_t * dst, __m256i v) {
+	__m128i words = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08));
+	_mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(words, words));
+}
+
+__attribute__((target("avx2")))
+static unsigned int extractAvx2(const PacketBatch & batch, PacketColumns & columns, unsigned int first, unsigned int count) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i byte = _mm256_set1_epi32(0xFF);
+
+	unsigned int i = first;
+	for (; i + 8 <= count; i += 8) {
+		const PacketRecord * r = &batch[i];
+		__m256i ptr[2];
+		ptr[0] = _mm256_setr_epi64x((long long)r[0].data, (long long)r[1].data, (long long)r[2].data, (long long)r[3].data);
+		ptr[1] = _mm256_setr_epi64x((long long)r[4].data, (long long)r[5].data, (long long)r[6].data, (long long)r[7].data);
+		__m256i caplen = _mm256_setr_epi32(r[0].caplen, r[1].caplen, r[2].caplen, r[3].caplen,
+			r[4].caplen, r[5].caplen, r[6].caplen, r[7].caplen);
+		caplen = _mm256_min_epu32(caplen, _mm256_set1_epi32(0xFFFF)); // Keep comparisons signed-safe
+
+		// IP header
+		__m256i big_enough = _mm256_cmpgt_epi32(caplen, _mm256_set1_epi32(MIN_IP_FRAME - 1));
+		__m256i w12 = gatherAvx2(ptr, _mm256_set1_epi32(12), big_enough);
+		__m256i w16 = gatherAvx2(ptr, _mm256_set1_epi32(16), big_enough);
+		__m256i w20 = gatherAvx2(ptr, _mm256_set1_epi32(20), big_enough);
+		__m256i saddr = gatherAvx2(ptr, _mm256_set1_epi32(26), big_enough);
+		__m256i daddr = gatherAvx2(ptr, _mm256_set1_epi32(30), big_enough);
+
+		__m256i is_ip = _mm256_cmpeq_epi32(_mm256_and_si256(w12, _mm256_set1_epi32(0xFFFF)), _mm256_set1_epi32(ETHERTYPE_IP_LE));
+		__m256i ver_ihl = _mm256_and_si256(_mm256_srli_epi32(w12, 16), byte);
+		__m256i ihl = _mm256_and_si256(ver_ihl, _mm256_set1_epi32(0x0F));
+		__m256i l4 = _mm256_add_epi32(_mm256_set1_epi32(14), _mm256_slli_epi32(ihl, 2));
+		is_ip = _mm256_and_si256(is_ip, big_enough);
+		is_ip = _mm256_and_si256(is_ip, _mm256_cmpeq_epi32(_mm256_srli_epi32(ver_ihl, 4), _mm256_set1_epi32(4)));
+		is_ip = _mm256_and_si256(is_ip, _mm256_cmpgt_epi32(ihl, _mm256_set1_epi32(4)));
+		is_ip = _mm256_andnot_si256(_mm256_cmpgt_epi32(l4, caplen), is_ip);
+
+		// Transport header
+		__m256i protocol = _mm256_srli_epi32(w20, 24);
+		__m256i fragment = _mm256_cmpgt_epi32(_mm256_and_si256(w20, _mm256_set1_epi32(FRAG_OFFSET_MASK_LE)), zero);
+		fragment = _mm256_and_si256(fragment, is_ip);
+		__m256i is_tcp = _mm256_andnot_si256(fragment, _mm256_cmpeq_epi32(protocol, _mm256_set1_epi32(IPPROTO_TCP)));
+		__m256i is_udp = _mm256_andnot_si256(fragment, _mm256_cmpeq_epi32(protocol, _mm256_set1_epi32(IPPROTO_UDP)));
+		__m256i l4_len = _mm256_or_si256(_mm256_and_si256(is_tcp, _mm256_set1_epi32(20)), _mm256_and_si256(is_udp, _mm256_set1_epi32(8)));
+		__m256i has_ports = _mm256_and_si256(_mm256_or_si256(is_tcp, is_udp), is_ip);
+		__m256i ports_ok = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_add_epi32(l4, l4_len), caplen), has_ports);
+		is_tcp = _mm256_and_si256(is_tcp, ports_ok);
+		is_udp = _mm256_and_si256(is_udp, ports_ok);
+
+		__m256i ports = gatherAvx2(ptr, l4, ports_ok);
+		__m256i tcp_word = gatherAvx2(ptr, _mm256_add_epi32(l4, _mm256_set1_epi32(12)), is_tcp);
+
+		__m256i sport = swap16Avx2(ports);
+		__m256i dport = swap16Avx2(_mm256_srli_epi32(ports, 16));
+		__m256i tcp_flags = _mm256_and_si256(_mm256_srli_epi32(tcp_word, 8), byte);
+		__m256i doff = _mm256_slli_epi32(_mm256_srli_epi32(_mm256_and_si256(tcp_word, byte), 4), 2);
+		__m256i payload = _mm256_add_epi32(l4, _mm256_or_si256(_mm256_and_si256(is_tcp, doff), _mm256_and_si256(is_udp, _mm256_set1_epi32(8))));
+		__m256i hash = _mm256_and_si256(hashAvx2(saddr, sport, daddr, dport), is_ip);
+
+		__m256i flags = _mm256_and_si256(is_ip, _mm256_set1_epi32(SUMMARY_IP));
+		flags = _mm256_or_si256(flags, _mm256_and_si256(ports_ok, _mm256_set1_epi32(SUMMARY_PORTS)));
+		flags = _mm256_or_si256(flags, _mm256_and_si256(fragment, _mm256_set1_epi32(SUMMARY_FRAGMENT)));
+
+		_mm256_storeu_si256((__m256i *)&columns.saddr[i], saddr);
+		_mm256_storeu_si256((__m256i *)&columns.daddr[i], daddr);
+		_mm256_storeu_si256((__m256i *)&columns.hash[i], hash);
+		store16Avx2(&columns.sport[i], sport);
+		store16Avx2(&columns.dport[i], dport);
+		store16Avx2(&columns.ethertype[i], _mm256_set1_epi32(ETH_P_IP));
+		store16Avx2(&columns.ip_len[i], swap16Avx2(w16));
+		store16Avx2(&columns.l3_offset[i], _mm256_set1_epi32(14));
+		store16Avx2(&columns.l4_offset[i], l4);
+		store16Avx2(&columns.payload_offset[i], payload);
+		store8Avx2(&columns.protocol[i], protocol);
+		store8Avx2(&columns.tcp_flags[i], tcp_flags);
+		store8Avx2(&columns.flags[i], flags);
+
+		// Lanes that are not plain IP, or have a truncated transport header
+		__m256i handled = _mm256_andnot_si256(_mm256_xor_si256(has_ports, ports_ok), is_ip);
+		unsigned int slow = ~_mm256_movemask_ps(_mm256_castsi256_ps(handled)) & 0xFF;
+		while (slow) {
+			unsigned int lane = __builtin_ctz(slow);
+			extractScalar(batch, columns, i + lane, i + lane + 1);
+			slow &= slow - 1;
+		}
+	}
+	return i;
+}
+
+// SSE4.2: 4 packets at a time. There is no gather instruction, so the words
+// are loaded one lane at a time, but the checks and the hashing are done in
+// the vector registers.
+
+__attribute__((target("sse4.2")))
+static inline __m128i mixSse(__m128i h) {
+	h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+	h = _mm_mullo_epi32(h, _mm_set1_epi32(0x85EBCA6B));
+	h = _mm_xor_si128(h, _mm_srli_epi32(h, 13));
+	h = _mm_mullo_epi32(h, _mm_set1_epi32(0xC2B2AE35));
+	h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+	return h;
+}
+
+__attribute__((target("sse4.2")))
+static inline __m128i hashSse(__m128i saddr, __m128i sport, __m128i daddr, __m128i dport) {
+	__m128i golden = _mm_set1_epi32(0x9E3779B1);
+	__m128i src = mixSse(_mm_xor_si128(saddr, _mm_mullo_epi32(sport, golden)));
+	__m128i dst = mixSse(_mm_xor_si128(daddr, _mm_mullo_epi32(dport, golden)));
+	return mixSse(_mm_add_epi32(src, dst));
+}
+
+__attribute__((target("sse4.2")))
+static inline __m128i swap16Sse(__m128i v) {
+	const __m128i shuffle = _mm_setr_epi8(1, 0, -1, -1, 5, 4, -1, -1, 9, 8, -1, -1, 13, 12, -1, -1);
+	return _mm_shuffle_epi8(v, shuffle);
+}
+
+__attribute__((target("sse4.2")))
+static inline __m128i gatherSse(const PacketRecord * r, __m128i offset, __m128i mask) {
+	u_int32_t off[4], m[4], v[4];
+	_mm_storeu_si128((__m128i *)off, offset);
+	_mm_storeu_si128((__m128i *)m, mask);
+	for (int j = 0; j < 4; j++)
+		v[j] = m[j] ? load32(r[j].data + off[j]) : 0;
+	return _mm_loadu_si128((const __m128i *)v);
+}
+
+__attribute__((target("sse4.2")))
+static inline void store16Sse(u_int16_t * dst, __m128i v) {
+	_mm_storel_epi64((__m128i *)dst, _mm_packus_epi32(v, v));
+}
+
+__attribute__((target("sse4.2")))
+static inline void store8Sse(u_int8_t * dst, __m128i v) {
+	__m128i words = _mm_packus_epi32(v, v);
+	u_int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+	memcpy(dst, &bytes, sizeof(bytes));
+}
+
+__attribute__((target("sse4.2")))
+static unsigned int extractSse42(const PacketBatch & batch, PacketColumns & columns, unsigned int first, unsigned int count) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i byte = _mm_set1_epi32(0xFF);
+
+	unsigned int i = first;
+	for (; i + 4 <= count; i += 4) {
+		const PacketRecord * r = &batch[i];
+		__m128i caplen = _mm_setr_epi32(r[0].caplen, r[1].caplen, r[2].caplen, r[3].caplen);
+		caplen = _mm_min_epu32(caplen, _mm_set1_epi32(0xFFFF));
+
+		__m128i big_enough = _mm_cmpgt_epi32(caplen, _mm_set1_epi32(MIN_IP_FRAME - 1));
+		__m128i w12 = gatherSse(r, _mm_set1_epi32(12), big_enough);
+		__m128i w16 = gatherSse(r, _mm_set1_epi32(16), big_enough);
+		__m128i w20 = gatherSse(r, _mm_set1_epi32(20), big_enough);
+		__m128i saddr = gatherSse(r, _mm_set1_epi32(26), big_enough);
+		__m128i daddr = gatherSse(r, _mm_set1_epi32(30), big_enough);
+
+		__m128i is_ip = _mm_cmpeq_epi32(_mm_and_si128(w12, _mm_set1_epi32(0xFFFF)), _mm_set1_epi32(ETHERTYPE_IP_LE));
+		__m128i ver_ihl = _mm_and_si128(_mm_srli_epi32(w12, 16), byte);
+		__m128i ihl = _mm_and_si128(ver_ihl, _mm_set1_epi32(0x0F));
+		__m128i l4 = _mm_add_epi32(_mm_set1_epi32(14), _mm_slli_epi32(ihl, 2));
+		is_ip = _mm_and_si128(is_ip, big_enough);
+		is_ip = _mm_and_si128(is_ip, _mm_cmpeq_epi32(_mm_srli_epi32(ver_ihl, 4), _mm_set1_epi32(4)));
+		is_ip = _mm_and_si128(is_ip, _mm_cmpgt_epi32(ihl, _mm_set1_epi32(4)));
+		is_ip = _mm_andnot_si128(_mm_cmpgt_epi32(l4, caplen), is_ip);
+
+		__m128i protocol = _mm_srli_epi32(w20, 24);
+		__m128i fragment = _mm_cmpgt_epi32(_mm_and_si128(w20, _mm_set1_epi32(FRAG_OFFSET_MASK_LE)), zero);
+		fragment = _mm_and_si128(fragment, is_ip);
+		__m128i is_tcp = _mm_andnot_si128(fragment, _mm_cmpeq_epi32(protocol, _mm_set1_epi32(IPPROTO_TCP)));
+		__m128i is_udp = _mm_andnot_si128(fragment, _mm_cmpeq_epi32(protocol, _mm_set1_epi32(IPPROTO_UDP)));
+		__m128i l4_len = _mm_or_si128(_mm_and_si128(is_tcp, _mm_set1_epi32(20)), _mm_and_si128(is_udp, _mm_set1_epi32(8)));
+		__m128i has_ports = _mm_and_si128(_mm_or_si128(is_tcp, is_udp), is_ip);
+		__m128i ports_ok = _mm_andnot_si128(_mm_cmpgt_epi32(_mm_add_epi32(l4, l4_len), caplen), has_ports);
+		is_tcp = _mm_and_si128(is_tcp, ports_ok);
+		is_udp = _mm_and_si128(is_udp, ports_ok);
+
+		__m128i ports = gatherSse(r, l4, ports_ok);
+		__m128i tcp_word = gatherSse(r, _mm_add_epi32(l4, _mm_set1_epi32(12)), is_tcp);
+
+		__m128i sport = swap16Sse(ports);
+		__m128i dport = swap16Sse(_mm_srli_epi32(ports, 16));
+		__m128i tcp_flags = _mm_and_si128(_mm_srli_epi32(tcp_word, 8), byte);
+		__m128i doff = _mm_slli_epi32(_mm_srli_epi32(_mm_and_si128(tcp_word, byte), 4), 2);
+		__m128i payload = _mm_add_epi32(l4, _mm_or_si128(_mm_and_si128(is_tcp, doff), _mm_and_si128(is_udp, _mm_set1_epi32(8))));
+		__m128i hash = _mm_and_si128(hashSse(saddr, sport, daddr, dport), is_ip);
+
+		__m128i flags = _mm_and_si128(is_ip, _mm_set1_epi32(SUMMARY_IP));
+		flags = _mm_or_si128(flags, _mm_and_si128(ports_ok, _mm_set1_epi32(SUMMARY_PORTS)));
+		flags = _mm_or_si128(flags, _mm_and_si128(fragment, _mm_set1_epi32(SUMMARY_FRAGMENT)));
+
+		_mm_storeu_si128((__m128i *)&columns.saddr[i], saddr);
+		_mm_storeu_si128((__m128i *)&columns.daddr[i], daddr);
+		_mm_storeu_si128((__m128i *)&columns.hash[i], hash);
+		store16Sse(&columns.sport[i], sport);
+		store16Sse(&columns.dport[i], dport);
+		store16Sse(&columns.ethertype[i], _mm_set1_epi32(ETH_P_IP));
+		store16Sse(&columns.ip_len[i], swap16Sse(w16));
+		store16Sse(&columns.l3_offset[i], _mm_set1_epi32(14));
+		store16Sse(&columns.l4_offset[i], l4);
+		store16Sse(&columns.payload_offset[i], payload);
+		store8Sse(&columns.protocol[i], protocol);
+		store8Sse(&columns.tcp_flags[i], tcp_flags);
+		store8Sse(&columns.flags[i], flags);
+
+		__m128i handled = _mm_andnot_si128(_mm_xor_si128(has_ports, ports_ok), is_ip);
+		unsigned int slow = ~_mm_movemask_ps(_mm_castsi128_ps(handled)) & 0x0F;
+		while (slow) {
+			unsigned int lane = __builtin_ctz(slow);
+			extractScalar(batch, columns, i + lane, i + lane + 1);
+			slow &= slow - 1;
+		}
+	}
+	return i;
+}
+
+#endif // HAVE_X86_SIMD
+
+int filter::getSimdLevel() {
+#ifdef HAVE_X86_SIMD
+	static int level = -1;
+	if (level < 0) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			level = SIMD_AVX2;
+		else if (__builtin_cpu_supports("sse4.2"))
+			level = SIMD_SSE42;
+		else
+			level = SIMD_NONE;
+	}
+	return level;
+#else
+	return SIMD_NONE;
+#endif
+}
+
+void filter::extractPacketColumns(const PacketBatch & batch, PacketColumns & columns, int simd, int depth) {
+	unsigned int count = batch.size();
+	columns.reserve(count);
+	columns.count = count;
+	if (depth < DECODE_TRANSPORT) {
+		extractScalar(batch, columns, 0, count, depth);
+		return;
+	}
+
+	int level = getSimdLevel();
+	if (simd != SIMD_AUTO && simd < level) level = simd;
+
+	unsigned int done = 0;
+#ifdef HAVE_X86_SIMD
+	if (level >= SIMD_AVX2)
+		done = extractAvx2(batch, columns, done, count);
+	if (level >= SIMD_SSE42)
+		done = extractSse42(batch, columns, done, count);
+#endif
+	extractScalar(batch, columns, done, count);
+}
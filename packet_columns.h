@@ -0,0 +1,99 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef PACKET_COLUMNS_H_BFA5E89E_CBD6_11F1_995E_02FC00000001_
+#define PACKET_COLUMNS_H_BFA5E89E_CBD6_11F1_995E_02FC00000001_
+
+#include "packet_summary.h"
+#include "packet_batch.h"
+
+#include <sys/types.h>
+
+namespace filter {
+
+// Same fields as PacketSummary for a whole PacketBatch, stored as columns
+// (structure of arrays) together with the hash of the connection of every
+// packet, so that they can be filled with vector instructions and the
+// connection table lookups can be fed straight from them.
+
+enum {
+	SIMD_AUTO = -1,  // Best one supported by the CPU
+	SIMD_NONE = 0,   // Scalar code
+	SIMD_SSE42 = 1,  // 4 packets at a time
+	SIMD_AVX2 = 2,   // 8 packets at a time
+};
+
+class PacketColumns {
+public:
+	PacketColumns();
+	~PacketColumns();
+
+	// Allocates room for at least capacity packets. Previous content is lost.
+	void reserve(unsigned int capacity);
+	inline unsigned int capacity() const { return max_count; }
+	inline unsigned int size() const { return count; }
+
+	// Copy the fields of a packet back into a PacketSummary
+	void get(unsigned int i, PacketSummary & summary) const;
+	// Store a PacketSummary (and its hash) as packet i
+	void set(unsigned int i, const PacketSummary & summary);
+
+	u_int32_t * saddr;          // Network byte order
+	u_int32_t * daddr;          // Network byte order
+	u_int32_t * hash;           // hashConnection() of the packet, 0 if not IP
+	u_int16_t * sport;          // Host byte order
+	u_int16_t * dport;          // Host byte order
+	u_int16_t * ethertype;
+	u_int16_t * ip_len;
+	u_int16_t * l3_offset;
+	u_int16_t * l4_offset;
+	u_int16_t * payload_offset;
+	u_int8_t * protocol;
+	u_int8_t * tcp_flags;
+	u_int8_t * flags;           // SUMMARY_*
+
+private:
+	friend void extractPacketColumns(const PacketBatch & batch, PacketColumns & columns, int simd, int depth);
+
+	unsigned char * block;
+	unsigned int count;
+	unsigned int max_count;
+
+	// Can't be copied
+	PacketColumns(const PacketColumns &other);
+	PacketColumns &operator=(const PacketColumns &other);
+};
+
+// Decodes the headers of all the packets in the batch into the columns, up
+// to depth (DECODE_*, packet_summary.h). All the SIMD levels produce exactly
+// the same result; the vector code always goes down to the transport layer,
+// so shallower decodes are done with the scalar code.
+void extractPacketColumns(const PacketBatch & batch, PacketColumns & columns, int simd = SIMD_AUTO,
+	int depth = DECODE_TRANSPORT);
+
+// Highest SIMD level supported by this CPU
+int getSimdLevel();
+
+} // namespace filter
+
+#endif // PACKET_COLUMNS_H_BFA5E89E_CBD6_11F1_995E_02FC00000001_
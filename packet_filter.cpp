@@ -0,0 +1,63 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "packet_filter.h"
+
+#include <pcap.h>
+
+using namespace filter;
+
+PacketFilter * PacketFilter::compile(const char * expression, std::string & error) {
+	// Only used to compile the program for Ethernet frames
+	pcap_t * dead = pcap_open_dead(DLT_EN10MB, 65536);
+	if (!dead) {
+		error = "Can't compile filters";
+		return NULL;
+	}
+	PacketFilter * filter = new PacketFilter(expression);
+	filter->program = new struct bpf_program;
+	if (pcap_compile(dead, filter->program, expression, 1, PCAP_NETMASK_UNKNOWN) != 0) {
+		error = pcap_geterr(dead);
+		delete filter->program;
+		filter->program = NULL;
+		delete filter;
+		filter = NULL;
+	}
+	pcap_close(dead);
+	return filter;
+}
+
+PacketFilter::~PacketFilter() {
+	if (program) {
+		pcap_freecode(program);
+		delete program;
+	}
+}
+
+bool PacketFilter::matches(const PacketRecord & packet) const {
+	struct pcap_pkthdr header;
+	header.ts = packet.ts;
+	header.caplen = packet.caplen;
+	header.len = packet.len;
+	return pcap_offline_filter(program, &header, packet.data) != 0;
+}
@@ -0,0 +1,65 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef PACKET_FILTER_H_47B09870_CBE0_11F1_82EA_02FC00000001_
+#define PACKET_FILTER_H_47B09870_CBE0_11F1_82EA_02FC00000001_
+
+#include "packet_batch.h"
+
+#include <string>
+
+struct bpf_program;
+
+namespace filter {
+
+// BPF filter program (pcap-filter syntax, e.g. "tcp port 80"), run on the
+// packets by the sniffer itself instead of being installed on the capture
+// handle. It can then be compiled by any thread and replaced while the
+// capture goes on (see Sniffer::setPacketFilter()), without reopening the
+// device. The program never changes once compiled, so it can be shared by
+// several threads.
+
+class PacketFilter {
+public:
+	// Returns NULL, with the reason in error, if the expression is not valid
+	static PacketFilter * compile(const char * expression, std::string & error);
+	~PacketFilter();
+
+	bool matches(const PacketRecord & packet) const;
+
+	inline const std::string & getExpression() const { return expression; }
+
+private:
+	PacketFilter(const char * expression) : program(NULL), expression(expression) { }
+
+	struct bpf_program * program;
+	std::string expression;
+
+	// Can't be copied
+	PacketFilter(const PacketFilter &other);
+	PacketFilter &operator=(const PacketFilter &other);
+};
+
+} // namespace filter
+
+#endif // PACKET_FILTER_H_47B09870_CBE0_11F1_82EA_02FC00000001_
@@ -0,0 +1,363 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "packet_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+using namespace filter;
+
+static const char SEGMENT_PREFIX[] = "segment-";
+static const size_t WRITE_BUFFER_SIZE = 1 << 20;
+
+static inline u_int64_t toMicroseconds(const struct timeval & tv) {
+	return (u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Number of a segment file with the given extension, -1 if it isn't one
+static long segmentNumber(const char * name, const char * extension) {
+	size_t prefix_len = sizeof(SEGMENT_PREFIX) - 1;
+	if (strncmp(name, SEGMENT_PREFIX, prefix_len) != 0) return -1;
+	char * end;
+	long number = strtol(name + prefix_len, &end, 10);
+	if (end == name + prefix_len || strcmp(end, extension) != 0) return -1;
+	return number;
+}
+
+void filter::initPcapFileHeader(PcapFileHeader & header, unsigned int snaplen) {
+	header.magic = PCAP_MAGIC;
+	header.version_major = 2;
+	header.version_minor = 4;
+	header.thiszone = 0;
+	header.sigfigs = 0;
+	header.snaplen = snaplen;
+	header.linktype = PCAP_LINKTYPE_ETHERNET;
+}
+
+// Packet Store
+
+PacketStore::PacketStore(unsigned int size, unsigned int s)
+		: segment_size(size), snaplen(s), next_segment(0), data(NULL), offset(0),
+		first_us(0), last_us(0), packets(0), write_errors(0) {
+}
+
+PacketStore::~PacketStore() {
+	close();
+}
+
+bool PacketStore::open(const char * path) {
+	close();
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) return false;
+	DIR * dir = opendir(path);
+	if (!dir) return false;
+	directory = path;
+	next_segment = 0;
+	struct dirent * entry;
+	while ((entry = readdir(dir)) != NULL) {
+		long number = segmentNumber(entry->d_name, ".pcap");
+		if (number >= 0 && (unsigned long)number >= next_segment) next_segment = number + 1;
+	}
+	closedir(dir);
+	return true;
+}
+
+void PacketStore::close() {
+	if (data) closeSegment();
+}
+
+bool PacketStore::openSegment() {
+	if (directory.empty()) return false;
+	char name[64];
+	snprintf(name, sizeof(name), "/%s%010u.pcap", SEGMENT_PREFIX, next_segment);
+	data_path = directory + name;
+	data = fopen(data_path.c_str(), "wb");
+	if (!data) return false;
+	setvbuf(data, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+	next_segment++;
+
+	PcapFileHeader header;
+	initPcapFileHeader(header, snaplen);
+	if (fwrite(&header, sizeof(header), 1, data) != 1) write_errors++;
+	offset = sizeof(header);
+	return true;
+}
+
+void PacketStore::closeSegment() {
+	if (fclose(data) != 0) write_errors++;
+	data = NULL;
+
+	// segment-N.pcap -> segment-N.idx
+	std::string index_path = data_path.substr(0, data_path.size() - 5) + ".idx";
+	if (!writeIndex(index_path)) write_errors++;
+
+	flow_ids.clear();
+	flow_keys.clear();
+	flow_hashes.clear();
+	packet_flows.clear();
+	packet_offsets.clear();
+	times.clear();
+}
+
+bool PacketStore::add(const PacketRecord & packet, const PacketSummary * summary, u_int32_t hash) {
+	unsigned int caplen = packet.caplen < snaplen ? packet.caplen : snaplen;
+	u_int32_t record_size = sizeof(PcapRecordHeader) + caplen;
+	if (data && (u_int64_t)offset + record_size > segment_size && offset > sizeof(PcapFileHeader))
+		closeSegment();
+	if (!data && !openSegment()) {
+		write_errors++;
+		return false;
+	}
+
+	u_int64_t us = toMicroseconds(packet.ts);
+	if (times.empty()) first_us = us;
+	last_us = us;
+	if (times.empty() || times.back().sec != (u_int32_t)packet.ts.tv_sec) {
+		StoreTimeEntry time;
+		time.sec = packet.ts.tv_sec;
+		time.offset = offset;
+		times.push_back(time);
+	}
+
+	if (summary) {
+		Connection key(summary->saddr, summary->sport, summary->daddr, summary->dport);
+		bool created;
+		FlowId & flow = flow_ids.insert(key, hash, &created);
+		if (created) {
+			flow.id = flow_keys.size();
+			flow_keys.push_back(key);
+			flow_hashes.push_back(hash);
+		}
+		packet_flows.push_back(flow.id);
+		packet_offsets.push_back(offset);
+	}
+
+	PcapRecordHeader header;
+	header.ts_sec = packet.ts.tv_sec;
+	header.ts_usec = packet.ts.tv_usec;
+	header.caplen = caplen;
+	header.len = packet.len;
+	offset += record_size;
+	packets++;
+	if (fwrite(&header, sizeof(header), 1, data) != 1 || fwrite(packet.data, 1, caplen, data) != caplen) {
+		write_errors++;
+		return false;
+	}
+	return true;
+}
+
+static bool compareFlowEntries(const StoreFlowEntry & a, const StoreFlowEntry & b) {
+	return a.hash < b.hash;
+}
+
+bool PacketStore::writeIndex(const std::string & path) {
+	// Group the offsets by flow, keeping the capture order (counting sort)
+	unsigned int flow_count = flow_keys.size();
+	std::vector<StoreFlowEntry> flows(flow_count);
+	for (unsigned int i = 0; i < flow_count; i++) {
+		StoreFlowEntry & flow = flows[i];
+		flow.hash = flow_hashes[i];
+		flow.low_addr = flow_keys[i].low.addr;
+		flow.high_addr = flow_keys[i].high.addr;
+		flow.low_port = flow_keys[i].low.port;
+		flow.high_port = flow_keys[i].high.port;
+		flow.count = 0;
+	}
+	for (size_t i = 0; i < packet_flows.size(); i++)
+		flows[packet_flows[i]].count++;
+	u_int32_t first = 0;
+	for (unsigned int i = 0; i < flow_count; i++) {
+		flows[i].first = first;
+		first += flows[i].count;
+	}
+	std::vector<u_int32_t> offsets(packet_offsets.size());
+	std::vector<u_int32_t> next(flow_count);
+	for (unsigned int i = 0; i < flow_count; i++) next[i] = flows[i].first;
+	for (size_t i = 0; i < packet_flows.size(); i++)
+		offsets[next[packet_flows[i]]++] = packet_offsets[i];
+	std::sort(flows.begin(), flows.end(), compareFlowEntries);
+
+	StoreIndexHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = STORE_INDEX_MAGIC;
+	header.version = STORE_INDEX_VERSION;
+	header.flow_count = flow_count;
+	header.packet_count = offsets.size();
+	header.time_count = times.size();
+	header.first_us = first_us;
+	header.last_us = last_us;
+
+	// Written under another name first, readers never see a partial index
+	std::string temporary = path + ".tmp";
+	FILE * file = fopen(temporary.c_str(), "wb");
+	if (!file) return false;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	if (flow_count) ok = ok && fwrite(&flows[0], sizeof(StoreFlowEntry), flow_count, file) == flow_count;
+	if (!offsets.empty()) ok = ok && fwrite(&offsets[0], sizeof(u_int32_t), offsets.size(), file) == offsets.size();
+	if (!times.empty()) ok = ok && fwrite(&times[0], sizeof(StoreTimeEntry), times.size(), file) == times.size();
+	ok = (fclose(file) == 0) && ok;
+	if (ok) ok = rename(temporary.c_str(), path.c_str()) == 0;
+	if (!ok) unlink(temporary.c_str());
+	return ok;
+}
+
+// Packet Store Reader
+
+PacketStoreReader::PacketStoreReader() {
+	buffer = new unsigned char[65536];
+}
+
+PacketStoreReader::~PacketStoreReader() {
+	delete[] buffer;
+}
+
+static bool compareSegmentNames(const std::string & a, const std::string & b) {
+	return segmentNumber(a.c_str(), "") < segmentNumber(b.c_str(), "");
+}
+
+bool PacketStoreReader::open(const char * path) {
+	DIR * dir = opendir(path);
+	if (!dir) return false;
+	directory = path;
+	segments.clear();
+	struct dirent * entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (segmentNumber(entry->d_name, ".idx") < 0) continue;
+		std::string name = entry->d_name;
+		segments.push_back(name.substr(0, name.size() - 4));
+	}
+	closedir(dir);
+	std::sort(segments.begin(), segments.end(), compareSegmentNames);
+	return true;
+}
+
+unsigned int PacketStoreReader::extract(const Connection & key, u_int64_t from_us, u_int64_t to_us,
+		PacketCallback callback, void * context) {
+	unsigned int found = 0;
+	for (size_t i = 0; i < segments.size(); i++)
+		found += extractSegment(segments[i], key, from_us, to_us, callback, context);
+	return found;
+}
+
+static bool compareTimeEntries(const StoreTimeEntry & a, const StoreTimeEntry & b) {
+	return a.sec < b.sec;
+}
+
+// Offsets in the pcap file of the packets captured between from_us and to_us
+// (whole seconds), from the time index. Returns false if the index can't
+// tell, when the clock went back during the segment.
+static bool timeRange(const StoreTimeEntry * times, u_int32_t count, u_int64_t from_us, u_int64_t to_us,
+		u_int64_t & begin, u_int64_t & end) {
+	for (u_int32_t i = 1; i < count; i++) {
+		if (times[i].sec <= times[i - 1].sec) return false;
+	}
+	StoreTimeEntry from, to;
+	from.sec = from_us / 1000000 > 0xFFFFFFFFull ? 0xFFFFFFFF : (u_int32_t)(from_us / 1000000);
+	to.sec = to_us / 1000000 > 0xFFFFFFFFull ? 0xFFFFFFFF : (u_int32_t)(to_us / 1000000);
+	const StoreTimeEntry * first = std::lower_bound(times, times + count, from, compareTimeEntries);
+	const StoreTimeEntry * last = std::upper_bound(times, times + count, to, compareTimeEntries);
+	begin = first < times + count ? first->offset : 0x100000000ull;
+	end = last < times + count ? last->offset : 0x100000000ull;
+	return true;
+}
+
+unsigned int PacketStoreReader::extractSegment(const std::string & name, const Connection & key,
+		u_int64_t from_us, u_int64_t to_us, PacketCallback callback, void * context) {
+	std::string base = directory + "/" + name;
+	int fd = ::open((base + ".idx").c_str(), O_RDONLY);
+	if (fd < 0) return 0;
+	struct stat st;
+	void * map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(StoreIndexHeader))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) return 0;
+
+	unsigned int found = 0;
+	const StoreIndexHeader * header = (const StoreIndexHeader *)map;
+	size_t expected = sizeof(StoreIndexHeader) + (size_t)header->flow_count * sizeof(StoreFlowEntry)
+		+ (size_t)header->packet_count * sizeof(u_int32_t) + (size_t)header->time_count * sizeof(StoreTimeEntry);
+	if (header->magic != STORE_INDEX_MAGIC || header->version != STORE_INDEX_VERSION
+			|| (size_t)st.st_size != expected || header->last_us < from_us || header->first_us > to_us) {
+		munmap(map, st.st_size);
+		return 0;
+	}
+
+	const StoreFlowEntry * flows = (const StoreFlowEntry *)(header + 1);
+	const u_int32_t * offsets = (const u_int32_t *)(flows + header->flow_count);
+	const StoreTimeEntry * times = (const StoreTimeEntry *)(offsets + header->packet_count);
+	u_int64_t begin = 0, end = 0x100000000ull;   // Part of the pcap file in the time range
+	timeRange(times, header->time_count, from_us, to_us, begin, end);
+	StoreFlowEntry wanted;
+	wanted.hash = key.hash();
+	const StoreFlowEntry * flow = std::lower_bound(flows, flows + header->flow_count, wanted, compareFlowEntries);
+	for (; flow < flows + header->flow_count && flow->hash == wanted.hash; flow++) {
+		if (flow->low_addr != key.low.addr || flow->low_port != key.low.port
+				|| flow->high_addr != key.high.addr || flow->high_port != key.high.port)
+			continue;
+		if (flow->first + (u_int64_t)flow->count > header->packet_count) break;
+
+		// The offsets of a flow are in capture order: only read the ones in the time range
+		const u_int32_t * first = offsets + flow->first;
+		const u_int32_t * last = first + flow->count;
+		if (begin > 0xFFFFFFFFull) first = last;
+		else first = std::lower_bound(first, last, (u_int32_t)begin);
+		if (end <= 0xFFFFFFFFull) last = std::lower_bound(first, last, (u_int32_t)end);
+		if (first == last) break;
+
+		int data = ::open((base + ".pcap").c_str(), O_RDONLY);
+		if (data < 0) break;
+		for (const u_int32_t * position = first; position < last; position++) {
+			PcapRecordHeader record;
+			off_t offset = *position;
+			if (pread(data, &record, sizeof(record), offset) != (ssize_t)sizeof(record) || record.caplen > 65536) break;
+			if (pread(data, buffer, record.caplen, offset + sizeof(record)) != (ssize_t)record.caplen) break;
+
+			PacketRecord packet;
+			packet.data = buffer;
+			packet.caplen = record.caplen;
+			packet.len = record.len;
+			packet.ts.tv_sec = record.ts_sec;
+			packet.ts.tv_usec = record.ts_usec;
+			u_int64_t us = toMicroseconds(packet.ts);
+			if (us < from_us || us > to_us) continue;
+			callback(packet, context);
+			found++;
+		}
+		::close(data);
+		break;
+	}
+
+	munmap(map, st.st_size);
+	return found;
+}
@@ -0,0 +1,201 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef PACKET_STORE_H_FBDCE0CA_CBDA_11F1_AB6C_02FC00000001_
+#define PACKET_STORE_H_FBDCE0CA_CBDA_11F1_AB6C_02FC00000001_
+
+#include "ip_port_connection.h"
+#include "flow_table.h"
+#include "packet_batch.h"
+#include "packet_summary.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+
+namespace filter {
+
+// Packets are stored in a directory as a sequence of segments. Each one is
+// a pcap file (segment-N.pcap) with an index (segment-N.idx) written when
+// the segment is closed:
+//
+//   StoreIndexHeader
+//   StoreFlowEntry[flow_count]   sorted by hash
+//   u_int32_t[packet_count]      offsets of the packets in the pcap file, grouped by flow
+//   StoreTimeEntry[time_count]   offset of the first packet of each second
+//
+// Indexes are in host byte order, they are meant to be mmapped on the same
+// machine. The index of a segment is built in memory as the packets are
+// written, so there is no second pass over the data. Extractions look up the
+// flow, then use the time entries to read only its packets of the seconds
+// asked for.
+//
+// The segment being written has no index until it's closed, so its packets
+// can't be extracted yet; after a crash, up to segment_size bytes of
+// packets are in a pcap file without an index.
+
+enum {
+	STORE_INDEX_MAGIC = 0x58444950, // "PIDX"
+	STORE_INDEX_VERSION = 1,
+};
+
+struct StoreIndexHeader {
+	u_int32_t magic;
+	u_int32_t version;
+	u_int32_t flow_count;
+	u_int32_t packet_count;   // Packets with an IPv4 header, the only ones in flows
+	u_int32_t time_count;
+	u_int32_t reserved;
+	u_int64_t first_us;       // Capture times of the first and last packets
+	u_int64_t last_us;
+};
+
+struct StoreFlowEntry {
+	u_int32_t hash;           // IpPortConnection::hash()
+	in_addr_t low_addr;       // As in IpPortConnection, network byte order
+	in_addr_t high_addr;
+	u_int16_t low_port;       // Host byte order
+	u_int16_t high_port;
+	u_int32_t first;          // Index of the first offset of the flow
+	u_int32_t count;
+};
+
+struct StoreTimeEntry {
+	u_int32_t sec;
+	u_int32_t offset;
+};
+
+class PacketStore {
+public:
+	typedef IpPortConnection<in_addr_t,u_int16_t> Connection;
+
+	PacketStore(unsigned int segment_size = 256 << 20, unsigned int snaplen = 65535);
+	~PacketStore();
+
+	// Segments are numbered after the ones already in the directory
+	bool open(const char * directory);
+	void close();
+
+	// Write a packet; summary is NULL if it isn't IPv4, hash is the one of its connection
+	bool add(const PacketRecord & packet, const PacketSummary * summary, u_int32_t hash);
+
+	inline u_int64_t getPackets() const { return packets; }
+	inline u_int64_t getWriteErrors() const { return write_errors; }
+
+private:
+	bool openSegment();
+	void closeSegment();
+	bool writeIndex(const std::string & path);
+
+	unsigned int segment_size;
+	unsigned int snaplen;
+	std::string directory;
+	unsigned int next_segment;
+
+	FILE * data;                   // Current segment, NULL if none
+	std::string data_path;
+	u_int32_t offset;              // Where the next packet goes
+
+	// Index of the current segment
+	struct FlowId {
+		u_int32_t id;
+		FlowId() : id(0) { }
+	};
+	FlowTable<Connection, FlowId> flow_ids;
+	std::vector<Connection> flow_keys;              // By id
+	std::vector<u_int32_t> flow_hashes;
+	std::vector<u_int32_t> packet_flows;            // Flow id of each indexed packet
+	std::vector<u_int32_t> packet_offsets;
+	std::vector<StoreTimeEntry> times;
+	u_int64_t first_us;
+	u_int64_t last_us;
+
+	u_int64_t packets;
+	u_int64_t write_errors;
+
+	// Can't be copied
+	PacketStore(const PacketStore &other);
+	PacketStore &operator=(const PacketStore &other);
+};
+
+// Reads the packets of a flow back from a store directory
+
+class PacketStoreReader {
+public:
+	typedef IpPortConnection<in_addr_t,u_int16_t> Connection;
+
+	// Called for every packet found; data is only valid during the call
+	typedef void (*PacketCallback)(const PacketRecord & packet, void * context);
+
+	PacketStoreReader();
+	~PacketStoreReader();
+
+	// Finds the segments with an index
+	bool open(const char * directory);
+	inline unsigned int getSegmentCount() const { return segments.size(); }
+
+	// Packets of a connection captured between from_us and to_us (microseconds
+	// since the epoch), in capture order. Returns the number of packets.
+	unsigned int extract(const Connection & key, u_int64_t from_us, u_int64_t to_us,
+		PacketCallback callback, void * context);
+
+private:
+	unsigned int extractSegment(const std::string & name, const Connection & key, u_int64_t from_us, u_int64_t to_us,
+		PacketCallback callback, void * context);
+
+	std::string directory;
+	std::vector<std::string> segments;   // Names, without extension, in order
+	unsigned char * buffer;              // For one packet
+};
+
+// pcap file format, written without libpcap
+
+enum {
+	PCAP_MAGIC = 0xA1B2C3D4,
+	PCAP_LINKTYPE_ETHERNET = 1,
+};
+
+struct PcapFileHeader {
+	u_int32_t magic;
+	u_int16_t version_major;
+	u_int16_t version_minor;
+	int32_t thiszone;
+	u_int32_t sigfigs;
+	u_int32_t snaplen;
+	u_int32_t linktype;
+};
+
+struct PcapRecordHeader {
+	u_int32_t ts_sec;
+	u_int32_t ts_usec;
+	u_int32_t caplen;
+	u_int32_t len;
+};
+
+void initPcapFileHeader(PcapFileHeader & header, unsigned int snaplen);
+
+} // namespace filter
+
+#endif // PACKET_STORE_H_FBDCE0CA_CBDA_11F1_AB6C_02FC00000001_
@@ -0,0 +1,98 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "packet_summary.h"
+
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <netinet/ip.h>
+
+using namespace filter;
+
+bool filter::decodePacketSummary(const unsigned char * buffer, unsigned int len, PacketSummary & summary, int depth) {
+	memset(&summary, 0, sizeof(summary));
+	if (depth < DECODE_LINK) return false;
+
+	unsigned short ethhdrlen = sizeof(struct ethhdr);
+	if (len < ethhdrlen) {
+		summary.flags = SUMMARY_TRUNCATED;
+		return false;
+	}
+	const struct ethhdr * eth = (const struct ethhdr *) buffer;
+	summary.ethertype = ntohs(eth->h_proto);
+	summary.l3_offset = ethhdrlen;
+	if (summary.ethertype != ETH_P_IP || depth < DECODE_NETWORK) return false;
+
+	const struct iphdr * iph = (const struct iphdr *) (buffer + ethhdrlen);
+	if (len < ethhdrlen + sizeof(struct iphdr) || iph->version != 4 || iph->ihl < 5
+			|| len < ethhdrlen + iph->ihl*4u) {
+		summary.flags = SUMMARY_TRUNCATED;
+		return false;
+	}
+	summary.flags = SUMMARY_IP;
+	summary.saddr = iph->saddr;
+	summary.daddr = iph->daddr;
+	summary.protocol = iph->protocol;
+	summary.ip_len = ntohs(iph->tot_len);
+	summary.l4_offset = ethhdrlen + iph->ihl*4;
+	summary.payload_offset = summary.l4_offset;
+
+	if (ntohs(iph->frag_off) & IP_OFFMASK) {
+		summary.flags |= SUMMARY_FRAGMENT;
+		return true;
+	}
+	if (depth < DECODE_TRANSPORT) return true;
+
+	switch (iph->protocol) {
+		case IPPROTO_TCP: {
+			const struct tcphdr * tcph = (const struct tcphdr *) (buffer + summary.l4_offset);
+			if (len < summary.l4_offset + sizeof(struct tcphdr)) {
+				summary.flags |= SUMMARY_TRUNCATED;
+				break;
+			}
+			summary.sport = ntohs(tcph->source);
+			summary.dport = ntohs(tcph->dest);
+			summary.tcp_flags = buffer[summary.l4_offset + 13];
+			summary.payload_offset = summary.l4_offset + tcph->doff*4;
+			summary.flags |= SUMMARY_PORTS;
+			break;
+		}
+		case IPPROTO_UDP: {
+			const struct udphdr * udph = (const struct udphdr *) (buffer + summary.l4_offset);
+			if (len < summary.l4_offset + sizeof(struct udphdr)) {
+				summary.flags |= SUMMARY_TRUNCATED;
+				break;
+			}
+			summary.sport = ntohs(udph->source);
+			summary.dport = ntohs(udph->dest);
+			summary.payload_offset = summary.l4_offset + sizeof(struct udphdr);
+			summary.flags |= SUMMARY_PORTS;
+			break;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef PACKET_SUMMARY_H_4E67F2BC_CBD6_11F1_A596_02FC00000001_
+#define PACKET_SUMMARY_H_4E67F2BC_CBD6_11F1_A596_02FC00000001_
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+namespace filter {
+
+// Flat summary of the fields of a packet that are needed for keeping track of
+// the connections. It's filled in a single pass over the buffer, without
+// creating the list of headers (see headers.h), so it's cheap enough to be
+// used on every packet.
+
+enum {
+	SUMMARY_IP =        1 << 0, // IPv4 header present
+	SUMMARY_PORTS =     1 << 1, // TCP or UDP header present, ports are valid
+	SUMMARY_TRUNCATED = 1 << 2, // Captured data shorter than the headers
+	SUMMARY_FRAGMENT =  1 << 3, // Non-first IP fragment, no transport header
+	// Set by ChecksumValidator (checksum.h) only
+	SUMMARY_BAD_IP_CHECKSUM = 1 << 4,
+	SUMMARY_BAD_L4_CHECKSUM = 1 << 5, // TCP, UDP or ICMP
+	SUMMARY_L4_UNVERIFIED =   1 << 6, // Fragmented or truncated, L4 checksum can't be checked
+};
+
+// How far the headers are decoded. Every consumer of the summaries declares
+// the deepest layer it needs (see Sniffer::requireDecodeDepth()), so that the
+// data of the packets is never read further than that.
+enum {
+	DECODE_NONE = 0,
+	DECODE_LINK = 1,       // ethertype, l3_offset
+	DECODE_NETWORK = 2,    // IP addresses, protocol, length, fragments, l4_offset
+	DECODE_TRANSPORT = 3,  // Ports, TCP flags, payload_offset
+	DECODE_ALL = 4,        // Whole list of headers, application ones included (headers.h)
+};
+
+struct PacketSummary {
+	in_addr_t saddr;          // Network byte order
+	in_addr_t daddr;          // Network byte order
+	u_int16_t sport;          // Host byte order
+	u_int16_t dport;          // Host byte order
+	u_int16_t ethertype;      // Host byte order
+	u_int16_t ip_len;         // IP total length, host byte order
+	u_int16_t l3_offset;      // Offsets from the start of the frame
+	u_int16_t l4_offset;
+	u_int16_t payload_offset;
+	u_int8_t protocol;        // IP protocol number
+	u_int8_t tcp_flags;       // TH_FIN, TH_SYN, ... (netinet/tcp.h)
+	u_int8_t flags;           // SUMMARY_*
+};
+
+// Returns true if the packet carries an IPv4 header (always false below DECODE_NETWORK)
+bool decodePacketSummary(const unsigned char * buffer, unsigned int len, PacketSummary & summary,
+	int depth = DECODE_TRANSPORT);
+
+} // namespace filter
+
+#endif // PACKET_SUMMARY_H_4E67F2BC_CBD6_11F1_A596_02FC00000001_
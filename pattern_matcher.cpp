@@ -0,0 +1,283 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "pattern_matcher.h"
+#include "packet_columns.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+using namespace filter;
+
+// Pattern Set
+
+unsigned int PatternSet::add(const void * bytes, unsigned int len) {
+	patterns.push_back(std::string((const char *)bytes, len));
+	return patterns.size() - 1;
+}
+
+static int hexValue(int c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+bool PatternSet::loadFile(const char * filename) {
+	FILE * file = fopen(filename, "r");
+	if (!file) return false;
+
+	bool ok = true;
+	char line[4096];
+	while (fgets(line, sizeof(line), file)) {
+		size_t len = strlen(line);
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = 0;
+		if (len == 0 || line[0] == '#') continue;
+
+		if (strncmp(line, "hex:", 4) != 0) {
+			add(line, len);
+			continue;
+		}
+
+		std::string bytes;
+		int high = -1;
+		for (const char * c = line + 4; *c; c++) {
+			if (isspace((unsigned char)*c)) continue;
+			int v = hexValue(*c);
+			if (v < 0) { ok = false; break; }
+			if (high < 0) {
+				high = v;
+			} else {
+				bytes += (char)(high << 4 | v);
+				high = -1;
+			}
+		}
+		if (high >= 0) ok = false;
+		if (!ok) break;
+		add(bytes);
+	}
+
+	fclose(file);
+	return ok;
+}
+
+PatternMatcher * PatternSet::compile() const {
+	PatternMatcher * m = new PatternMatcher();
+	m->patterns = patterns;
+
+	// Input classes: one for each byte used in the patterns, 0 for the rest
+	memset(m->byte_class, 0, sizeof(m->byte_class));
+	memset(m->first_byte, 0, sizeof(m->first_byte));
+	memset(m->first_lo, 0, sizeof(m->first_lo));
+	memset(m->first_hi, 0, sizeof(m->first_hi));
+	unsigned int classes = 1;
+	for (unsigned int p = 0; p < patterns.size(); p++) {
+		const std::string & pattern = patterns[p];
+		if (pattern.empty()) continue;
+		for (unsigned int i = 0; i < pattern.size(); i++) {
+			unsigned char c = pattern[i];
+			if (!m->byte_class[c]) m->byte_class[c] = classes++;
+		}
+		unsigned char first = pattern[0];
+		m->first_byte[first] = 1;
+		if (first & 0x80)
+			m->first_hi[first & 0x0F] |= 1 << ((first >> 4) & 0x07);
+		else
+			m->first_lo[first & 0x0F] |= 1 << ((first >> 4) & 0x07);
+	}
+	m->class_count = classes;
+
+	// Trie of the patterns. Rows are offsets below MATCH_FLAG, so the table
+	// can't have more entries than that.
+	const u_int32_t NONE = 0xFFFFFFFF;
+	std::vector<u_int32_t> next(classes, NONE);
+	std::vector< std::vector<u_int32_t> > own(1);
+	unsigned int states = 1;
+	for (unsigned int p = 0; p < patterns.size(); p++) {
+		const std::string & pattern = patterns[p];
+		if (pattern.empty()) continue;
+		u_int32_t s = 0;
+		for (unsigned int i = 0; i < pattern.size(); i++) {
+			size_t index = (size_t)s * classes + m->byte_class[(unsigned char)pattern[i]];
+			if (next[index] == NONE) {
+				if ((size_t)(states + 1) * classes > PatternMatcher::MATCH_FLAG) {
+					delete m;
+					return NULL;
+				}
+				next[index] = states++;
+				next.resize((size_t)states * classes, NONE);
+				own.resize(states);
+			}
+			s = next[index];
+		}
+		own[s].push_back(p);
+	}
+	m->state_count = states;
+
+	// Failure links in breadth first order, turning the trie into a DFA
+	std::vector<u_int32_t> fail(states, 0);
+	std::vector<u_int32_t> order;
+	order.reserve(states);
+	for (unsigned int c = 0; c < classes; c++) {
+		u_int32_t & t = next[c];
+		if (t == NONE) {
+			t = 0;
+		} else {
+			fail[t] = 0;
+			order.push_back(t);
+		}
+	}
+	for (unsigned int q = 0; q < order.size(); q++) {
+		u_int32_t s = order[q];
+		for (unsigned int c = 0; c < classes; c++) {
+			u_int32_t & t = next[(size_t)s * classes + c];
+			if (t == NONE) {
+				t = next[(size_t)fail[s] * classes + c];
+			} else {
+				fail[t] = next[(size_t)fail[s] * classes + c];
+				order.push_back(t);
+			}
+		}
+	}
+
+	// Matches of every state: its own patterns plus those of its failure state
+	std::vector< std::vector<u_int32_t> > out(states);
+	for (unsigned int q = 0; q < order.size(); q++) {
+		u_int32_t s = order[q];
+		out[s] = own[s];
+		out[s].insert(out[s].end(), out[fail[s]].begin(), out[fail[s]].end());
+	}
+	m->match_index.resize(states + 1);
+	for (unsigned int s = 0; s < states; s++) {
+		m->match_index[s] = m->matches.size();
+		m->matches.insert(m->matches.end(), out[s].begin(), out[s].end());
+	}
+	m->match_index[states] = m->matches.size();
+
+	m->table = new u_int32_t[(size_t)states * classes];
+	for (size_t i = 0; i < (size_t)states * classes; i++) {
+		u_int32_t t = next[i];
+		m->table[i] = t * classes | (out[t].empty() ? 0 : PatternMatcher::MATCH_FLAG);
+	}
+
+	return m;
+}
+
+// Pattern Matcher
+
+PatternMatcher::~PatternMatcher() {
+	delete[] table;
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Byte set membership with two nibble lookups (the "truffle" method): the low
+// nibble of the byte selects a mask, bits 4-6 select the bit inside it, and
+// bit 7 selects which one of the two tables is used.
+
+__attribute__((target("ssse3")))
+static unsigned int skipSse(const unsigned char * data, unsigned int pos, unsigned int len,
+		const u_int8_t * lo, const u_int8_t * hi) {
+	const __m128i mask_lo = _mm_loadu_si128((const __m128i *)lo);
+	const __m128i mask_hi = _mm_loadu_si128((const __m128i *)hi);
+	const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+	const __m128i high_bit = _mm_set1_epi8((char)0x80);
+	const __m128i nibble = _mm_set1_epi8(0x07);
+
+	for (; pos + 16 <= len; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + pos));
+		__m128i found = _mm_or_si128(_mm_shuffle_epi8(mask_lo, v), _mm_shuffle_epi8(mask_hi, _mm_xor_si128(v, high_bit)));
+		__m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+		__m128i hit = _mm_cmpeq_epi8(_mm_and_si128(found, bit), _mm_setzero_si128());
+		unsigned int mask = ~_mm_movemask_epi8(hit) & 0xFFFF;
+		if (mask) return pos + __builtin_ctz(mask);
+	}
+	return pos;
+}
+
+__attribute__((target("avx2")))
+static unsigned int skipAvx2(const unsigned char * data, unsigned int pos, unsigned int len,
+		const u_int8_t * lo, const u_int8_t * hi) {
+	const __m256i mask_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+	const __m256i mask_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+	const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128,
+		1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+	const __m256i high_bit = _mm256_set1_epi8((char)0x80);
+	const __m256i nibble = _mm256_set1_epi8(0x07);
+
+	for (; pos + 32 <= len; pos += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + pos));
+		__m256i found = _mm256_or_si256(_mm256_shuffle_epi8(mask_lo, v), _mm256_shuffle_epi8(mask_hi, _mm256_xor_si256(v, high_bit)));
+		__m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+		__m256i hit = _mm256_cmpeq_epi8(_mm256_and_si256(found, bit), _mm256_setzero_si256());
+		unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(hit);
+		if (mask) return pos + __builtin_ctz(mask);
+	}
+	return pos;
+}
+
+#endif // HAVE_X86_SIMD
+
+// Position of the next byte that can start a match, len if there is none
+unsigned int PatternMatcher::skip(const unsigned char * data, unsigned int pos, unsigned int len) const {
+#ifdef HAVE_X86_SIMD
+	int level = getSimdLevel();
+	if (level >= SIMD_AVX2)
+		pos = skipAvx2(data, pos, len, first_lo, first_hi);
+	else if (level >= SIMD_SSE42)
+		pos = skipSse(data, pos, len, first_lo, first_hi);
+#endif
+	while (pos < len && !first_byte[data[pos]]) pos++;
+	return pos;
+}
+
+unsigned int PatternMatcher::scan(const unsigned char * data, unsigned int len, u_int32_t & state,
+		MatchCallback callback, void * context) const {
+	unsigned int found = 0;
+	u_int32_t s = state;
+	unsigned int i = 0;
+	while (i < len) {
+		if (s == START_STATE) {
+			i = skip(data, i, len);
+			if (i >= len) break;
+		}
+		u_int32_t t = table[s + byte_class[data[i++]]];
+		s = t & ~MATCH_FLAG;
+		if (t & MATCH_FLAG) {
+			unsigned int state_id = s / class_count;
+			for (unsigned int m = match_index[state_id]; m < match_index[state_id + 1]; m++) {
+				found++;
+				if (callback) callback(matches[m], i, context);
+			}
+		}
+	}
+	state = s;
+	return found;
+}
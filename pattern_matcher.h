@@ -0,0 +1,120 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef PATTERN_MATCHER_H_56698CD6_CBD7_11F1_9975_02FC00000001_
+#define PATTERN_MATCHER_H_56698CD6_CBD7_11F1_9975_02FC00000001_
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+namespace filter {
+
+class PatternMatcher;
+
+// Set of byte patterns (signatures) to look for in the payloads. Building the
+// matcher is expensive, so it's meant to be done away from the capture thread
+// and then handed to Sniffer::setPatternMatcher().
+
+class PatternSet {
+public:
+	// Returns the ID of the new pattern, patterns are numbered from 0
+	unsigned int add(const void * bytes, unsigned int len);
+	unsigned int add(const std::string & text) { return add(text.data(), text.size()); }
+
+	// One pattern per line. Lines starting with "hex:" contain the bytes of
+	// the pattern in hexadecimal, other lines are taken literally. Empty lines
+	// and lines starting with '#' are ignored. Returns false on errors.
+	bool loadFile(const char * filename);
+
+	inline unsigned int size() const { return patterns.size(); }
+
+	// NULL if the automaton would need more than 2^31 transitions (states
+	// times byte classes), about 8 million states with all the bytes used
+	PatternMatcher * compile() const;
+
+private:
+	std::vector<std::string> patterns;
+};
+
+// Aho-Corasick automaton compiled into a DFA. Bytes that don't appear in any
+// pattern share a single input class, so the transition table only has a
+// column for each distinct byte used in the patterns. Inside the initial state,
+// the input is skipped with a vector search for the first bytes of the
+// patterns, which is where most of the time is spent on normal traffic.
+//
+// The state of the scan can be kept between calls, so matches that span
+// several packets of a stream are found too. The matcher never changes once
+// it has been compiled, so it can be shared by several threads.
+
+class PatternMatcher {
+public:
+	static const u_int32_t START_STATE = 0;
+
+	typedef void (*MatchCallback)(unsigned int pattern, unsigned int end, void * context);
+
+	~PatternMatcher();
+
+	// Calls callback (if any) with the ID of every pattern found and the
+	// offset just past its end. Returns the number of matches.
+	unsigned int scan(const unsigned char * data, unsigned int len, u_int32_t & state,
+		MatchCallback callback = NULL, void * context = NULL) const;
+
+	inline unsigned int getPatternCount() const { return patterns.size(); }
+	inline const std::string & getPattern(unsigned int id) const { return patterns[id]; }
+	inline unsigned int getStateCount() const { return state_count; }
+
+	// Set by whoever publishes the matcher, to tell the scan states of this
+	// matcher apart from those of the matchers used before
+	inline u_int16_t getGeneration() const { return generation; }
+	inline void setGeneration(u_int16_t g) { generation = g; }
+
+private:
+	friend class PatternSet;
+	PatternMatcher() : table(NULL), class_count(0), state_count(0), generation(0) { }
+
+	unsigned int skip(const unsigned char * data, unsigned int pos, unsigned int len) const;
+
+	static const u_int32_t MATCH_FLAG = 0x80000000;
+
+	u_int32_t * table;         // Next row offset (state * class_count) | MATCH_FLAG
+	unsigned int class_count;
+	unsigned int state_count;
+	u_int16_t generation;
+	u_int16_t byte_class[256];  // Up to 257 classes: 0 for the bytes not in any pattern
+	u_int8_t first_byte[256];  // Non zero if some pattern starts with the byte
+	u_int8_t first_lo[16];     // First bytes as nibble masks, for the vector search
+	u_int8_t first_hi[16];
+
+	std::vector<u_int32_t> match_index; // Patterns of state s: matches[match_index[s] .. match_index[s+1]-1]
+	std::vector<u_int32_t> matches;
+	std::vector<std::string> patterns;
+
+	// Can't be copied
+	PatternMatcher(const PatternMatcher &other);
+	PatternMatcher &operator=(const PatternMatcher &other);
+};
+
+} // namespace filter
+
+#endif // PATTERN_MATCHER_H_56698CD6_CBD7_11F1_9975_02FC00000001_
@@ -0,0 +1,70 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Compiles a text file of prefixes into the binary format mapped by
+// PrefixTable::open():
+//
+//   prefix_build INPUT OUTPUT
+//
+// Each line of INPUT is a prefix and its tag, e.g. "10.0.0.0/8 1" or
+// "2001:db8::/32 7". Empty lines and lines starting with # are ignored.
+// OUTPUT is replaced atomically, so a running sniffer can reload it. The
+// sizes of the tables written are printed, to keep an eye on the IPv6 nodes.
+
+#include "prefix_table.h"
+
+#include <stdio.h>
+
+using namespace filter;
+
+int main(int argc, char * argv[])
+{
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s INPUT OUTPUT\n", argv[0]);
+		return 1;
+	}
+
+	PrefixTableBuilder builder;
+	unsigned int error_line = 0;
+	if (!builder.loadFile(argv[1], &error_line)) {
+		if (error_line) fprintf(stderr, "%s:%u: invalid prefix\n", argv[1], error_line);
+		else fprintf(stderr, "Can't read %s\n", argv[1]);
+		return 1;
+	}
+	if (!builder.write(argv[2])) {
+		fprintf(stderr, "Can't write %s\n", argv[2]);
+		return 1;
+	}
+	PrefixTable * table = PrefixTable::open(argv[2]);
+	if (!table) {
+		fprintf(stderr, "Can't read back %s\n", argv[2]);
+		return 1;
+	}
+	const PrefixFileHeader & header = table->getHeader();
+	printf("IPv4: %u prefixes, %u groups of 256 entries\n", header.prefixes4, header.groups);
+	printf("IPv6: %u prefixes, %u nodes of %u bytes, %u tags (%lu KB)\n", header.prefixes6, header.nodes,
+		(unsigned int)sizeof(PrefixNode6), header.leaves,
+		(unsigned long)(((size_t)header.nodes * sizeof(PrefixNode6) + (size_t)header.leaves * sizeof(u_int32_t)) / 1024));
+	delete table;
+	return 0;
+}
@@ -0,0 +1,338 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "prefix_table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+using namespace filter;
+
+static const size_t TBL24_SIZE = 1 << 24;
+
+static inline size_t prefixFileSize(u_int32_t groups, u_int32_t nodes, u_int32_t leaves) {
+	return sizeof(PrefixFileHeader) + (TBL24_SIZE + (size_t)groups * 256) * sizeof(u_int32_t)
+		+ (size_t)nodes * sizeof(PrefixNode6) + (size_t)leaves * sizeof(u_int32_t);
+}
+
+// Table
+
+PrefixTable::PrefixTable(void * d, size_t s, bool m) : data(d), size(s), mapped(m) {
+	header = (const PrefixFileHeader *)data;
+	tbl24 = (const u_int32_t *)(header + 1);
+	tbl8 = tbl24 + TBL24_SIZE;
+	nodes6 = (const PrefixNode6 *)(tbl8 + (size_t)header->groups * 256);
+	leaves6 = (const u_int32_t *)(nodes6 + header->nodes);
+}
+
+PrefixTable::~PrefixTable() {
+	if (mapped) munmap(data, size);
+	else free(data);
+}
+
+PrefixTable * PrefixTable::open(const char * path) {
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	void * map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= prefixFileSize(0, 0, 0))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) return NULL;
+
+	const PrefixFileHeader * header = (const PrefixFileHeader *)map;
+	if (header->magic != PREFIX_FILE_MAGIC || header->version != PREFIX_FILE_VERSION || header->nodes < 1
+			|| (size_t)st.st_size != prefixFileSize(header->groups, header->nodes, header->leaves)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	return new PrefixTable(map, st.st_size, true);
+}
+
+u_int32_t PrefixTable::lookup6(const struct in6_addr & addr) const {
+	const PrefixNode6 * node = nodes6;
+	for (unsigned int i = 0; i < 16; i++) {
+		unsigned int word = addr.s6_addr[i] >> 6;
+		u_int64_t bit = (u_int64_t)1 << (addr.s6_addr[i] & 63);
+		if (node->child_bits[word] & bit) {
+			node = nodes6 + node->child_base + node->child_rank[word] + __builtin_popcountll(node->child_bits[word] & (bit - 1));
+			continue;
+		}
+		// The run of the byte is the last one started at or below it
+		return leaves6[node->leaf_base + node->leaf_rank[word] + __builtin_popcountll(node->leaf_bits[word] & (bit | (bit - 1))) - 1];
+	}
+	return 0; // Not reached, /128 prefixes are stored in the last level
+}
+
+// Builder
+
+PrefixTableBuilder::PrefixTableBuilder() {
+}
+
+bool PrefixTableBuilder::add4(u_int32_t addr, unsigned int len, u_int32_t tag) {
+	if (len > 32 || tag == 0 || tag > PREFIX_TAG_MAX) return false;
+	if (len < 32) addr &= len ? ~0u << (32 - len) : 0;
+	Prefix prefix;
+	memset(&prefix, 0, sizeof(prefix));
+	u_int32_t network = htonl(addr);
+	memcpy(prefix.addr, &network, 4);
+	prefix.len = len;
+	prefix.tag = tag;
+	prefix.order = prefixes4.size();
+	prefixes4.push_back(prefix);
+	return true;
+}
+
+bool PrefixTableBuilder::add6(const struct in6_addr & addr, unsigned int len, u_int32_t tag) {
+	if (len > 128 || tag == 0 || tag > PREFIX_TAG_MAX) return false;
+	Prefix prefix;
+	memset(&prefix, 0, sizeof(prefix));
+	for (unsigned int i = 0; i < 16; i++) {
+		if (len >= (i + 1) * 8) prefix.addr[i] = addr.s6_addr[i];
+		else if (len > i * 8) prefix.addr[i] = addr.s6_addr[i] & (0xFF << (8 - (len - i * 8)));
+	}
+	prefix.len = len;
+	prefix.tag = tag;
+	prefix.order = prefixes6.size();
+	prefixes6.push_back(prefix);
+	return true;
+}
+
+bool PrefixTableBuilder::add(const char * cidr, u_int32_t tag) {
+	char text[INET6_ADDRSTRLEN + 8];
+	if (strlen(cidr) >= sizeof(text)) return false;
+	strcpy(text, cidr);
+	long len = -1;
+	char * slash = strchr(text, '/');
+	if (slash) {
+		char * end;
+		*slash = '\0';
+		len = strtol(slash + 1, &end, 10);
+		if (end == slash + 1 || *end != '\0' || len < 0) return false;
+	}
+	struct in_addr addr4;
+	struct in6_addr addr6;
+	if (inet_pton(AF_INET, text, &addr4) == 1)
+		return add4(ntohl(addr4.s_addr), len < 0 ? 32 : len, tag);
+	if (inet_pton(AF_INET6, text, &addr6) == 1)
+		return add6(addr6, len < 0 ? 128 : len, tag);
+	return false;
+}
+
+bool PrefixTableBuilder::loadFile(const char * path, unsigned int * error_line) {
+	FILE * file = fopen(path, "r");
+	if (!file) return false;
+	char line[256];
+	unsigned int number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), file)) {
+		number++;
+		char * comment = strchr(line, '#');
+		if (comment) *comment = '\0';
+		char prefix[INET6_ADDRSTRLEN + 8];
+		unsigned long tag;
+		char extra;
+		int fields = sscanf(line, "%53s %lu %c", prefix, &tag, &extra);
+		if (fields <= 0) continue; // Empty line
+		ok = fields == 2 && add(prefix, tag);
+	}
+	if (!ok && error_line) *error_line = number;
+	fclose(file);
+	return ok;
+}
+
+// Shorter prefixes first, so that longer ones overwrite them. The entries
+// being filled are then never extended yet: groups and nodes are only
+// created below the prefixes that are longer than the current one.
+bool PrefixTableBuilder::shorter(const Prefix & a, const Prefix & b) {
+	if (a.len != b.len) return a.len < b.len;
+	return a.order < b.order;
+}
+
+// By address, so that the prefixes below each node are contiguous
+bool PrefixTableBuilder::lower(const Prefix & a, const Prefix & b) {
+	int c = memcmp(a.addr, b.addr, sizeof(a.addr));
+	if (c != 0) return c < 0;
+	return shorter(a, b);
+}
+
+void PrefixTableBuilder::compile() {
+	std::sort(prefixes4.begin(), prefixes4.end(), shorter);
+	std::sort(prefixes6.begin(), prefixes6.end(), lower);
+
+	tbl24.assign(TBL24_SIZE, 0);
+	tbl8.clear();
+	for (size_t i = 0; i < prefixes4.size(); i++) {
+		const Prefix & prefix = prefixes4[i];
+		u_int32_t network;
+		memcpy(&network, prefix.addr, 4);
+		u_int32_t addr = ntohl(network);
+		if (prefix.len <= 24) {
+			std::fill(tbl24.begin() + (addr >> 8), tbl24.begin() + (addr >> 8) + (1u << (24 - prefix.len)), prefix.tag);
+			continue;
+		}
+		u_int32_t & entry = tbl24[addr >> 8];
+		if (!(entry & PREFIX_EXTENDED)) {
+			u_int32_t group = tbl8.size() / 256;
+			tbl8.resize(tbl8.size() + 256, entry);
+			entry = group | PREFIX_EXTENDED;
+		}
+		size_t start = ((size_t)(entry & ~PREFIX_EXTENDED) << 8) | (addr & 0xFF);
+		std::fill(tbl8.begin() + start, tbl8.begin() + start + (1u << (32 - prefix.len)), prefix.tag);
+	}
+
+	nodes6.assign(1, PrefixNode6());
+	leaves6.clear();
+	compileNode6(0, 0, 0, prefixes6.size(), 0);
+}
+
+// Fills the node at the given index from the prefixes in [begin, end), all of
+// them sharing its first level bytes; below the root, those not longer than
+// level * 8 belong to its ancestors and are skipped. The children are allocated together, so
+// that they can be found from child_base, and then filled one by one.
+void PrefixTableBuilder::compileNode6(u_int32_t index, unsigned int level, size_t begin, size_t end, u_int32_t inherited) {
+	unsigned int limit = (level + 1) * 8;
+	u_int32_t entries[256];
+	std::fill(entries, entries + 256, inherited);
+	std::vector<Prefix> ending;
+	PrefixNode6 node;
+	memset(&node, 0, sizeof(node));
+	for (size_t i = begin; i < end; i++) {
+		const Prefix & prefix = prefixes6[i];
+		if (level && prefix.len <= level * 8) continue;
+		if (prefix.len <= limit) ending.push_back(prefix);
+		else node.child_bits[prefix.addr[level] >> 6] |= (u_int64_t)1 << (prefix.addr[level] & 63);
+	}
+	std::sort(ending.begin(), ending.end(), shorter);
+	for (size_t i = 0; i < ending.size(); i++) {
+		const Prefix & prefix = ending[i];
+		std::fill(entries + prefix.addr[level], entries + prefix.addr[level] + (1u << (limit - prefix.len)), prefix.tag);
+	}
+
+	unsigned int children = 0;
+	bool started = false;
+	node.leaf_base = leaves6.size();
+	for (unsigned int byte = 0; byte < 256; byte++) {
+		u_int64_t bit = (u_int64_t)1 << (byte & 63);
+		if (node.child_bits[byte >> 6] & bit) {
+			children++;
+			continue;
+		}
+		if (!started || entries[byte] != leaves6.back()) {
+			node.leaf_bits[byte >> 6] |= bit;
+			leaves6.push_back(entries[byte]);
+			started = true;
+		}
+	}
+	for (unsigned int word = 1; word < 4; word++) {
+		node.child_rank[word] = node.child_rank[word - 1] + __builtin_popcountll(node.child_bits[word - 1]);
+		node.leaf_rank[word] = node.leaf_rank[word - 1] + __builtin_popcountll(node.leaf_bits[word - 1]);
+	}
+	node.child_base = nodes6.size();
+	nodes6[index] = node;
+	nodes6.resize(nodes6.size() + children, PrefixNode6());
+
+	u_int32_t child = node.child_base;
+	size_t i = begin;
+	while (i < end) {
+		const Prefix & prefix = prefixes6[i];
+		if (prefix.len <= limit) {
+			i++;
+			continue;
+		}
+		unsigned char byte = prefix.addr[level];
+		size_t last = i + 1;
+		while (last < end && prefixes6[last].addr[level] == byte) last++;
+		compileNode6(child++, level + 1, i, last, entries[byte]);
+		i = last;
+	}
+}
+
+void PrefixTableBuilder::fillHeader(PrefixFileHeader & header) const {
+	memset(&header, 0, sizeof(header));
+	header.magic = PREFIX_FILE_MAGIC;
+	header.version = PREFIX_FILE_VERSION;
+	header.groups = tbl8.size() / 256;
+	header.nodes = nodes6.size();
+	header.prefixes4 = prefixes4.size();
+	header.prefixes6 = prefixes6.size();
+	header.leaves = leaves6.size();
+}
+
+// Written under another name first, so a table being reloaded is never partial
+bool PrefixTableBuilder::write(const char * path) {
+	compile();
+	PrefixFileHeader header;
+	fillHeader(header);
+
+	std::string temporary = std::string(path) + ".tmp";
+	FILE * file = fopen(temporary.c_str(), "wb");
+	bool ok = file != NULL;
+	if (ok) {
+		ok = fwrite(&header, sizeof(header), 1, file) == 1;
+		ok = ok && fwrite(&tbl24[0], sizeof(u_int32_t), tbl24.size(), file) == tbl24.size();
+		if (!tbl8.empty()) ok = ok && fwrite(&tbl8[0], sizeof(u_int32_t), tbl8.size(), file) == tbl8.size();
+		ok = ok && fwrite(&nodes6[0], sizeof(PrefixNode6), nodes6.size(), file) == nodes6.size();
+		if (!leaves6.empty()) ok = ok && fwrite(&leaves6[0], sizeof(u_int32_t), leaves6.size(), file) == leaves6.size();
+		ok = (fclose(file) == 0) && ok;
+		if (ok) ok = rename(temporary.c_str(), path) == 0;
+		if (!ok) unlink(temporary.c_str());
+	}
+
+	std::vector<u_int32_t>().swap(tbl24);
+	std::vector<u_int32_t>().swap(tbl8);
+	std::vector<PrefixNode6>().swap(nodes6);
+	std::vector<u_int32_t>().swap(leaves6);
+	return ok;
+}
+
+PrefixTable * PrefixTableBuilder::build() {
+	compile();
+	PrefixFileHeader header;
+	fillHeader(header);
+	size_t size = prefixFileSize(header.groups, header.nodes, header.leaves);
+	unsigned char * data = (unsigned char *)malloc(size);
+	if (!data) abort();
+
+	unsigned char * p = data;
+	memcpy(p, &header, sizeof(header));                           p += sizeof(header);
+	memcpy(p, &tbl24[0], tbl24.size() * sizeof(u_int32_t));       p += tbl24.size() * sizeof(u_int32_t);
+	if (!tbl8.empty()) memcpy(p, &tbl8[0], tbl8.size() * sizeof(u_int32_t));
+	p += tbl8.size() * sizeof(u_int32_t);
+	memcpy(p, &nodes6[0], nodes6.size() * sizeof(PrefixNode6));     p += nodes6.size() * sizeof(PrefixNode6);
+	if (!leaves6.empty()) memcpy(p, &leaves6[0], leaves6.size() * sizeof(u_int32_t));
+
+	std::vector<u_int32_t>().swap(tbl24);
+	std::vector<u_int32_t>().swap(tbl8);
+	std::vector<PrefixNode6>().swap(nodes6);
+	std::vector<u_int32_t>().swap(leaves6);
+	return new PrefixTable(data, size, false);
+}
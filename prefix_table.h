@@ -0,0 +1,182 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef PREFIX_TABLE_H_C56167CA_CBDD_11F1_9C81_02FC00000001_
+#define PREFIX_TABLE_H_C56167CA_CBDD_11F1_9C81_02FC00000001_
+
+#include "ip_port_connection.h"
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+
+namespace filter {
+
+// Longest prefix match of IPv4 and IPv6 addresses against a list of CIDR
+// prefixes, each with a tag (a number chosen by the user: a list, a subnet,
+// an AS...). Tags go from 1 to PREFIX_TAG_MAX, 0 means no prefix matched.
+//
+// IPv4 uses DIR-24-8: a table indexed by the first 24 bits of the address
+// holds the tag, or the number of a group of 256 entries indexed by the last
+// 8 bits for the prefixes longer than /24. A lookup is one memory access, two
+// for those. IPv6 uses a multibit trie with 8 bit strides, one node per byte
+// of the prefix. Nodes are compressed as in Poptrie: a bitmap of the bytes
+// that lead to a child, whose children are stored one after the other, and
+// a bitmap of the bytes where a run of equal tags starts, with one tag per
+// run. The popcount of the bits below the byte gives the child or the tag.
+//
+// A node takes sizeof(PrefixNode6) (88 bytes) plus 4 bytes per run, and a
+// prefix adds at most one node per byte of its length beyond the first,
+// so a million disjoint /48 take at most 5 nodes of 1 to 3 runs each, ~470 MB,
+// and much less when they share their first bytes, as real tables do. The
+// builder never holds more than that either. prefix_build reports the sizes.
+//
+// Tables are built by PrefixTableBuilder, usually into a file (prefix_build)
+// that is mapped as it is, without any parsing, so loading even a million
+// prefixes is immediate. A table never changes once built; new versions are
+// swapped in (Sniffer::setPrefixTable()).
+//
+// File layout, host byte order:
+//
+//   PrefixFileHeader
+//   u_int32_t tbl24[1 << 24]
+//   u_int32_t tbl8[groups * 256]
+//   PrefixNode6 nodes6[nodes]         // Node 0 is the root
+//   u_int32_t leaves6[leaves]
+
+enum {
+	PREFIX_FILE_MAGIC = 0x544D504C, // "LPMT"
+	PREFIX_FILE_VERSION = 2,
+	PREFIX_TAG_MAX = 0x7FFFFFFF,
+	PREFIX_EXTENDED = 0x80000000,   // Entry points to a group or node
+};
+
+struct PrefixFileHeader {
+	u_int32_t magic;
+	u_int32_t version;
+	u_int32_t groups;         // tbl8 groups of 256 entries
+	u_int32_t nodes;          // IPv6 nodes
+	u_int32_t prefixes4;
+	u_int32_t prefixes6;
+	u_int32_t leaves;         // IPv6 tags, one per run
+	u_int32_t reserved;
+};
+
+struct PrefixNode6 {
+	u_int64_t child_bits[4];  // Bytes that lead to a child node
+	u_int64_t leaf_bits[4];   // Bytes that start a run of equal tags, out of the others
+	u_int16_t child_rank[4];  // Bits set in the previous words
+	u_int16_t leaf_rank[4];
+	u_int32_t child_base;     // First child in nodes6
+	u_int32_t leaf_base;      // First tag in leaves6
+};
+
+class PrefixTable {
+public:
+	~PrefixTable();
+
+	// Maps a file written by PrefixTableBuilder, NULL if it isn't valid
+	static PrefixTable * open(const char * path);
+
+	// addr in network byte order
+	inline u_int32_t lookup(in_addr_t addr) const {
+		u_int32_t a = ntohl(addr);
+		u_int32_t entry = tbl24[a >> 8];
+		if (entry & PREFIX_EXTENDED)
+			entry = tbl8[((entry & ~PREFIX_EXTENDED) << 8) | (a & 0xFF)];
+		return entry;
+	}
+	u_int32_t lookup6(const struct in6_addr & addr) const;
+
+	// Tags of both addresses of a connection
+	inline void lookup(const IpPortConnection<in_addr_t,u_int16_t> & key, u_int32_t & low_tag, u_int32_t & high_tag) const {
+		low_tag = lookup(key.low.addr);
+		high_tag = lookup(key.high.addr);
+	}
+
+	inline const PrefixFileHeader & getHeader() const { return *header; }
+
+private:
+	friend class PrefixTableBuilder;
+	PrefixTable(void * data, size_t size, bool mapped);
+
+	void * data;
+	size_t size;
+	bool mapped;              // Else allocated with malloc()
+	const PrefixFileHeader * header;
+	const u_int32_t * tbl24;
+	const u_int32_t * tbl8;
+	const PrefixNode6 * nodes6;
+	const u_int32_t * leaves6;
+
+	// Can't be copied
+	PrefixTable(const PrefixTable &other);
+	PrefixTable &operator=(const PrefixTable &other);
+};
+
+class PrefixTableBuilder {
+public:
+	PrefixTableBuilder();
+
+	// "192.168.0.0/16" or "2001:db8::/32"; a plain address is a full length prefix
+	bool add(const char * cidr, u_int32_t tag);
+	// addr in host byte order
+	bool add4(u_int32_t addr, unsigned int len, u_int32_t tag);
+	bool add6(const struct in6_addr & addr, unsigned int len, u_int32_t tag);
+
+	// One "PREFIX TAG" per line, '#' starts a comment. Returns false on
+	// errors, with the line number in error_line.
+	bool loadFile(const char * path, unsigned int * error_line = NULL);
+
+	inline unsigned int size() const { return prefixes4.size() + prefixes6.size(); }
+
+	// Both can be called from any thread, away from the capture
+	bool write(const char * path);
+	PrefixTable * build();
+
+private:
+	struct Prefix {
+		unsigned char addr[16];   // Network byte order, host bits cleared
+		u_int32_t tag;
+		u_int8_t len;
+		u_int32_t order;          // Later prefixes win over equal ones
+	};
+	std::vector<Prefix> prefixes4;
+	std::vector<Prefix> prefixes6;
+	static bool shorter(const Prefix & a, const Prefix & b);
+	static bool lower(const Prefix & a, const Prefix & b);
+
+	std::vector<u_int32_t> tbl24;
+	std::vector<u_int32_t> tbl8;
+	std::vector<PrefixNode6> nodes6;
+	std::vector<u_int32_t> leaves6;
+	void compile();
+	void compileNode6(u_int32_t index, unsigned int level, size_t begin, size_t end, u_int32_t inherited);
+	void fillHeader(PrefixFileHeader & header) const;
+};
+
+} // namespace filter
+
+#endif // PREFIX_TABLE_H_C56167CA_CBDD_11F1_9C81_02FC00000001_
@@ -42,14 +42,31 @@
 
 using namespace filter;
 
+// End of the IP payload of a packet: Ethernet padding is not included
+static inline unsigned int payloadEnd(const PacketSummary & summary, const PacketRecord & packet) {
+	unsigned int end = summary.l3_offset + summary.ip_len;
+	return end < packet.caplen ? end : packet.caplen;
+}
+
+static inline u_int64_t toMilliseconds(const struct timeval & tv) {
+	return (u_int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// Connections looked at for expiry for each packet decoded
+static const unsigned int EXPIRY_BUDGET = 4;
+// Slots of the connection table copied into the snapshot for each packet decoded
+static const unsigned int SNAPSHOT_BUDGET = 64;
+
 void Sniffer::loop(const char* devname) {
 	printf("Opening device %s for sniffing ... " , devname);
 
 	pcap_t* handle; // Handle of the device that shall be sniffed
 	char errbuf[100];
 
-	// Open device for sniffing
-	handle = pcap_open_live(devname , 65536 , 1 , 0 , errbuf);
+	// Open device for sniffing, with a read timeout so that connections
+	// still expire and the traffic rollups move on when there is no traffic,
+	// and so that a partial batch is still delivered when the traffic is low.
+	handle = pcap_open_live(devname , 65536 , 1 , 100 , errbuf);
 
 	if (handle == NULL) 
 	{
@@ -59,11 +76,611 @@ void Sniffer::loop(const char* devname) {
 
 	printf("Sniffing...\n");
 
-	// Put the device in sniff loop
-	pcap_loop(handle, -1, process_packet, (u_char*)this);
+	// Read up to batch_size packets from the device each time, decode them
+	// together. Without batching, packets are decoded one by one as read.
+	PacketBatch batch(batch_size > 1 ? batch_size : 1);
+	int count;
+	while ((count = batch_size > 1 ? pcap_dispatch(handle, batch_size, batch_packet, (u_char*)&batch)
+			: pcap_dispatch(handle, -1, process_packet, (u_char*)this)) >= 0) {
+		if (batch.size()) {
+			newPackets(batch);
+			batch.clear();
+		} else if (count == 0) { // Read timeout, connections still have to expire
+			unsigned int packets = batch_size > PacketBatch::DEFAULT_CAPACITY ? batch_size : PacketBatch::DEFAULT_CAPACITY;
+			struct timeval now;
+			gettimeofday(&now, NULL);
+			expireConnections(now, packets * EXPIRY_BUDGET);
+			updateSnapshot(now, packets * SNAPSHOT_BUDGET);
+			if (traffic_rollups) traffic_rollups->advance(now.tv_sec);
+		}
+	}
+	flushConnections();
 }
 
 void Sniffer::newPacket(const unsigned char * buffer, int size) {
+	if (duplicate_filter && duplicate_filter->isDuplicate(buffer, size, current_time))
+		return;
+
+	PacketRecord packet;
+	packet.data = buffer;
+	packet.caplen = packet.len = size;
+	packet.ts = current_time;
+
+	capture_epoch.enter();
+	current_filter = __atomic_load_n(&packet_filter, __ATOMIC_ACQUIRE);
+	if (current_filter && !current_filter->matches(packet)) {
+		__atomic_store_n(&filtered_packets, filtered_packets + 1, __ATOMIC_RELAXED);
+		current_filter = NULL;
+		capture_epoch.leave();
+		return;
+	}
+	current_matcher = __atomic_load_n(&pattern_matcher, __ATOMIC_ACQUIRE);
+	current_prefixes = __atomic_load_n(&prefix_table, __ATOMIC_ACQUIRE);
+
+	int depth = getDecodeDepth();
+	PacketSummary summary;
+	bool ip = decodePacketSummary(buffer, size, summary, depth);
+	if (traffic_counters && depth >= DECODE_NETWORK)
+		traffic_counters->update(summary, packet.len);
+	if (neighbour_table && depth >= DECODE_LINK)
+		learnNeighbours(summary, packet);
+	ip = ip && depth >= DECODE_TRANSPORT;
+	u_int32_t hash = 0;
+	if (ip) {
+		if (checksum_validator)
+			summary.flags |= checksum_validator->validate(summary, buffer, size);
+		hash = hashConnection(summary.saddr, summary.sport, summary.daddr, summary.dport);
+		if (track_connections)
+			updateConnection(summary, hash, packet);
+		if (traffic_rollups) traffic_rollups->update(summary, packet.ts.tv_sec);
+		if (attack_detector) detectAttacks(summary, packet);
+	}
+	if (packet_store) packet_store->add(packet, ip ? &summary : NULL, hash);
+	if (summary_publisher) summary_publisher->publishPacket(summary, hash, packet);
+
+	current_matcher = NULL;
+	current_prefixes = NULL;
+	current_filter = NULL;
+	capture_epoch.leave();
+
+	if (flight_recorder && flight_recorder->hasPendingDumps()) serveFlightDumps();
+	expireConnections(current_time, EXPIRY_BUDGET);
+	updateSnapshot(current_time, SNAPSHOT_BUDGET);
+
+	if (__atomic_load_n(&print_packets, __ATOMIC_RELAXED))
+		dissectPacket(buffer, size);
+}
+
+void Sniffer::newPackets(const PacketBatch & packets) {
+	capture_epoch.enter();
+	current_filter = __atomic_load_n(&packet_filter, __ATOMIC_ACQUIRE);
+	current_matcher = __atomic_load_n(&pattern_matcher, __ATOMIC_ACQUIRE);
+	current_prefixes = __atomic_load_n(&prefix_table, __ATOMIC_ACQUIRE);
+
+	const PacketBatch & batch = duplicate_filter || current_filter ? selectPackets(packets) : packets;
+	unsigned int count = batch.size();
+	PacketColumns & columns = batch_columns;
+
+	int depth = getDecodeDepth();
+	bool transport = depth >= DECODE_TRANSPORT;
+
+	// Stage 1: Start loading the L2/L3 headers of every packet
+	for (unsigned int i = 0; i < count; i++) {
+		__builtin_prefetch(batch[i].data);
+		__builtin_prefetch(batch[i].data + 64);
+	}
+
+	// Stage 2: Parse L3/L4 headers and hash the connections, several packets at a time
+	extractPacketColumns(batch, columns, SIMD_AUTO, depth);
+
+	// Stage 3: Start loading the buckets of the connections
+	if (transport && track_connections) {
+		for (unsigned int i = 0; i < count; i++) {
+			if (columns.flags[i] & SUMMARY_IP)
+				connections.prefetch(columns.hash[i]);
+		}
+	}
+
+	// Stage 4: Update the connections
+	PacketSummary summary;
+	for (unsigned int i = 0; i < count; i++) {
+		current_time = batch[i].ts;
+		bool ip = transport && (columns.flags[i] & SUMMARY_IP);
+		u_int32_t hash = ip ? columns.hash[i] : 0;
+		if (ip || traffic_counters || neighbour_table || summary_publisher)
+			columns.get(i, summary);
+		if (traffic_counters && depth >= DECODE_NETWORK)
+			traffic_counters->update(summary, batch[i].len);
+		if (neighbour_table && depth >= DECODE_LINK)
+			learnNeighbours(summary, batch[i]);
+		if (ip) {
+			if (checksum_validator) {
+				summary.flags |= checksum_validator->validate(summary, batch[i].data, batch[i].caplen);
+				columns.flags[i] = summary.flags;
+			}
+			if (track_connections)
+				updateConnection(summary, hash, batch[i]);
+			if (traffic_rollups) traffic_rollups->update(summary, batch[i].ts.tv_sec);
+			if (attack_detector) detectAttacks(summary, batch[i]);
+		}
+		if (packet_store) packet_store->add(batch[i], ip ? &summary : NULL, hash);
+		if (summary_publisher) summary_publisher->publishPacket(summary, hash, batch[i]);
+	}
+
+	current_matcher = NULL;
+	current_prefixes = NULL;
+	current_filter = NULL;
+	capture_epoch.leave();
+
+	if (flight_recorder && flight_recorder->hasPendingDumps()) serveFlightDumps();
+	if (count) {
+		expireConnections(batch[count - 1].ts, count * EXPIRY_BUDGET);
+		updateSnapshot(batch[count - 1].ts, count * SNAPSHOT_BUDGET);
+	}
+
+	if (__atomic_load_n(&print_packets, __ATOMIC_RELAXED)) {
+		for (unsigned int i = 0; i < count; i++) {
+			current_time = batch[i].ts;
+			dissectPacket(batch[i].data, batch[i].caplen);
+		}
+	}
+}
+
+// Connections removed to keep the table within the memory budget
+struct Sniffer::EvictionVisitor {
+	Sniffer * sniffer;
+
+	bool expendable(const Connection & key, const Status & status) const {
+		return status.protocol == IPPROTO_TCP && (!status.tcpEstablished() || status.tcpClosed());
+	}
+
+	void evicted(const Connection & key, Status & status) {
+		sniffer->finishConnection(key, status, FLOW_END_LACK_OF_RESOURCES);
+		sniffer->evicted_connections++;
+	}
+};
+
+Sniffer::Status & Sniffer::updateConnection(const PacketSummary & summary, u_int32_t hash, const PacketRecord & packet) {
+	Connection key(summary.saddr, summary.sport, summary.daddr, summary.dport);
+	u_int32_t now = flowTime(packet.ts);
+
+	EvictionVisitor eviction;
+	eviction.sniffer = this;
+	bool created;
+	Status & status = connections.insert(key, hash, max_connections, eviction, &created);
+	bool from_high = (key.high == IpPort<in_addr_t,u_int16_t>(summary.saddr, summary.sport));
+	if (created) {
+		status.record_start = now;
+		status.protocol = summary.protocol;
+		if (from_high) status.flags |= STATUS_FROM_HIGH;
+		if (summary_publisher) summary_publisher->publishPacket(summary, hash, packet, SUMMARY_RECORD_FLOW_START);
+		if (current_prefixes) {
+			u_int32_t low_tag, high_tag;
+			current_prefixes->lookup(key, low_tag, high_tag);
+			if (low_tag || high_tag) connectionTagged(key, status, low_tag, high_tag);
+		}
+		if (flight_recorder && flight_recorder->start(key, hash)) status.flags |= STATUS_RECORDING;
+	} else if (status.packets == 0xFFFFFFFF) { // Counter full, start a new record
+		exportConnection(key, status, FLOW_END_ACTIVE_TIMEOUT);
+		status.record_start = now;
+	}
+	status.last_seen = now;
+	status.packets++;
+	status.bytes += summary.ip_len;
+	status.tcp_flags |= summary.tcp_flags;
+	if (summary.protocol == IPPROTO_TCP)
+		status.updateTcpState(from_high ? 1 : 0, summary.tcp_flags);
+	if (status.flags & STATUS_RECORDING)
+		flight_recorder->add(key, hash, packet);
+	if (delta_reports && !(status.flags & STATUS_DIRTY)) {
+		status.flags |= STATUS_DIRTY;
+		DirtyConnection dirty;
+		dirty.key = key;
+		dirty.hash = hash;
+		dirty_connections.push_back(dirty);
+	}
+
+	if (tls_statistics && summary.protocol == IPPROTO_TCP) {
+		if (!(status.flags & STATUS_TLS_CHECKED) || (status.flags & STATUS_TLS_PENDING)) {
+			if (inspectTls(status, summary, packet)) // Names known: the connection so far
+				tls_statistics->update(status.tls_names, status.packets, status.bytes);
+		} else if (status.flags & STATUS_TLS) {
+			tls_statistics->update(status.tls_names, 1, summary.ip_len);
+		}
+	}
+
+	if (current_matcher && !(status.flags & STATUS_TLS))
+		matchPayload(key, status, summary, packet);
+
+	if (dns_statistics && summary.protocol == IPPROTO_UDP && (summary.sport == 53 || summary.dport == 53)) {
+		unsigned int end = payloadEnd(summary, packet);
+		if (summary.payload_offset < end)
+			dns_statistics->update(packet.data + summary.payload_offset, end - summary.payload_offset);
+	}
+
+	return status;
+}
+
+// Pattern Matching
+
+struct Sniffer::MatchContext {
+	Sniffer * sniffer;
+	const Connection * key;
+	Status * status;
+};
+
+void Sniffer::matchPayload(const Connection & key, Status & status, const PacketSummary & summary, const PacketRecord & packet) {
+	unsigned int end = payloadEnd(summary, packet);
+	if (summary.payload_offset >= end) return;
+
+	if (status.match_generation != current_matcher->getGeneration()) { // States of another matcher
+		status.match_state[0] = status.match_state[1] = PatternMatcher::START_STATE;
+		status.match_generation = current_matcher->getGeneration();
+	}
+	int direction = (key.low == IpPort<in_addr_t,u_int16_t>(summary.saddr, summary.sport)) ? 0 : 1;
+
+	MatchContext context;
+	context.sniffer = this;
+	context.key = &key;
+	context.status = &status;
+	current_matcher->scan(packet.data + summary.payload_offset, end - summary.payload_offset,
+		status.match_state[direction], match_found, &context);
+}
+
+void Sniffer::match_found(unsigned int pattern, unsigned int end, void * context) {
+	MatchContext * match = (MatchContext *)context;
+	Status & status = *match->status;
+	if (status.match_count < 0xFFFF) status.match_count++;
+	if (status.match_count == 1) {
+		status.first_match = pattern;
+		if (status.flags & STATUS_RECORDING) match->sniffer->dumpFlight(*match->key, "match");
+	}
+	match->sniffer->newMatch(*match->key, status, pattern);
+}
+
+void Sniffer::setPatternMatcher(PatternMatcher * matcher) {
+	if (matcher) matcher->setGeneration(__atomic_add_fetch(&matcher_generation, 1, __ATOMIC_RELAXED));
+	if (matcher) requireDecodeDepth(DECODE_TRANSPORT);
+	PatternMatcher * old = __atomic_exchange_n(&pattern_matcher, matcher, __ATOMIC_SEQ_CST);
+	if (old) releaseDecodeDepth(DECODE_TRANSPORT);
+	capture_epoch.synchronize();
+	delete old;
+}
+
+// TLS Inspection
+
+// The first segment with payload tells whether the connection is TLS; the
+// next ones are only looked at while the ClientHello goes on. Returns true
+// when the end of the ClientHello is reached.
+bool Sniffer::inspectTls(Status & status, const PacketSummary & summary, const PacketRecord & packet) {
+	unsigned int end = payloadEnd(summary, packet);
+	if (summary.payload_offset >= end) return false;
+	const unsigned char * payload = packet.data + summary.payload_offset;
+
+	TlsClientHello hello;
+	int result;
+	if (!(status.flags & STATUS_TLS_CHECKED)) {
+		status.flags |= STATUS_TLS_CHECKED;
+		result = tlsParseClientHello(payload, end - summary.payload_offset, hello);
+		if (result == TLS_NOT_HELLO) return false;
+		status.flags |= STATUS_TLS;
+		status.tls_names[0] = status.tls_names[1] = TlsNameTable::NONE;
+	} else {
+		hello.resume = status.tls_resume;
+		result = tlsResumeClientHello(payload, end - summary.payload_offset, hello);
+	}
+	tls_statistics->addNames(hello, status.tls_names);
+
+	if (result == TLS_HELLO_PARTIAL) {
+		status.flags |= STATUS_TLS_PENDING;
+		status.tls_resume = hello.resume;
+		return false;
+	}
+	status.flags &= ~STATUS_TLS_PENDING;
+	status.tls_resume = 0;
+	tls_statistics->helloDone(status.tls_names);
+	return true;
+}
+
+std::string Sniffer::getTlsServerName(const Status & status) const {
+	if (!(status.flags & STATUS_TLS) || status.tls_names[0] == TlsNameTable::NONE) return "";
+	return tls_statistics->getServerNames().getName(status.tls_names[0]);
+}
+
+std::string Sniffer::getTlsProtocol(const Status & status) const {
+	if (!(status.flags & STATUS_TLS) || status.tls_names[1] == TlsNameTable::NONE) return "";
+	return tls_statistics->getProtocols().getName(status.tls_names[1]);
+}
+
+void Sniffer::enableTlsInspection(unsigned int names_capacity) {
+	if (tls_statistics) return;
+	tls_statistics = new TlsStatistics(names_capacity);
+	requireDecodeDepth(DECODE_TRANSPORT);
+}
+
+void Sniffer::printTlsStatistics(std::ostream& out) {
+	if (tls_statistics)
+		tls_statistics->print(out);
+}
+
+// Neighbours
+
+void Sniffer::learnNeighbours(const PacketSummary & summary, const PacketRecord & packet) {
+	in_addr_t addr;
+	u_int64_t mac;
+	unsigned int source;
+	if (summary.ethertype == ETH_P_ARP) {
+		if (packet.caplen < summary.l3_offset + sizeof(struct arphdr) + sizeof(struct arphdr_eth_ipv4)) return;
+		const struct arphdr * arph = (const struct arphdr *)(packet.data + summary.l3_offset);
+		if (arph->ar_hrd != htons(ARPHRD_ETHER) || arph->ar_pro != htons(ETH_P_IP) || arph->ar_hln != ETH_ALEN || arph->ar_pln != 4)
+			return;
+		const struct arphdr_eth_ipv4 * addresses = (const struct arphdr_eth_ipv4 *)(arph + 1);
+		memcpy(&addr, addresses->ar_spa, sizeof(addr));
+		mac = macKey(addresses->ar_sha);
+		source = NeighbourTable::FROM_ARP;
+	} else if (learn_neighbours_from_ip && (summary.flags & SUMMARY_IP)) {
+		addr = summary.saddr;
+		mac = macKey(packet.data + ETH_ALEN);
+		source = NeighbourTable::FROM_IP;
+	} else {
+		return;
+	}
+	// Probes (0.0.0.0), and group addresses that can't be the source of a frame
+	if (!addr || (mac >> 40) & 0x01) return;
+
+	u_int64_t previous_mac;
+	if (neighbour_table->update(addr, mac, source, packet.ts.tv_sec, previous_mac) == NEIGHBOUR_CHANGED)
+		neighbourChanged(addr, previous_mac, mac, source);
+}
+
+void Sniffer::neighbourChanged(in_addr_t addr, u_int64_t previous_mac, u_int64_t mac, unsigned int source) {
+	NeighbourTable::printChange(std::cout, addr, previous_mac, mac, source);
+}
+
+void Sniffer::enableNeighbourTable(unsigned int capacity, bool from_ip) {
+	if (neighbour_table) return;
+	neighbour_table = new NeighbourTable(capacity);
+	learn_neighbours_from_ip = from_ip;
+	requireDecodeDepth(from_ip ? DECODE_NETWORK : DECODE_LINK);
+}
+
+void Sniffer::printNeighbours(std::ostream& out) {
+	if (neighbour_table)
+		neighbour_table->print(out);
+}
+
+void Sniffer::setPacketFilter(PacketFilter * filter) {
+	PacketFilter * old = __atomic_exchange_n(&packet_filter, filter, __ATOMIC_SEQ_CST);
+	capture_epoch.synchronize();
+	delete old;
+}
+
+void Sniffer::setPrefixTable(PrefixTable * table) {
+	PrefixTable * old = __atomic_exchange_n(&prefix_table, table, __ATOMIC_SEQ_CST);
+	capture_epoch.synchronize();
+	delete old;
+}
+
+// Flow Expiry and Export
+
+struct Sniffer::ExpiryVisitor {
+	Sniffer * sniffer;
+	u_int32_t now;
+	unsigned int idle_timeout;     // Read once per sweep, they can change at any time
+	unsigned int active_timeout;
+	unsigned int syn_timeout;
+	unsigned int close_linger;
+
+	bool operator()(const Connection & key, Status & status) {
+		unsigned int timeout = idle_timeout;
+		unsigned int reason = FLOW_END_IDLE_TIMEOUT;
+		if (status.protocol == IPPROTO_TCP) {
+			if (status.tcpClosed()) {
+				timeout = close_linger;
+				reason = FLOW_END_OF_FLOW;
+			} else if (!status.tcpEstablished() && syn_timeout < timeout) {
+				timeout = syn_timeout;
+			}
+		}
+
+		if ((int32_t)(now - status.last_seen) >= (int32_t)(timeout * 1000)) {
+			sniffer->finishConnection(key, status, reason);
+			return true;
+		}
+		if ((int32_t)(now - status.record_start) >= (int32_t)(active_timeout * 1000)) {
+			sniffer->exportConnection(key, status, FLOW_END_ACTIVE_TIMEOUT);
+			status.record_start = now;
+		}
+		return false;
+	}
+};
+
+void Sniffer::expireConnections(const struct timeval & now, unsigned int budget) {
+	ExpiryVisitor visitor;
+	visitor.sniffer = this;
+	visitor.now = flowTime(now);
+	visitor.idle_timeout = __atomic_load_n(&idle_timeout, __ATOMIC_RELAXED);
+	visitor.active_timeout = __atomic_load_n(&active_timeout, __ATOMIC_RELAXED);
+	visitor.syn_timeout = __atomic_load_n(&syn_timeout, __ATOMIC_RELAXED);
+	visitor.close_linger = __atomic_load_n(&close_linger, __ATOMIC_RELAXED);
+	connections.sweep(budget, visitor);
+}
+
+void Sniffer::flushConnections() {
+	for (ConnectionStatusMap::const_iterator it = connections.begin(); it != connections.end(); it++) {
+		Status status = it->second;
+		finishConnection(it->first, status, FLOW_END_FORCED);
+	}
+	connections.clear();
+}
+
+// The connection is about to be removed from the table
+void Sniffer::finishConnection(const Connection & key, Status & status, unsigned int reason) {
+	connectionFinished(key, status, reason);
+	if (status.flags & STATUS_RECORDING) {
+		flight_recorder->stop(key, key.hash());
+		status.flags &= ~STATUS_RECORDING;
+	}
+	if (delta_reports) {
+		closed_connections.resize(closed_connections.size() + 1);
+		makeFlowRecord(key, status, closed_connections.back());
+		closed_connections.back().end_reason = reason;
+	}
+	exportConnection(key, status, reason);
+}
+
+// Sends the record of the connection since record_start, and starts a new one
+void Sniffer::exportConnection(const Connection & key, Status & status, unsigned int reason) {
+	if ((flow_exporter || summary_publisher) && status.packets) {
+		FlowRecord record;
+		makeFlowRecord(key, status, record);
+		record.end_reason = reason;
+		if (flow_exporter) flow_exporter->push(record);
+		if (summary_publisher) summary_publisher->publishFlow(record);
+	}
+	status.packets = 0;
+	status.bytes = 0;
+}
+
+void Sniffer::makeFlowRecord(const Connection & key, const Status & status, FlowRecord & record) const {
+	bool from_high = (status.flags & STATUS_FROM_HIGH) != 0;
+	const IpPort<in_addr_t,u_int16_t> & src = from_high ? key.high : key.low;
+	const IpPort<in_addr_t,u_int16_t> & dst = from_high ? key.low : key.high;
+	record.saddr = src.addr;
+	record.daddr = dst.addr;
+	record.sport = src.port;
+	record.dport = dst.port;
+	record.protocol = status.protocol;
+	record.tcp_flags = status.tcp_flags;
+	record.end_reason = 0;
+	record.packets = status.packets;
+	record.bytes = status.bytes;
+	record.start_ms = flowTimeToMilliseconds(status.record_start);
+	record.end_ms = flowTimeToMilliseconds(status.last_seen);
+}
+
+// Query Snapshots
+
+struct Sniffer::SnapshotVisitor {
+	const Sniffer * sniffer;
+	FlowSnapshot * snapshot;
+
+	void operator()(const Connection & key, const Status & status) {
+		snapshot->flows.resize(snapshot->flows.size() + 1);
+		sniffer->makeFlowRecord(key, status, snapshot->flows.back());
+	}
+};
+
+void Sniffer::setQueryServer(FlowQueryServer * server, unsigned int interval_ms) {
+	query_server = server;
+	snapshot_interval = interval_ms;
+	delete snapshot;
+	snapshot = NULL;
+	snapshot_ms = 0;
+}
+
+void Sniffer::updateSnapshot(const struct timeval & now, unsigned int budget) {
+	if (!query_server) return;
+	u_int64_t now_ms = toMilliseconds(now);
+	if (!snapshot) {
+		if (now_ms - snapshot_ms < snapshot_interval) return;
+		snapshot = new FlowSnapshot;
+		snapshot->flows.reserve(connections.size());
+		snapshot_position = 0;
+		snapshot_complete = false;
+	}
+
+	if (!snapshot_complete) {
+		SnapshotVisitor visitor;
+		visitor.sniffer = this;
+		visitor.snapshot = snapshot;
+		snapshot_complete = connections.scan(snapshot_position, budget, visitor);
+		snapshot->time_ms = now_ms;
+	}
+
+	// The previous snapshot might still be in use, then just try again later
+	if (snapshot_complete && query_server->publish(snapshot)) {
+		snapshot = NULL;
+		snapshot_ms = now_ms;
+	}
+}
+
+// TCP State
+
+void Sniffer::Status::updateTcpState(unsigned int direction, u_int8_t flags) {
+	if (flags & TH_RST) {
+		tcp_state = TCP_STATE_CLOSED | TCP_STATE_CLOSED << 4;
+		return;
+	}
+
+	unsigned int own = tcpState(direction);
+	unsigned int other = tcpState(1 - direction);
+	if (flags & TH_ACK) { // Acknowledges the SYN or the FIN of the other side
+		if (other == TCP_STATE_SYN_SENT) other = TCP_STATE_ESTABLISHED;
+		else if (other == TCP_STATE_FIN_WAIT) other = TCP_STATE_CLOSED;
+	}
+	if (flags & TH_SYN) {
+		if (own == TCP_STATE_NONE) own = TCP_STATE_SYN_SENT;
+	} else if (own == TCP_STATE_NONE) { // Connection opened before the capture
+		own = TCP_STATE_ESTABLISHED;
+	} else if (own == TCP_STATE_SYN_SENT && (flags & TH_ACK)) {
+		// Only sent once the SYN-ACK was received, even if it wasn't captured
+		own = TCP_STATE_ESTABLISHED;
+	}
+	if ((flags & TH_FIN) && own != TCP_STATE_CLOSED)
+		own = TCP_STATE_FIN_WAIT;
+
+	tcp_state = (own << (direction * 4)) | (other << ((1 - direction) * 4));
+}
+
+// Memory Budget
+
+void Sniffer::evictConnection() {
+	EvictionVisitor visitor;
+	visitor.sniffer = this;
+	connections.evict(visitor);
+}
+
+void Sniffer::setMemoryBudget(size_t bytes) {
+	max_connections = ConnectionStatusMap::maxEntries(bytes);
+	connections.reserve(max_connections);
+	while (connections.size() > max_connections)
+		evictConnection();
+}
+
+// Flow Times
+
+// Flow times are moved back once they get this far from the base, so that they never overflow
+static const u_int64_t FLOW_TIME_REBASE = 0x80000000ull;
+
+struct Sniffer::RebaseVisitor {
+	u_int64_t shift;
+
+	inline u_int32_t move(u_int32_t t) const {
+		return t > shift ? t - shift : 0;
+	}
+
+	bool operator()(const Connection & key, Status & status) {
+		status.record_start = move(status.record_start);
+		status.last_seen = move(status.last_seen);
+		return false;
+	}
+};
+
+u_int32_t Sniffer::flowTime(const struct timeval & tv) {
+	u_int64_t ms = toMilliseconds(tv);
+	if (!flow_time_base) flow_time_base = ms;
+	if (ms < flow_time_base) return 0;
+	if (ms - flow_time_base >= FLOW_TIME_REBASE) {
+		RebaseVisitor visitor;
+		visitor.shift = ms - flow_time_base - FLOW_TIME_REBASE / 2;
+		connections.sweep(connections.capacity(), visitor);
+		flow_time_base += visitor.shift;
+	}
+	return ms - flow_time_base;
+}
+
+void Sniffer::dissectPacket(const unsigned char * buffer, int size) {
 	// Create list of headers from buffer
 	EthernetHeader first_header(buffer, size);
 
@@ -93,19 +710,303 @@ void Sniffer::newPacket(const unsigned char * buffer, int size) {
 
 		std::cout << "<< " << *h << std::endl;
 	}
+	std::cout << "     ----------" << std::endl;
 }
 
 void Sniffer::process_packet(u_char* arg, const struct pcap_pkthdr * header, const u_char * buffer) {
 	Sniffer *sniffer = (Sniffer *)arg;
-	int size = header->len;
-	sniffer->newPacket(buffer, size);
-	std::cout << "     ----------" << std::endl;
+	sniffer->current_time = header->ts;
+	sniffer->newPacket(buffer, header->caplen);
+}
+
+void Sniffer::batch_packet(u_char* arg, const struct pcap_pkthdr * header, const u_char * buffer) {
+	PacketBatch *batch = (PacketBatch *)arg;
+	batch->add(header->ts, buffer, header->caplen, header->len);
+}
+
+void Sniffer::enableDnsStatistics(unsigned int names_capacity) {
+	if (dns_statistics) return;
+	dns_statistics = new DnsStatistics(names_capacity);
+	requireDecodeDepth(DECODE_TRANSPORT);
+}
+
+void Sniffer::printDnsStatistics(std::ostream& out) {
+	if (dns_statistics)
+		dns_statistics->print(out);
+}
+
+void Sniffer::enableChecksumValidation() {
+	if (checksum_validator) return;
+	checksum_validator = new ChecksumValidator();
+	requireDecodeDepth(DECODE_TRANSPORT);
+}
+
+void Sniffer::printChecksumStatistics(std::ostream& out) {
+	if (checksum_validator)
+		checksum_validator->print(out);
+}
+
+void Sniffer::enableTrafficCounters() {
+	if (traffic_counters) return;
+	traffic_counters = new TrafficCounters();
+	requireDecodeDepth(DECODE_NETWORK);
+}
+
+void Sniffer::printTrafficCounters(std::ostream& out) {
+	if (traffic_counters)
+		traffic_counters->print(out);
+}
+
+void Sniffer::setSummaryPublisher(SummaryPublisher * publisher) {
+	if (publisher && !summary_publisher) requireDecodeDepth(DECODE_TRANSPORT);
+	if (!publisher && summary_publisher) releaseDecodeDepth(DECODE_TRANSPORT);
+	summary_publisher = publisher;
+}
+
+void Sniffer::enableDuplicateFilter(unsigned int window_us, unsigned int table_size) {
+	if (!duplicate_filter)
+		duplicate_filter = new DuplicateFilter(window_us, table_size);
+}
+
+void Sniffer::printDuplicateStatistics(std::ostream& out) {
+	if (duplicate_filter)
+		duplicate_filter->print(out);
+}
+
+// The packets that are not duplicates, referenced in place
+const PacketBatch & Sniffer::selectPackets(const PacketBatch & packets) {
+	if (selected_packets.capacity() < packets.size())
+		selected_packets.resize(packets.size());
+	selected_packets.clear();
+	unsigned int filtered = 0;
+	for (unsigned int i = 0; i < packets.size(); i++) {
+		const PacketRecord & packet = packets[i];
+		if (duplicate_filter && duplicate_filter->isDuplicate(packet.data, packet.caplen, packet.ts))
+			continue;
+		if (current_filter && !current_filter->matches(packet)) {
+			filtered++;
+			continue;
+		}
+		selected_packets.addRef(packet.ts, packet.data, packet.caplen, packet.len);
+	}
+	if (filtered)
+		__atomic_store_n(&filtered_packets, filtered_packets + filtered, __ATOMIC_RELAXED);
+	return selected_packets;
+}
+
+void Sniffer::enableAttackDetection(unsigned int syn_threshold, unsigned int scan_threshold, unsigned int window_ms) {
+	if (attack_detector) return;
+	attack_detector = new AttackDetector(syn_threshold, scan_threshold, window_ms);
+	requireDecodeDepth(DECODE_TRANSPORT);
+}
+
+void Sniffer::detectAttacks(const PacketSummary & summary, const PacketRecord & packet) {
+	AttackAlert alerts[2];
+	unsigned int count = attack_detector->update(summary, toMilliseconds(packet.ts), alerts);
+	for (unsigned int i = 0; i < count; i++)
+		attackDetected(alerts[i]);
+	if (count && flight_recorder && track_connections)
+		dumpFlight(Connection(summary.saddr, summary.sport, summary.daddr, summary.dport), "alert");
+}
+
+void Sniffer::attackDetected(const AttackAlert & alert) {
+	AttackDetector::print(alert, std::cout);
+}
+
+void Sniffer::setTrafficRollups(TrafficRollups * rollups) {
+	if (rollups && !traffic_rollups) requireDecodeDepth(DECODE_TRANSPORT);
+	if (!rollups && traffic_rollups) releaseDecodeDepth(DECODE_TRANSPORT);
+	traffic_rollups = rollups;
+}
+
+void Sniffer::setPacketStore(PacketStore * store) {
+	if (store && !packet_store) requireDecodeDepth(DECODE_TRANSPORT);
+	if (!store && packet_store) releaseDecodeDepth(DECODE_TRANSPORT);
+	packet_store = store;
+}
+
+// Flight Recorder
+
+void Sniffer::enableFlightRecorder(const char * directory, unsigned int max_packets, unsigned int max_bytes,
+		unsigned int snaplen, size_t memory_limit) {
+	if (flight_recorder) return;
+	flight_directory = directory;
+	flight_recorder = new FlightRecorder(max_packets, max_bytes, snaplen, memory_limit);
+	requireDecodeDepth(DECODE_TRANSPORT);
+}
+
+bool Sniffer::requestFlightDump(in_addr_t addr1, u_int16_t port1, in_addr_t addr2, u_int16_t port2) {
+	return flight_recorder && flight_recorder->requestDump(Connection(addr1, port1, addr2, port2));
+}
+
+// Out of the capture epoch, once the packets that fired the dumps are done
+void Sniffer::serveFlightDumps() {
+	Connection key;
+	while (flight_recorder->nextDumpRequest(key))
+		dumpFlight(key, "request");
+
+	const std::vector<FlightRecorder::Trigger> & triggers = flight_recorder->getTriggers();
+	for (unsigned int i = 0; i < triggers.size(); i++) {
+		const FlightRecorder::Trigger & trigger = triggers[i];
+		char low[INET_ADDRSTRLEN], high[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &trigger.key.low.addr, low, sizeof(low));
+		inet_ntop(AF_INET, &trigger.key.high.addr, high, sizeof(high));
+		char name[160];
+		snprintf(name, sizeof(name), "/flight-%lu.%06lu-%s.%u-%s.%u-%s.pcap",
+			(unsigned long)trigger.time.tv_sec, (unsigned long)trigger.time.tv_usec,
+			low, trigger.key.low.port, high, trigger.key.high.port, trigger.reason);
+		flight_recorder->dump(trigger.key, trigger.hash, (flight_directory + name).c_str());
+	}
+	flight_recorder->clearTriggers();
+}
+
+bool Sniffer::dumpFlight(const Connection & key, const char * reason) {
+	return flight_recorder && flight_recorder->trigger(key, key.hash(), reason, current_time);
+}
+
+void Sniffer::printFlightRecorderStatistics(std::ostream& out) {
+	if (flight_recorder)
+		flight_recorder->print(out);
+}
+
+// Decode Depth
+
+int Sniffer::requiredDecodeDepth() const {
+	for (int depth = DECODE_ALL; depth > DECODE_NONE; depth--) {
+		if (__atomic_load_n(&decode_consumers[depth], __ATOMIC_ACQUIRE))
+			return depth;
+	}
+	return DECODE_NONE;
+}
+
+void Sniffer::updateDecodeDepth() {
+	// A concurrent update may store a stale depth, but then it sees the
+	// requirements changed after storing it and tries again
+	int depth;
+	do {
+		depth = requiredDecodeDepth();
+		__atomic_store_n(&decode_depth, depth, __ATOMIC_RELEASE);
+	} while (depth != requiredDecodeDepth());
+}
+
+void Sniffer::requireDecodeDepth(int depth) {
+	if (depth <= DECODE_NONE || depth > DECODE_ALL) return;
+	__atomic_add_fetch(&decode_consumers[depth], 1, __ATOMIC_ACQ_REL);
+	updateDecodeDepth();
+}
+
+void Sniffer::releaseDecodeDepth(int depth) {
+	if (depth <= DECODE_NONE || depth > DECODE_ALL) return;
+	__atomic_sub_fetch(&decode_consumers[depth], 1, __ATOMIC_ACQ_REL);
+	updateDecodeDepth();
+}
+
+void Sniffer::setPrintPackets(bool print) {
+	if (__atomic_exchange_n(&print_packets, print, __ATOMIC_ACQ_REL) == print) return;
+	if (print) requireDecodeDepth(DECODE_ALL);
+	else releaseDecodeDepth(DECODE_ALL);
+}
+
+void Sniffer::setConnectionTracking(bool track) {
+	if (track == track_connections) return;
+	track_connections = track;
+	if (track) requireDecodeDepth(DECODE_TRANSPORT);
+	else releaseDecodeDepth(DECODE_TRANSPORT);
+}
+
+// Delta Reports
+
+// Marks the connections in place, without the lookups that would make them
+// look recently used to the eviction
+struct Sniffer::DirtyVisitor {
+	Sniffer * sniffer;
+
+	bool operator()(const Connection & key, Status & status) {
+		status.flags |= STATUS_DIRTY;
+		DirtyConnection dirty;
+		dirty.key = key;
+		dirty.hash = key.hash();
+		sniffer->dirty_connections.push_back(dirty);
+		return false;
+	}
+};
+
+void Sniffer::enableDeltaReports() {
+	if (delta_reports) return;
+	delta_reports = true;
+	// Everything is new for the first report
+	DirtyVisitor visitor;
+	visitor.sniffer = this;
+	connections.sweep(connections.capacity(), visitor);
+}
+
+static void writeChange(std::ostream& out, Sniffer::ReportFormat format, unsigned int change, const FlowRecord & record) {
+	if (format == Sniffer::REPORT_BINARY) {
+		unsigned char packed[PACKED_FLOW_RECORD_SIZE];
+		packFlowRecord(record, change, packed);
+		out.write((const char *)packed, sizeof(packed));
+	} else {
+		static const char SYMBOLS[] = " +*-";
+		char line[256];
+		formatFlowRecord(record, line, sizeof(line));
+		out << SYMBOLS[change] << ' ' << line;
+	}
+}
+
+void Sniffer::reportChangedConnections(std::ostream& out, ReportFormat format) {
+	if (!delta_reports) return;
+
+	// Connections still in the table; the ones removed were moved to closed_connections
+	std::vector<FlowRecord> changed;
+	std::vector<u_int8_t> changes;
+	for (size_t i = 0; i < dirty_connections.size(); i++) {
+		const DirtyConnection & dirty = dirty_connections[i];
+		Status * status = connections.find(dirty.key, dirty.hash);
+		if (!status || !(status->flags & STATUS_DIRTY)) continue; // Removed, or listed twice
+		changed.resize(changed.size() + 1);
+		makeFlowRecord(dirty.key, *status, changed.back());
+		changes.push_back((status->flags & STATUS_REPORTED) ? CHANGE_UPDATED : CHANGE_CREATED);
+		status->flags = (status->flags & ~STATUS_DIRTY) | STATUS_REPORTED;
+	}
+
+	if (format == REPORT_BINARY) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		ReportHeader header;
+		header.magic = htonl(REPORT_MAGIC);
+		header.count = htonl(changed.size() + closed_connections.size());
+		header.time_sec = htonl(now.tv_sec);
+		header.time_msec = htonl(now.tv_usec / 1000);
+		out.write((const char *)&header, sizeof(header));
+	}
+	for (size_t i = 0; i < changed.size(); i++)
+		writeChange(out, format, changes[i], changed[i]);
+	for (size_t i = 0; i < closed_connections.size(); i++)
+		writeChange(out, format, CHANGE_CLOSED, closed_connections[i]);
+	out.flush();
+
+	dirty_connections.clear();
+	closed_connections.clear();
 }
 
 void Sniffer::printConnections(std::ostream& out) {
+	const PrefixTable * prefixes = current_prefixes; // Only set while decoding packets
 	for (ConnectionStatusMap::const_iterator it = connections.begin(); it != connections.end(); it++) {
 		const Connection & key = it->first; (void) key;
 		const Status & value = it->second; (void) value;
-		out << key << std::endl;
+		out << key;
+		if (value.match_count)
+			out << " (" << value.match_count << " matches, first: " << value.first_match << ")";
+		if (value.flags & STATUS_TLS) {
+			std::string name = getTlsServerName(value), protocol = getTlsProtocol(value);
+			out << " [tls" << (name.empty() ? "" : " ") << name << (protocol.empty() ? "" : " ") << protocol << "]";
+		}
+		if (prefixes) {
+			u_int32_t low_tag, high_tag;
+			prefixes->lookup(key, low_tag, high_tag);
+			if (low_tag || high_tag)
+				out << " [tags " << low_tag << " " << high_tag << "]";
+		}
+		out << std::endl;
 	}
 }
@@ -27,36 +27,447 @@
 struct pcap_pkthdr;
 
 #include "ip_port_connection.h"
-#include <map>
+#include "flow_table.h"
+#include "packet_batch.h"
+#include "packet_summary.h"
+#include "packet_columns.h"
+#include "pattern_matcher.h"
+#include "epoch.h"
+#include "dns.h"
+#include "tls.h"
+#include "flow_exporter.h"
+#include "flow_query.h"
+#include "checksum.h"
+#include "packet_store.h"
+#include "traffic_counters.h"
+#include "traffic_rollups.h"
+#include "attack_detector.h"
+#include "duplicate_filter.h"
+#include "prefix_table.h"
+#include "packet_filter.h"
+#include "neighbour_table.h"
+#include "flight_recorder.h"
+#include "summary_publisher.h"
+#include <vector>
 #include <iostream>
+#include <sys/time.h>
 
 namespace filter {
 
 class Sniffer {
 
 public:
-	Sniffer() {
+	Sniffer() : batch_size(PacketBatch::DEFAULT_CAPACITY), print_packets(true),
+			pattern_matcher(NULL), current_matcher(NULL), matcher_generation(0),
+			prefix_table(NULL), current_prefixes(NULL), packet_filter(NULL), current_filter(NULL), filtered_packets(0), neighbour_table(NULL), learn_neighbours_from_ip(false),
+			dns_statistics(NULL), tls_statistics(NULL), checksum_validator(NULL), packet_store(NULL), traffic_counters(NULL), traffic_rollups(NULL), attack_detector(NULL), duplicate_filter(NULL), summary_publisher(NULL), flight_recorder(NULL), flow_exporter(NULL), idle_timeout(15), active_timeout(1800), syn_timeout(5), close_linger(2),
+			max_connections(0), evicted_connections(0), flow_time_base(0),
+			query_server(NULL), snapshot(NULL), snapshot_position(0), snapshot_complete(false),
+			snapshot_ms(0), snapshot_interval(1000), delta_reports(false),
+			track_connections(true), decode_depth(DECODE_NONE) {
+		timerclear(&current_time);
+		for (int i = 0; i <= DECODE_ALL; i++) decode_consumers[i] = 0;
+		requireDecodeDepth(DECODE_TRANSPORT); // Connections
+		requireDecodeDepth(DECODE_ALL);       // Printer
 	}
 
 	virtual ~Sniffer() {
+		delete pattern_matcher;
+		delete prefix_table;
+		delete packet_filter;
+		delete neighbour_table;
+		delete dns_statistics;
+		delete tls_statistics;
+		delete checksum_validator;
+		delete traffic_counters;
+		delete attack_detector;
+		delete duplicate_filter;
+		delete flight_recorder;
+		delete snapshot;
 	}
 
 	void loop(const char* devname);
 
+	// Decodes a group of packets at once. The work is done in stages across
+	// the whole batch (prefetch headers, parse, hash and prefetch the buckets
+	// of the connection table, update), so that the memory latency of one
+	// packet is hidden behind the work done on the others.
+	virtual void newPackets(const PacketBatch & batch);
+
+	// Number of packets read from the device before decoding them (1 = no batching)
+	inline void setBatchSize(unsigned int size) { batch_size = size ? size : 1; }
+	inline unsigned int getBatchSize() const { return batch_size; }
+
+	// Packets are only decoded as deep as needed. Every consumer of the
+	// decoded packets (connections, printer, counters, ...) requires the
+	// deepest layer it uses (DECODE_*, packet_summary.h) while it's active,
+	// and the decoder stops at the deepest one still required. Can be called
+	// from any thread, the new depth is used from the next packet or batch.
+	void requireDecodeDepth(int depth);
+	void releaseDecodeDepth(int depth);
+	inline int getDecodeDepth() const { return __atomic_load_n(&decode_depth, __ATOMIC_ACQUIRE); }
+
+	// Print the full list of headers of every packet (DECODE_ALL, on by
+	// default). Can be called from any thread.
+	void setPrintPackets(bool print);
+
+	// Keep track of the connections (DECODE_TRANSPORT, on by default). Flow
+	// export, queries, delta reports, pattern matching and DNS statistics
+	// are all done on the connections.
+	void setConnectionTracking(bool track);
+
+	// Count packets and bytes per link layer and IP protocol (DECODE_NETWORK)
+	void enableTrafficCounters();
+	void printTrafficCounters(std::ostream& out);
+
+	// Add up the traffic per host and per port, per second (NULL to stop).
+	// The windows can be read from any thread while the capture goes on.
+	// The rollups are not owned by the sniffer.
+	void setTrafficRollups(TrafficRollups * rollups);
+
+	// Look for SYN floods (syn_threshold SYNs to a service left unanswered)
+	// and port scans (scan_threshold distinct ports from a source) within
+	// window_ms, see attack_detector.h. Alerts go to attackDetected().
+	void enableAttackDetection(unsigned int syn_threshold = 1000, unsigned int scan_threshold = 100,
+		unsigned int window_ms = 1000);
+
+	// Look for these patterns in the payloads of the connections (NULL to
+	// stop). Can be called from any thread; the previous matcher is deleted
+	// once the capture thread is no longer using it.
+	void setPatternMatcher(PatternMatcher * matcher);
+
+	// Only decode the packets that pass this filter (NULL for all of them).
+	// Can be called from any thread; the previous filter is deleted once the
+	// capture thread is no longer using it.
+	void setPacketFilter(PacketFilter * filter);
+	inline u_int64_t getFilteredPackets() const { return __atomic_load_n(&filtered_packets, __ATOMIC_RELAXED); }
+
+	// Tag the addresses with this table of prefixes (NULL to stop). Can be
+	// called from any thread, typically once a new table has been built or
+	// mapped; the previous one is deleted once the capture thread is no
+	// longer using it. Tags are passed to connectionTagged() when a
+	// connection starts, and printed with the connections.
+	void setPrefixTable(PrefixTable * table);
+
+	// Keep the MAC address of every IPv4 address seen, from ARP packets and,
+	// with from_ip, from the source of the IP packets (DECODE_LINK, or
+	// DECODE_NETWORK with from_ip). Changes go to neighbourChanged().
+	void enableNeighbourTable(unsigned int capacity = 4096, bool from_ip = true);
+	void printNeighbours(std::ostream& out);
+
+	// Count DNS messages per query name (up to names_capacity names) and per response code
+	void enableDnsStatistics(unsigned int names_capacity = 65536);
+	void printDnsStatistics(std::ostream& out);
+
+	// Look for a TLS ClientHello at the start of the TCP connections, and
+	// count the connections and their traffic per server name (SNI, up to
+	// names_capacity names) and application protocol (ALPN). Once found, the
+	// rest of the connection is not inspected, not even by the pattern
+	// matcher: it's encrypted.
+	void enableTlsInspection(unsigned int names_capacity = 65536);
+	void printTlsStatistics(std::ostream& out);
+
+	// Drop the packets seen again within window_us microseconds, before
+	// decoding them, as mirror ports send many packets twice (see
+	// duplicate_filter.h)
+	void enableDuplicateFilter(unsigned int window_us = 1000, unsigned int table_size = 8192);
+	void printDuplicateStatistics(std::ostream& out);
+
+	// Verify the IP, TCP, UDP and ICMP checksums of every packet. Bad ones
+	// are flagged in the PacketSummary (SUMMARY_BAD_*) and counted.
+	void enableChecksumValidation();
+	void printChecksumStatistics(std::ostream& out);
+
+	// Write every captured packet to this store (NULL to stop), indexed by
+	// connection. The store is not owned by the sniffer.
+	void setPacketStore(PacketStore * store);
+
+	// Keep the last packets of every connection (see flight_recorder.h) and
+	// write them to a pcap file in directory when something happens on it:
+	// the first pattern found, an attack alert raised by one of its packets,
+	// or a call to dumpFlight(). The rings are given back as the connections
+	// end. Should be called before the capture.
+	void enableFlightRecorder(const char * directory, unsigned int max_packets = 64, unsigned int max_bytes = 16384,
+		unsigned int snaplen = 256, size_t memory_limit = 64 << 20);
+	// Dump the packets kept for a connection (addresses in network byte
+	// order, ports in host byte order). Can be called from one other thread
+	// at a time: the file is written by the capture thread, along with the
+	// next packets.
+	bool requestFlightDump(in_addr_t addr1, u_int16_t port1, in_addr_t addr2, u_int16_t port2);
+	void printFlightRecorderStatistics(std::ostream& out);
+
+	// Publish the summary of every packet, and the connection events (first
+	// packet, flow records as exported), to this ring in shared memory (NULL
+	// to stop). The publisher is not owned by the sniffer.
+	void setSummaryPublisher(SummaryPublisher * publisher);
+
+	// Capture thread only, as any access to the connections. The prefix tags
+	// are printed when called from the hooks run while decoding a packet
+	// (newMatch(), connectionFinished(), attackDetected()...), with the table
+	// used for that packet; it can't enter the capture epoch again there.
 	void printConnections(std::ostream& out);
 
+	// Reports of the connections created, updated or closed since the
+	// previous report. The changes are tracked as they happen, so a report
+	// costs as much as the activity since the previous one, not as the
+	// number of connections.
+	enum ReportFormat {
+		REPORT_TEXT,    // "+" created, "*" updated, "-" closed, then the flow
+		REPORT_BINARY,  // ReportHeader, then packed flow records tagged with CHANGE_*
+	};
+	enum {
+		CHANGE_CREATED = 1,
+		CHANGE_UPDATED = 2,
+		CHANGE_CLOSED = 3,
+	};
+	struct ReportHeader {    // Network byte order
+		u_int32_t magic;       // REPORT_MAGIC
+		u_int32_t count;       // Records that follow (PACKED_FLOW_RECORD_SIZE bytes each)
+		u_int32_t time_sec;    // When the report was made
+		u_int32_t time_msec;
+	};
+	enum { REPORT_MAGIC = 0x464C5744 }; // "FLWD"
+
+	void enableDeltaReports();
+	void reportChangedConnections(std::ostream& out, ReportFormat format = REPORT_TEXT);
+
+	// Send a record of every connection to this exporter (NULL to stop) when
+	// it ends, and every active_timeout seconds while it lasts. The exporter
+	// is not owned by the sniffer.
+	inline void setFlowExporter(FlowExporter * exporter) { flow_exporter = exporter; }
+	// Connections end after idle_timeout seconds without packets. The
+	// timeouts can be changed from any thread.
+	inline void setFlowTimeouts(unsigned int idle, unsigned int active) {
+		__atomic_store_n(&idle_timeout, idle, __ATOMIC_RELAXED);
+		__atomic_store_n(&active_timeout, active, __ATOMIC_RELAXED);
+	}
+	// TCP connections end syn_timeout seconds after the last packet while a
+	// SYN waits for its acknowledgement (a side never seen, as on one
+	// direction of a tap, doesn't count), and close_linger seconds after the last
+	// packet once both sides have closed (FIN acknowledged, or RST)
+	inline void setTcpTimeouts(unsigned int syn, unsigned int linger) {
+		__atomic_store_n(&syn_timeout, syn, __ATOMIC_RELAXED);
+		__atomic_store_n(&close_linger, linger, __ATOMIC_RELAXED);
+	}
+	// Look for expired connections, at most budget entries of the table.
+	// Called while decoding packets, and by loop() when there is no traffic.
+	void expireConnections(const struct timeval & now, unsigned int budget);
+	// End all the connections, e.g. at the end of the capture
+	void flushConnections();
+
+	// Connections in the table, and the memory taken by the table
+	inline unsigned int getConnectionCount() const { return connections.size(); }
+	inline size_t getConnectionMemory() const { return (size_t)connections.capacity() * ConnectionStatusMap::slotSize(); }
+
+	// Keep the connection table within this amount of memory, allocated
+	// right away. When it's full, a connection is evicted for each new one
+	// (TCP connections that were never established go first) and finished
+	// with FLOW_END_LACK_OF_RESOURCES. Should be set before the capture.
+	void setMemoryBudget(size_t bytes);
+	inline unsigned int getMaxConnections() const { return max_connections; }
+	inline u_int64_t getEvictedConnections() const { return evicted_connections; }
+
+	// Publish a copy of the connection table to this server (NULL to stop)
+	// every interval_ms milliseconds. The copy is made while decoding
+	// packets, a few connections at a time. The server is not owned by the
+	// sniffer.
+	void setQueryServer(FlowQueryServer * server, unsigned int interval_ms = 1000);
+
 protected:
 	virtual void newPacket(const unsigned char * buffer, int size);
+	virtual void dissectPacket(const unsigned char * buffer, int size);
 
 	typedef IpPortConnection<in_addr_t,u_int16_t> Connection;
 
+	// Flags of a connection
+	enum {
+		STATUS_FROM_HIGH = 0x01,    // First packet was sent by the high endpoint
+		STATUS_DIRTY = 0x02,        // Changed since the last delta report
+		STATUS_REPORTED = 0x04,     // Included in a delta report already
+		STATUS_TLS_CHECKED = 0x08,  // First payload looked at for a TLS ClientHello
+		STATUS_TLS = 0x10,          // Started with a ClientHello: tls_names are set, payload not inspected any more
+		STATUS_TLS_PENDING = 0x20,  // ClientHello goes on in the next segment (see tls_resume)
+		STATUS_RECORDING = 0x40,    // Has a ring in the flight recorder
+	};
+
+	// State of each direction of a TCP connection
+	enum {
+		TCP_STATE_NONE = 0,         // Nothing sent yet
+		TCP_STATE_SYN_SENT = 1,     // SYN not acknowledged yet
+		TCP_STATE_ESTABLISHED = 2,  // SYN acknowledged, or seen already open or acknowledging
+		TCP_STATE_FIN_WAIT = 3,     // FIN not acknowledged yet
+		TCP_STATE_CLOSED = 4,       // FIN acknowledged, or RST
+	};
+
+	// Kept small (40 bytes, 64 with the key and the bucket), so that a known
+	// number of connections fits in a given amount of memory. Times are in
+	// milliseconds since flow_time_base (see flowTime()).
 	class Status {
+	public:
+		Status() : bytes(0), packets(0), record_start(0), last_seen(0),
+				first_match(0), match_count(0), match_generation(0), protocol(0), tcp_flags(0), tcp_state(0), flags(0) {
+			match_state[0] = match_state[1] = PatternMatcher::START_STATE;
+		}
+		u_int64_t bytes;          // IP bytes, since the start of the record
+		u_int32_t packets;        // Since the start of the record
+		u_int32_t record_start;   // First packet of the record (of the connection, for the first one)
+		u_int32_t last_seen;
+		union {                   // Connections with STATUS_TLS aren't matched
+			u_int32_t match_state[2]; // Pattern matcher state for each direction (low -> high, high -> low)
+			u_int32_t tls_names[2];   // Server name and protocol, slots of the TlsStatistics tables
+		};
+		union {
+			u_int32_t first_match;    // ID of the first pattern found
+			u_int32_t tls_resume;     // With STATUS_TLS_PENDING, see tlsResumeClientHello()
+		};
+		u_int16_t match_count;    // Patterns found (saturated)
+		u_int16_t match_generation;
+		u_int8_t protocol;
+		u_int8_t tcp_flags;       // All the TCP flags seen
+		u_int8_t tcp_state;       // TCP_STATE_* of each direction (low -> high in the low 4 bits)
+		u_int8_t flags;           // STATUS_*
+
+		inline unsigned int tcpState(unsigned int direction) const {
+			return (tcp_state >> (direction * 4)) & 0x0F;
+		}
+		// No SYN waits for its acknowledgement. A side that was never seen
+		// stays TCP_STATE_NONE, which doesn't hold the connection back.
+		inline bool tcpEstablished() const {
+			return tcpState(0) != TCP_STATE_SYN_SENT && tcpState(1) != TCP_STATE_SYN_SENT
+				&& (tcpState(0) >= TCP_STATE_ESTABLISHED || tcpState(1) >= TCP_STATE_ESTABLISHED);
+		}
+		inline bool tcpClosed() const {
+			return tcp_state == (TCP_STATE_CLOSED | TCP_STATE_CLOSED << 4);
+		}
+		// Follow a TCP segment sent in the given direction
+		void updateTcpState(unsigned int direction, u_int8_t flags);
 	};
 
-	typedef std::map<Connection,Status> ConnectionStatusMap;
+	typedef FlowTable<Connection,Status> ConnectionStatusMap;
 	ConnectionStatusMap connections;
+
+	Status & updateConnection(const PacketSummary & summary, u_int32_t hash, const PacketRecord & packet);
+
+	// Server name and protocol of a TLS connection, empty if unknown
+	std::string getTlsServerName(const Status & status) const;
+	std::string getTlsProtocol(const Status & status) const;
+
+	// Called for every pattern found in the payload of a connection
+	virtual void newMatch(const Connection & connection, Status & status, unsigned int pattern) { }
+
+	// Called when a connection starts if any of its addresses is in the
+	// prefix table (tags are 0 for the ones that aren't)
+	virtual void connectionTagged(const Connection & connection, Status & status, u_int32_t low_tag, u_int32_t high_tag) { }
+
+	// Called when an address is seen with a new MAC address (source is
+	// NeighbourTable::FROM_*), prints it by default
+	virtual void neighbourChanged(in_addr_t addr, u_int64_t previous_mac, u_int64_t mac, unsigned int source);
+
+	// Called for every alert of the attack detector, prints it by default
+	virtual void attackDetected(const AttackAlert & alert);
+
+	// Write the packets kept by the flight recorder for a connection to
+	// DIRECTORY/flight-TIME-LOW-HIGH-REASON.pcap (reason a static string).
+	// From the capture thread, e.g. in newMatch(); the file is written once
+	// the current packets are done. Returns false if the connection is not
+	// recorded or too many dumps are pending.
+	bool dumpFlight(const Connection & key, const char * reason);
+
+	// Called for every connection removed from the table, reason is FLOW_END_*
+	virtual void connectionFinished(const Connection & connection, Status & status, unsigned int reason) { }
+	void finishConnection(const Connection & key, Status & status, unsigned int reason);
+
+	struct timeval current_time; // Capture time of the packet being decoded
+
+	// Time in the units of Status: milliseconds since flow_time_base
+	u_int32_t flowTime(const struct timeval & tv);
+	inline u_int64_t flowTimeToMilliseconds(u_int32_t t) const { return flow_time_base + t; }
+
+	unsigned int batch_size;
+	bool print_packets;
+
 private:
+	PacketColumns batch_columns;
+
+	PatternMatcher * pattern_matcher;        // Latest matcher, swapped atomically
+	const PatternMatcher * current_matcher;  // Matcher used for the packets being decoded
+	u_int16_t matcher_generation;
+	PrefixTable * prefix_table;              // Latest table, swapped atomically
+	const PrefixTable * current_prefixes;    // Table used for the packets being decoded
+	PacketFilter * packet_filter;            // Latest filter, swapped atomically
+	const PacketFilter * current_filter;     // Filter used for the packets being decoded
+	u_int64_t filtered_packets;
+	Epoch capture_epoch;                     // Capture thread is decoding packets
+
+	NeighbourTable * neighbour_table;
+	bool learn_neighbours_from_ip;
+	void learnNeighbours(const PacketSummary & summary, const PacketRecord & packet);
+
+	struct MatchContext;
+
+	DnsStatistics * dns_statistics;
+	TlsStatistics * tls_statistics;
+	bool inspectTls(Status & status, const PacketSummary & summary, const PacketRecord & packet);
+	ChecksumValidator * checksum_validator;
+	PacketStore * packet_store;
+	TrafficCounters * traffic_counters;
+	TrafficRollups * traffic_rollups;
+	AttackDetector * attack_detector;
+	DuplicateFilter * duplicate_filter;
+	PacketBatch selected_packets;            // Packets of a batch that are not duplicates and pass the filter
+	const PacketBatch & selectPackets(const PacketBatch & packets);
+	void detectAttacks(const PacketSummary & summary, const PacketRecord & packet);
+	SummaryPublisher * summary_publisher;
+	FlightRecorder * flight_recorder;
+	std::string flight_directory;
+	void serveFlightDumps();
+
+	void matchPayload(const Connection & key, Status & status, const PacketSummary & summary, const PacketRecord & packet);
+	static void match_found(unsigned int pattern, unsigned int end, void * context);
+
+	FlowExporter * flow_exporter;
+	unsigned int idle_timeout;
+	unsigned int active_timeout;
+	unsigned int syn_timeout;
+	unsigned int close_linger;
+	struct ExpiryVisitor;
+	void exportConnection(const Connection & key, Status & status, unsigned int reason);
+	void makeFlowRecord(const Connection & key, const Status & status, FlowRecord & record) const;
+
+	unsigned int max_connections;  // 0 if there is no limit
+	u_int64_t evicted_connections;
+	struct EvictionVisitor;
+	void evictConnection();
+
+	u_int64_t flow_time_base;
+	struct RebaseVisitor;
+
+	FlowQueryServer * query_server;
+	FlowSnapshot * snapshot;             // Being filled, or waiting to be published
+	unsigned int snapshot_position;
+	bool snapshot_complete;
+	u_int64_t snapshot_ms;               // When the last one was published
+	unsigned int snapshot_interval;
+	struct SnapshotVisitor;
+	void updateSnapshot(const struct timeval & now, unsigned int budget);
+
+	struct DirtyConnection {
+		Connection key;
+		u_int32_t hash;
+	};
+	bool delta_reports;
+	std::vector<DirtyConnection> dirty_connections;  // Changed since the last report (maybe removed since)
+	std::vector<FlowRecord> closed_connections;      // Removed since the last report
+	struct DirtyVisitor;
+
+	bool track_connections;
+	u_int32_t decode_consumers[DECODE_ALL + 1];      // Requirements held for each depth
+	int decode_depth;                                // Deepest one held
+	int requiredDecodeDepth() const;
+	void updateDecodeDepth();
+
 	static void process_packet(unsigned char* arg, const struct pcap_pkthdr * header, const unsigned char * buffer);
+	static void batch_packet(unsigned char* arg, const struct pcap_pkthdr * header, const unsigned char * buffer);
 };
 
 }
@@ -0,0 +1,86 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef SPSC_RING_H_399ECACA_CBD8_11F1_9C2B_02FC00000001_
+#define SPSC_RING_H_399ECACA_CBD8_11F1_9C2B_02FC00000001_
+
+#include <sys/types.h>
+
+namespace filter {
+
+// Lock free queue for one producer thread and one consumer thread. Neither
+// side ever waits: push() fails when the queue is full and pop() when it's
+// empty. The capacity is rounded up to a power of two.
+
+template <typename T>
+class SpscRing {
+public:
+	SpscRing(unsigned int capacity) : head(0), tail(0) {
+		unsigned int size = 2;
+		while (size < capacity) size <<= 1;
+		items = new T[size];
+		mask = size - 1;
+	}
+
+	~SpscRing() {
+		delete[] items;
+	}
+
+	// Producer side
+	bool push(const T & item) {
+		u_int64_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+		if (t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) > mask) return false;
+		items[t & mask] = item;
+		__atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	// Consumer side
+	bool pop(T & item) {
+		u_int64_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		if (h == __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) return false;
+		item = items[h & mask];
+		__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	inline unsigned int size() const {
+		return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	}
+	inline unsigned int capacity() const { return mask + 1; }
+
+private:
+	T * items;
+	unsigned int mask;
+	// Each index is written by a single thread, keep them in different cache lines
+	u_int64_t head __attribute__((aligned(64)));
+	u_int64_t tail __attribute__((aligned(64)));
+
+	// Can't be copied
+	SpscRing(const SpscRing &other);
+	SpscRing &operator=(const SpscRing &other);
+};
+
+} // namespace filter
+
+#endif // SPSC_RING_H_399ECACA_CBD8_11F1_9C2B_02FC00000001_
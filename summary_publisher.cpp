@@ -0,0 +1,138 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "summary_publisher.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+using namespace filter;
+
+SummaryPublisher::SummaryPublisher() : header(NULL), records(NULL), map_size(0), mask(0), head(0) {
+}
+
+SummaryPublisher::~SummaryPublisher() {
+	close();
+}
+
+bool SummaryPublisher::open(const char * name, unsigned int capacity) {
+	close();
+	if (!name[0] || strchr(name, '/')) return false;
+	u_int32_t size = 1;
+	while (size < capacity && size < 0x80000000u) size <<= 1;
+
+	path = std::string(SUMMARY_RING_DIRECTORY) + name;
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+	size_t bytes = sizeof(summary_ring_header) + (size_t)size * sizeof(summary_record);
+	void * map = MAP_FAILED;
+	if (ftruncate(fd, bytes) == 0)
+		map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		unlink(path.c_str());
+		return false;
+	}
+
+	// The file is new and full of zeros; the magic goes last, so readers
+	// never accept a header that isn't complete
+	header = (summary_ring_header *)map;
+	records = (summary_record *)(header + 1);
+	map_size = bytes;
+	mask = size - 1;
+	head = 0;
+	header->version = SUMMARY_RING_VERSION;
+	header->record_size = sizeof(summary_record);
+	header->capacity = size;
+	__atomic_store_n(&header->magic, SUMMARY_RING_MAGIC, __ATOMIC_RELEASE);
+	return true;
+}
+
+void SummaryPublisher::close() {
+	if (!header) return;
+	munmap(header, map_size);
+	unlink(path.c_str());
+	header = NULL;
+	records = NULL;
+}
+
+// The sequence number is cleared before the record changes, and set once
+// it's complete, so readers can tell a record that changed under them
+summary_record * SummaryPublisher::begin() {
+	summary_record * record = &records[head & mask];
+	__atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return record;
+}
+
+void SummaryPublisher::commit(summary_record * record) {
+	__atomic_store_n(&record->seq, head + 1, __ATOMIC_RELEASE);
+	head++;
+	__atomic_store_n(&header->head, head, __ATOMIC_RELEASE);
+}
+
+void SummaryPublisher::publishPacket(const PacketSummary & summary, u_int32_t hash, const PacketRecord & packet,
+		unsigned int type) {
+	if (!header) return;
+	summary_record * record = begin();
+	record->type = type;
+	record->protocol = summary.protocol;
+	record->tcp_flags = summary.tcp_flags;
+	record->flags = summary.flags;
+	record->saddr = summary.saddr;
+	record->daddr = summary.daddr;
+	record->sport = summary.sport;
+	record->dport = summary.dport;
+	record->ts_sec = packet.ts.tv_sec;
+	record->ts_usec = packet.ts.tv_usec;
+	record->u.packet.len = packet.len;
+	record->u.packet.caplen = packet.caplen;
+	record->u.packet.hash = hash;
+	record->u.packet.ethertype = summary.ethertype;
+	record->u.packet.ip_len = summary.ip_len;
+	record->u.packet.l4_offset = summary.l4_offset;
+	record->u.packet.payload_offset = summary.payload_offset;
+	commit(record);
+}
+
+void SummaryPublisher::publishFlow(const FlowRecord & flow) {
+	if (!header) return;
+	summary_record * record = begin();
+	record->type = SUMMARY_RECORD_FLOW;
+	record->protocol = flow.protocol;
+	record->tcp_flags = flow.tcp_flags;
+	record->flags = flow.end_reason;
+	record->saddr = flow.saddr;
+	record->daddr = flow.daddr;
+	record->sport = flow.sport;
+	record->dport = flow.dport;
+	record->ts_sec = flow.end_ms / 1000;
+	record->ts_usec = (flow.end_ms % 1000) * 1000;
+	record->u.flow.packets = flow.packets;
+	record->u.flow.bytes = flow.bytes;
+	record->u.flow.start_ms = flow.start_ms;
+	record->u.flow.end_ms = flow.end_ms;
+	commit(record);
+}
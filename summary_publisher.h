@@ -0,0 +1,76 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef SUMMARY_PUBLISHER_H_4C46DC7C_CBDC_11F1_9E3C_02FC00000001_
+#define SUMMARY_PUBLISHER_H_4C46DC7C_CBDC_11F1_9E3C_02FC00000001_
+
+#include "summary_ring.h"
+#include "packet_summary.h"
+#include "packet_batch.h"
+#include "flow_exporter.h"
+
+#include <sys/types.h>
+#include <string>
+
+namespace filter {
+
+// Writer of a summary ring (summary_ring.h) in /dev/shm, so that other
+// programs can follow the decoded traffic without capturing and decoding it
+// again. Records are written in place, there is no system call per record.
+// Only the capture thread writes.
+
+class SummaryPublisher {
+public:
+	SummaryPublisher();
+	~SummaryPublisher();
+
+	// Creates /dev/shm/NAME with room for capacity records (rounded up to a
+	// power of two). The file is removed by close().
+	bool open(const char * name, unsigned int capacity = 1 << 16);
+	void close();
+
+	void publishPacket(const PacketSummary & summary, u_int32_t hash, const PacketRecord & packet,
+		unsigned int type = SUMMARY_RECORD_PACKET);
+	void publishFlow(const FlowRecord & record);
+
+	inline u_int64_t getPublished() const { return head; }
+
+private:
+	summary_record * begin();
+	void commit(summary_record * record);
+
+	std::string path;
+	summary_ring_header * header;
+	summary_record * records;
+	size_t map_size;
+	u_int32_t mask;
+	u_int64_t head;
+
+	// Can't be copied
+	SummaryPublisher(const SummaryPublisher &other);
+	SummaryPublisher &operator=(const SummaryPublisher &other);
+};
+
+} // namespace filter
+
+#endif // SUMMARY_PUBLISHER_H_4C46DC7C_CBDC_11F1_9E3C_02FC00000001_
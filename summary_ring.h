@@ -0,0 +1,200 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef SUMMARY_RING_H_2CD697E2_CBDC_11F1_A6DB_02FC00000001_
+#define SUMMARY_RING_H_2CD697E2_CBDC_11F1_A6DB_02FC00000001_
+
+// Ring of decoded packet summaries and flow events published by the sniffer
+// in a file in /dev/shm (see SummaryPublisher, summary_publisher.h). This
+// header is plain C, for the programs reading the ring.
+//
+// There is a single writer and any number of readers. The writer never waits
+// for the readers: each reader keeps its own cursor, and finds out when the
+// records it hasn't read yet have been overwritten. Reading doesn't need any
+// system call once the ring has been mapped.
+//
+//   struct summary_ring_reader reader;
+//   struct summary_record record;
+//   if (summary_ring_open(&reader, "sniffer") == 0) {
+//       for (;;) {
+//           if (summary_ring_read(&reader, &record)) handle(&record);
+//           else wait_a_bit();
+//       }
+//   }
+//
+// Every slot carries the sequence number of the record in it, written last,
+// so a record that was overwritten while being copied is detected (seqlock).
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SUMMARY_RING_MAGIC 0x53524E47  /* "GNRS" */
+#define SUMMARY_RING_VERSION 1
+#define SUMMARY_RING_DIRECTORY "/dev/shm/"
+
+enum {
+	SUMMARY_RECORD_PACKET = 1,      /* A decoded packet */
+	SUMMARY_RECORD_FLOW_START = 2,  /* First packet of a connection, u.packet is valid */
+	SUMMARY_RECORD_FLOW = 3,        /* Record of a connection (as exported), u.flow is valid */
+};
+
+struct summary_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;           /* sizeof(struct summary_record) */
+	uint32_t capacity;              /* Records, a power of two */
+	uint64_t reserved[6];
+	uint64_t head;                  /* Records published so far, in a cache line of its own */
+	uint64_t pad[7];
+};
+
+struct summary_record {
+	uint64_t seq;                   /* Sequence number of the record + 1, 0 while it's being written */
+	uint8_t type;                   /* SUMMARY_RECORD_* */
+	uint8_t protocol;               /* IP protocol */
+	uint8_t tcp_flags;              /* Of the packet, or all the ones seen in the flow */
+	uint8_t flags;                  /* SUMMARY_* of the packet, or FLOW_END_* of the flow record */
+	uint32_t saddr;                 /* Network byte order, initiator for flows */
+	uint32_t daddr;
+	uint16_t sport;                 /* Host byte order */
+	uint16_t dport;
+	uint32_t ts_sec;                /* Capture time of the packet, or end of the flow */
+	uint32_t ts_usec;
+	union {
+		struct {
+			uint32_t len;           /* On the wire */
+			uint32_t caplen;
+			uint32_t hash;          /* Of the connection, hashConnection() */
+			uint16_t ethertype;
+			uint16_t ip_len;
+			uint16_t l4_offset;
+			uint16_t payload_offset;
+		} packet;
+		struct {
+			uint64_t packets;       /* Since the previous record of the flow */
+			uint64_t bytes;
+			uint64_t start_ms;      /* Milliseconds since the epoch */
+			uint64_t end_ms;
+		} flow;
+	} u;
+};
+
+struct summary_ring_reader {
+	struct summary_ring_header * header;
+	struct summary_record * records;
+	size_t map_size;
+	uint64_t cursor;                /* Next record to read */
+	uint64_t lost;                  /* Records overwritten before they were read */
+};
+
+/* Maps the ring with this name, and starts reading at the next record
+   published. Returns 0 on success, -1 on error. */
+static inline int summary_ring_open(struct summary_ring_reader * reader, const char * name) {
+	char path[256];
+	struct stat st;
+	void * map;
+	const struct summary_ring_header * header;
+	int fd;
+
+	memset(reader, 0, sizeof(*reader));
+	if (snprintf(path, sizeof(path), "%s%s", SUMMARY_RING_DIRECTORY, name) >= (int)sizeof(path)) return -1;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct summary_ring_header)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return -1;
+
+	header = (const struct summary_ring_header *)map;
+	if (header->magic != SUMMARY_RING_MAGIC || header->version != SUMMARY_RING_VERSION
+			|| header->record_size != sizeof(struct summary_record)
+			|| header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0
+			|| (size_t)st.st_size < sizeof(struct summary_ring_header) + (size_t)header->capacity * sizeof(struct summary_record)) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	reader->header = (struct summary_ring_header *)map;
+	reader->records = (struct summary_record *)(reader->header + 1);
+	reader->map_size = st.st_size;
+	reader->cursor = __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE);
+	return 0;
+}
+
+static inline void summary_ring_close(struct summary_ring_reader * reader) {
+	if (reader->header) munmap(reader->header, reader->map_size);
+	reader->header = NULL;
+}
+
+/* Number of records published and not read yet (some may be lost already) */
+static inline uint64_t summary_ring_pending(const struct summary_ring_reader * reader) {
+	return __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE) - reader->cursor;
+}
+
+/* Copies the next record. Returns 1 if there was one, 0 if the reader is
+   up to date. Records overwritten before they could be read are skipped
+   and counted in lost. */
+static inline int summary_ring_read(struct summary_ring_reader * reader, struct summary_record * record) {
+	uint32_t capacity = reader->header->capacity;
+	for (;;) {
+		uint64_t head = __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE);
+		const struct summary_record * slot;
+		uint64_t seq;
+		if (reader->cursor == head) return 0;
+		if (head - reader->cursor > capacity) { /* Overrun, jump to the oldest record still there */
+			reader->lost += head - capacity - reader->cursor;
+			reader->cursor = head - capacity;
+		}
+		slot = &reader->records[reader->cursor & (capacity - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == reader->cursor + 1) {
+			memcpy(record, slot, sizeof(*record));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+				break;
+		}
+		/* Overwritten while reading it */
+		reader->lost++;
+		reader->cursor++;
+	}
+	record->seq = ++reader->cursor;
+	return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SUMMARY_RING_H_2CD697E2_CBDC_11F1_A6DB_02FC00000001_
@@ -0,0 +1,243 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "tls.h"
+#include "ip_port_connection.h"
+
+#include <string.h>
+
+using namespace filter;
+
+// Helper Functions
+
+static inline unsigned char lowerCase(unsigned char c) {
+	return (unsigned char)(c - 'A') < 26 ? c | 0x20 : c;
+}
+
+static inline unsigned int read16(const unsigned char * p) {
+	return p[0] << 8 | p[1];
+}
+
+// Letters, digits, '-', '_' and '.': anything else is not taken as a host name
+static bool validHostName(const unsigned char * name, unsigned int len) {
+	if (!len || len > TLS_MAX_NAME_LEN) return false;
+	for (unsigned int i = 0; i < len; i++) {
+		unsigned char c = lowerCase(name[i]);
+		if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.'))
+			return false;
+	}
+	return true;
+}
+
+static bool printable(const unsigned char * name, unsigned int len) {
+	if (!len) return false;
+	for (unsigned int i = 0; i < len; i++) {
+		if (name[i] < 0x21 || name[i] > 0x7E) return false;
+	}
+	return true;
+}
+
+// ClientHello Parsing
+
+static void parseServerName(const unsigned char * ext, unsigned int len, TlsClientHello & hello) {
+	if (len < 2) return;
+	unsigned int end = 2 + read16(ext);
+	if (end > len) return;
+	for (unsigned int offset = 2; offset + 3 <= end; ) {
+		unsigned int type = ext[offset];
+		unsigned int name_len = read16(ext + offset + 1);
+		offset += 3;
+		if (offset + name_len > end) return;
+		if (type == 0 && validHostName(ext + offset, name_len)) { // host_name
+			hello.server_name = ext + offset;
+			hello.server_name_len = name_len;
+			return;
+		}
+		offset += name_len;
+	}
+}
+
+static void parseAlpn(const unsigned char * ext, unsigned int len, TlsClientHello & hello) {
+	if (len < 3) return;
+	unsigned int end = 2 + read16(ext);
+	unsigned int name_len = ext[2];
+	if (end > len || 3 + name_len > end || !printable(ext + 3, name_len)) return;
+	hello.alpn = ext + 3;
+	hello.alpn_len = name_len;
+}
+
+// Walks the extensions from offset to end, which can be past the end of the
+// segment; then the position of the next extension is kept in hello.resume
+static int walkExtensions(const unsigned char * data, unsigned int len, unsigned int offset, unsigned int end, TlsClientHello & hello) {
+	while (offset + 4 <= end) {
+		if (offset + 4 > len) return TLS_HELLO; // Header of the extension split, can't go on
+		unsigned int type = read16(data + offset);
+		unsigned int ext_len = read16(data + offset + 2);
+		offset += 4;
+		if (offset + ext_len > end) return TLS_HELLO; // Malformed
+		if (offset + ext_len > len) {
+			unsigned int remaining = end - (offset + ext_len);
+			if (!remaining) return TLS_HELLO;
+			hello.resume = (offset + ext_len - len) << 16 | remaining;
+			return TLS_HELLO_PARTIAL;
+		}
+		if (type == TLS_EXTENSION_SERVER_NAME) parseServerName(data + offset, ext_len, hello);
+		else if (type == TLS_EXTENSION_ALPN) parseAlpn(data + offset, ext_len, hello);
+		offset += ext_len;
+	}
+	return TLS_HELLO;
+}
+
+int filter::tlsParseClientHello(const unsigned char * data, unsigned int len, TlsClientHello & hello) {
+	memset(&hello, 0, sizeof(hello));
+	const unsigned int HELLO = TLS_RECORD_HEADER_LEN + TLS_HANDSHAKE_HEADER_LEN;
+	if (len < HELLO + 2 + 32 + 1) return TLS_NOT_HELLO;
+	if (data[0] != TLS_CONTENT_HANDSHAKE || data[1] != 3 || data[2] > 4 || data[5] != TLS_HANDSHAKE_CLIENT_HELLO)
+		return TLS_NOT_HELLO;
+	unsigned int record_len = read16(data + 3);
+	unsigned int hello_len = data[6] << 16 | data[7] << 8 | data[8];
+	if (record_len < TLS_HANDSHAKE_HEADER_LEN || data[9] != 3 || hello_len < 2 + 32 + 1 + 2 + 1)
+		return TLS_NOT_HELLO;
+	hello.version = read16(data + 9);
+
+	// A ClientHello split in several records is only walked up to the end of the first one
+	unsigned int end = HELLO + hello_len;
+	if (end > TLS_RECORD_HEADER_LEN + record_len) end = TLS_RECORD_HEADER_LEN + record_len;
+
+	unsigned int offset = HELLO + 2 + 32;
+	unsigned int session_id_len = data[offset];
+	if (session_id_len > 32) return TLS_NOT_HELLO;
+	offset += 1 + session_id_len;
+	if (offset + 2 > len || offset + 2 > end) return TLS_HELLO;
+	offset += 2 + read16(data + offset); // Cipher suites
+	if (offset + 1 > len || offset + 1 > end) return TLS_HELLO;
+	offset += 1 + data[offset];          // Compression methods
+	if (offset + 2 > len || offset + 2 > end) return TLS_HELLO;
+	unsigned int extensions_end = offset + 2 + read16(data + offset);
+	if (extensions_end > end) return TLS_HELLO;
+	return walkExtensions(data, len, offset + 2, extensions_end, hello);
+}
+
+int filter::tlsResumeClientHello(const unsigned char * data, unsigned int len, TlsClientHello & hello) {
+	unsigned int skip = hello.resume >> 16;
+	unsigned int remaining = hello.resume & 0xFFFF;
+	hello.server_name = hello.alpn = NULL;
+	hello.server_name_len = hello.alpn_len = 0;
+	if (skip >= len) { // Still in the same extension
+		hello.resume = (skip - len) << 16 | remaining;
+		return TLS_HELLO_PARTIAL;
+	}
+	return walkExtensions(data, len, skip, skip + remaining, hello);
+}
+
+// Name Table
+
+TlsNameTable::TlsNameTable(unsigned int capacity) : overflows(0) {
+	unsigned int sets = 1;
+	while (sets * WAYS < capacity) sets <<= 1;
+	set_mask = sets - 1;
+	entries = new Entry[sets * WAYS];
+	memset(entries, 0, sizeof(Entry) * sets * WAYS);
+	names = new unsigned char[sets * WAYS * TLS_MAX_NAME_LEN];
+}
+
+TlsNameTable::~TlsNameTable() {
+	delete[] entries;
+	delete[] names;
+}
+
+u_int32_t TlsNameTable::intern(const unsigned char * name, unsigned int len) {
+	if (!len || len > TLS_MAX_NAME_LEN) return NONE;
+
+	// FNV-1a, ignoring case
+	u_int32_t hash = 2166136261u;
+	for (unsigned int i = 0; i < len; i++)
+		hash = (hash ^ lowerCase(name[i])) * 16777619u;
+	hash = hashMix32(hash);
+
+	u_int32_t first = (hash & set_mask) * WAYS;
+	for (u_int32_t slot = first; slot < first + WAYS; slot++) {
+		Entry & entry = entries[slot];
+		if (!entry.len) {
+			// First free slot: the name isn't in the set
+			entry.hash = hash;
+			entry.len = len;
+			unsigned char * stored = names + slot * TLS_MAX_NAME_LEN;
+			for (unsigned int i = 0; i < len; i++)
+				stored[i] = lowerCase(name[i]);
+			return slot;
+		}
+		if (entry.len != len || entry.hash != hash) continue;
+		const unsigned char * stored = names + slot * TLS_MAX_NAME_LEN;
+		unsigned int i = 0;
+		while (i < len && stored[i] == lowerCase(name[i])) i++;
+		if (i == len) return slot;
+	}
+	overflows++;
+	return NONE;
+}
+
+std::string TlsNameTable::getName(u_int32_t slot) const {
+	return std::string((const char *)names + slot * TLS_MAX_NAME_LEN, entries[slot].len);
+}
+
+// Statistics
+
+TlsStatistics::TlsStatistics(unsigned int capacity) : server_names(capacity), protocols(PROTOCOLS_CAPACITY), hellos(0) {
+	memset(&unnamed, 0, sizeof(unnamed));
+}
+
+void TlsStatistics::addNames(const TlsClientHello & hello, u_int32_t names[2]) {
+	if (hello.server_name && names[0] == TlsNameTable::NONE)
+		names[0] = server_names.intern(hello.server_name, hello.server_name_len);
+	if (hello.alpn && names[1] == TlsNameTable::NONE)
+		names[1] = protocols.intern(hello.alpn, hello.alpn_len);
+}
+
+void TlsStatistics::helloDone(const u_int32_t names[2]) {
+	hellos++;
+	if (names[0] != TlsNameTable::NONE) server_names[names[0]].flows++;
+	else unnamed.flows++;
+	if (names[1] != TlsNameTable::NONE) protocols[names[1]].flows++;
+}
+
+void TlsStatistics::print(std::ostream& out, u_int64_t min_flows) const {
+	out << "TLS Statistics" << std::endl;
+	out << "   |-ClientHellos : " << hellos << std::endl;
+	out << "   |-(No name)    : " << unnamed.flows << " connections, "
+		<< unnamed.packets << " packets, " << unnamed.bytes << " bytes" << std::endl;
+	if (server_names.getOverflows())
+		out << "   |-(No room)    : " << server_names.getOverflows() << " names" << std::endl;
+	for (u_int32_t slot = 0; slot < protocols.capacity(); slot++) {
+		const TlsNameTable::Entry & entry = protocols[slot];
+		if (!entry.len || entry.flows < min_flows) continue;
+		out << "   |-ALPN " << protocols.getName(slot) << " : " << entry.flows << " connections, "
+			<< entry.packets << " packets, " << entry.bytes << " bytes" << std::endl;
+	}
+	for (u_int32_t slot = 0; slot < server_names.capacity(); slot++) {
+		const TlsNameTable::Entry & entry = server_names[slot];
+		if (!entry.len || entry.flows < min_flows) continue;
+		out << "   |-" << server_names.getName(slot) << " : " << entry.flows << " connections, "
+			<< entry.packets << " packets, " << entry.bytes << " bytes" << std::endl;
+	}
+}
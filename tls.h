@@ -0,0 +1,153 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef TLS_H_932538F8_CBDE_11F1_AC78_02FC00000001_
+#define TLS_H_932538F8_CBDE_11F1_AC78_02FC00000001_
+
+#include <sys/types.h>
+#include <iostream>
+#include <string>
+
+namespace filter {
+
+// TLS ClientHello messages are walked in place, straight from the TCP
+// payload, to find the server name (SNI) and the first application protocol
+// offered (ALPN). Nothing is copied or reassembled: a ClientHello that goes
+// on in the next segments (common with large key shares) is resumed at the
+// next extension boundary, with a few bytes of state kept by the caller.
+
+enum {
+	TLS_RECORD_HEADER_LEN = 5,
+	TLS_HANDSHAKE_HEADER_LEN = 4,
+	TLS_CONTENT_HANDSHAKE = 22,
+	TLS_HANDSHAKE_CLIENT_HELLO = 1,
+	TLS_EXTENSION_SERVER_NAME = 0,
+	TLS_EXTENSION_ALPN = 16,
+	TLS_MAX_NAME_LEN = 255,
+};
+
+// Results of tlsParseClientHello() and tlsResumeClientHello()
+enum {
+	TLS_NOT_HELLO = 0,      // Not the start of a ClientHello
+	TLS_HELLO = 1,          // Done with the ClientHello (names may still be missing if it's malformed)
+	TLS_HELLO_PARTIAL = 2,  // Goes on in the next segment: call tlsResumeClientHello() with it
+};
+
+struct TlsClientHello {
+	u_int16_t version;                  // Legacy version of the ClientHello (0x0303 for TLS 1.2 and 1.3)
+	const unsigned char * server_name;  // Not terminated; NULL if not found in this segment
+	unsigned int server_name_len;
+	const unsigned char * alpn;         // First protocol offered; NULL if not found in this segment
+	unsigned int alpn_len;
+	u_int32_t resume;                   // Where the next segment goes on, with TLS_HELLO_PARTIAL
+};
+
+// First segment of the payload of a connection
+int tlsParseClientHello(const unsigned char * payload, unsigned int len, TlsClientHello & hello);
+// Next segment, after TLS_HELLO_PARTIAL (hello.resume must be kept from the previous call)
+int tlsResumeClientHello(const unsigned char * payload, unsigned int len, TlsClientHello & hello);
+
+// Interned names (compared ignoring case), with their traffic. Names stay in
+// their slot for as long as the table lives, so that connections can keep a
+// reference to them; once a set of WAYS slots is full, new names in it are
+// not interned.
+
+class TlsNameTable {
+public:
+	static const u_int32_t NONE = 0xFFFFFFFF;
+	enum { WAYS = 8 };
+
+	struct Entry {
+		u_int64_t flows;
+		u_int64_t packets;
+		u_int64_t bytes;
+		u_int32_t hash;
+		u_int8_t len;    // Of the name, 0 if the slot is free
+	};
+
+	TlsNameTable(unsigned int capacity = 65536);
+	~TlsNameTable();
+
+	// Returns the slot of the name, adding it if needed; NONE if there is no room
+	u_int32_t intern(const unsigned char * name, unsigned int len);
+
+	inline unsigned int capacity() const { return set_mask * WAYS + WAYS; }
+	inline Entry & operator[](u_int32_t slot) { return entries[slot]; }
+	inline const Entry & operator[](u_int32_t slot) const { return entries[slot]; }
+	std::string getName(u_int32_t slot) const;
+
+	inline u_int64_t getOverflows() const { return overflows; }
+
+private:
+	Entry * entries;
+	unsigned char * names;  // TLS_MAX_NAME_LEN bytes per slot, lowercase
+	unsigned int set_mask;
+	u_int64_t overflows;
+
+	// Can't be copied
+	TlsNameTable(const TlsNameTable &other);
+	TlsNameTable &operator=(const TlsNameTable &other);
+};
+
+// Connections, packets and bytes per server name and per application
+// protocol, from the ClientHello at the start of each TLS connection
+
+class TlsStatistics {
+public:
+	enum { PROTOCOLS_CAPACITY = 256 };
+
+	TlsStatistics(unsigned int capacity = 65536);
+
+	// Interns the names found in a segment of a ClientHello into names
+	// (server name, protocol), keeping the ones found in previous segments
+	void addNames(const TlsClientHello & hello, u_int32_t names[2]);
+	// Once the whole ClientHello has been seen
+	void helloDone(const u_int32_t names[2]);
+
+	// Traffic of a TLS connection, once its names are known
+	inline void update(const u_int32_t names[2], u_int32_t packets, u_int64_t bytes) {
+		TlsNameTable::Entry & entry = names[0] != TlsNameTable::NONE ? server_names[names[0]] : unnamed;
+		entry.packets += packets;
+		entry.bytes += bytes;
+		if (names[1] != TlsNameTable::NONE) {
+			protocols[names[1]].packets += packets;
+			protocols[names[1]].bytes += bytes;
+		}
+	}
+
+	// The names with at least min_flows connections
+	void print(std::ostream& out, u_int64_t min_flows = 1) const;
+
+	inline const TlsNameTable & getServerNames() const { return server_names; }
+	inline const TlsNameTable & getProtocols() const { return protocols; }
+
+private:
+	TlsNameTable server_names;
+	TlsNameTable protocols;
+	TlsNameTable::Entry unnamed;  // Connections without a server name (or no room for it)
+	u_int64_t hellos;
+};
+
+} // namespace filter
+
+#endif // TLS_H_932538F8_CBDE_11F1_AC78_02FC00000001_
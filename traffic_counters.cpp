@@ -0,0 +1,88 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "traffic_counters.h"
+
+#include <string.h>
+#include <netdb.h>
+#include <net/ethernet.h>
+
+using namespace filter;
+
+static const char * const LINK_NAMES[TrafficCounters::LINK_TYPES] = {
+	"IP", "IPv6", "ARP", "VLAN", "Other", "Truncated"
+};
+
+TrafficCounters::TrafficCounters() : fragments(0) {
+	memset(link_packets, 0, sizeof(link_packets));
+	memset(link_bytes, 0, sizeof(link_bytes));
+	memset(protocol_packets, 0, sizeof(protocol_packets));
+	memset(protocol_bytes, 0, sizeof(protocol_bytes));
+}
+
+void TrafficCounters::update(const PacketSummary & summary, unsigned int len) {
+	unsigned int type;
+	if (summary.flags & SUMMARY_IP) type = LINK_IP;
+	else if (summary.flags & SUMMARY_TRUNCATED) type = LINK_TRUNCATED;
+	else if (summary.ethertype == ETH_P_IPV6) type = LINK_IPV6;
+	else if (summary.ethertype == ETH_P_ARP) type = LINK_ARP;
+	else if (summary.ethertype == ETH_P_8021Q) type = LINK_VLAN;
+	else type = LINK_OTHER;
+	link_packets[type]++;
+	link_bytes[type] += len;
+
+	if (summary.flags & SUMMARY_IP) {
+		protocol_packets[summary.protocol]++;
+		protocol_bytes[summary.protocol] += summary.ip_len;
+		if (summary.flags & SUMMARY_FRAGMENT) fragments++;
+	}
+}
+
+void TrafficCounters::merge(const TrafficCounters & other) {
+	for (unsigned int i = 0; i < LINK_TYPES; i++) {
+		link_packets[i] += other.link_packets[i];
+		link_bytes[i] += other.link_bytes[i];
+	}
+	for (unsigned int i = 0; i < 256; i++) {
+		protocol_packets[i] += other.protocol_packets[i];
+		protocol_bytes[i] += other.protocol_bytes[i];
+	}
+	fragments += other.fragments;
+}
+
+void TrafficCounters::print(std::ostream& out) const {
+	out << "Traffic" << std::endl;
+	for (unsigned int i = 0; i < LINK_TYPES; i++) {
+		if (link_packets[i])
+			out << "   |-" << LINK_NAMES[i] << " : " << link_packets[i] << " packets, " << link_bytes[i] << " bytes" << std::endl;
+	}
+	for (unsigned int i = 0; i < 256; i++) {
+		if (!protocol_packets[i]) continue;
+		const struct protoent * proto = getprotobynumber(i);
+		out << "   |-IP protocol ";
+		if (proto) out << proto->p_name;
+		else out << i;
+		out << " : " << protocol_packets[i] << " packets, " << protocol_bytes[i] << " bytes" << std::endl;
+	}
+	out << "   |-Fragments : " << fragments << std::endl;
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef TRAFFIC_COUNTERS_H_97E8E1E4_CBDB_11F1_9568_02FC00000001_
+#define TRAFFIC_COUNTERS_H_97E8E1E4_CBDB_11F1_9568_02FC00000001_
+
+#include "packet_summary.h"
+
+#include <sys/types.h>
+#include <iostream>
+
+namespace filter {
+
+// Packets and bytes per link layer protocol and per IP protocol. Only needs
+// the packets decoded down to the network layer (DECODE_NETWORK).
+
+class TrafficCounters {
+public:
+	enum {
+		LINK_IP,
+		LINK_IPV6,
+		LINK_ARP,
+		LINK_VLAN,
+		LINK_OTHER,
+		LINK_TRUNCATED,
+		LINK_TYPES
+	};
+
+	TrafficCounters();
+
+	void update(const PacketSummary & summary, unsigned int len);
+	// Add the counts of another one, e.g. from another thread
+	void merge(const TrafficCounters & other);
+
+	void print(std::ostream& out) const;
+
+	inline u_int64_t getLinkPackets(unsigned int type) const { return link_packets[type]; }
+	inline u_int64_t getProtocolPackets(u_int8_t protocol) const { return protocol_packets[protocol]; }
+
+private:
+	u_int64_t link_packets[LINK_TYPES];
+	u_int64_t link_bytes[LINK_TYPES];
+	u_int64_t protocol_packets[256];
+	u_int64_t protocol_bytes[256];
+	u_int64_t fragments;
+};
+
+} // namespace filter
+
+#endif // TRAFFIC_COUNTERS_H_97E8E1E4_CBDB_11F1_9568_02FC00000001_
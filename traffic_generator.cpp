@@ -0,0 +1,201 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "traffic_generator.h"
+#include "ip_port_connection.h"
+#include "checksum.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+using namespace filter;
+
+static const u_int16_t TCP_SERVICES[] = { 443, 443, 443, 80, 22, 25 };
+static const u_int16_t UDP_SERVICES[] = { 53, 53, 123, 443 };
+
+static u_int16_t ipChecksum(const void * data, unsigned int len, u_int64_t sum = 0) {
+	return ~checksumFold(checksumAdd(data, len, sum));
+}
+
+// Sum of the TCP or UDP pseudo header
+static u_int64_t pseudoHeaderSum(const struct iphdr * ip, unsigned int l4_len) {
+	unsigned char pseudo[12];
+	memcpy(pseudo, &ip->saddr, 4);
+	memcpy(pseudo + 4, &ip->daddr, 4);
+	pseudo[8] = 0;
+	pseudo[9] = ip->protocol;
+	pseudo[10] = l4_len >> 8;
+	pseudo[11] = l4_len & 0xFF;
+	return checksumAdd(pseudo, sizeof(pseudo));
+}
+
+// Traffic Generator
+
+TrafficGenerator::TrafficGenerator(const TrafficProfile & p, unsigned int pool_size)
+		: profile(p), position(0), random_state(p.seed * 0x9E3779B97F4A7C15ull + 1) {
+	if (!profile.flows) profile.flows = 1;
+	if (!pool_size) pool_size = 1;
+
+	// Cumulative popularity of the connections, by rank
+	std::vector<double> popularity(profile.flows);
+	double total = 0;
+	for (unsigned int i = 0; i < profile.flows; i++) {
+		total += profile.zipf_exponent > 0 ? 1.0 / pow(i + 1, profile.zipf_exponent) : 1.0;
+		popularity[i] = total;
+	}
+
+	std::vector<u_int32_t> sent(profile.flows, 0);
+	frames.reserve(pool_size);
+	for (unsigned int i = 0; i < pool_size; i++) {
+		double pick = random() / 4294967296.0 * total;
+		unsigned int flow = std::upper_bound(popularity.begin(), popularity.end(), pick) - popularity.begin();
+		if (flow >= profile.flows) flow = profile.flows - 1;
+		addFrame(flow, sent[flow]++);
+	}
+}
+
+// xorshift64*
+u_int32_t TrafficGenerator::random() {
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return (random_state * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+unsigned int TrafficGenerator::frameSize() {
+	switch (profile.sizes) {
+		case SIZES_UNIFORM:
+			if (profile.max_size > profile.min_size)
+				return profile.min_size + random() % (profile.max_size - profile.min_size + 1);
+			return profile.min_size;
+		case SIZES_IMIX: {
+			unsigned int pick = random() % 12;
+			return pick < 7 ? 64 : pick < 11 ? 570 : 1514;
+		}
+		default:
+			return profile.min_size;
+	}
+}
+
+void TrafficGenerator::addFrame(unsigned int flow, unsigned int sequence) {
+	// Everything about a connection comes from its number
+	u_int32_t h = hashMix32(flow * 0x9E3779B1 + profile.seed);
+	unsigned int mix = h % 100;
+	u_int8_t protocol = mix < profile.tcp_percent ? IPPROTO_TCP
+		: mix < profile.tcp_percent + profile.udp_percent ? IPPROTO_UDP : IPPROTO_ICMP;
+	in_addr_t client = htonl(0x0A000000 | ((flow + 1) & 0x00FFFFFF));
+	in_addr_t server = htonl(0xAC100000 | ((h >> 8) & 0x000FFFFF));
+	u_int16_t client_port = 1024 + (h >> 4) % 64000;
+	u_int16_t server_port = protocol == IPPROTO_TCP ? TCP_SERVICES[(h >> 16) % 6] : UDP_SERVICES[(h >> 16) % 4];
+	bool from_server = sequence % 3 == 1;
+
+	unsigned int l4_len = protocol == IPPROTO_TCP ? sizeof(struct tcphdr)
+		: protocol == IPPROTO_UDP ? sizeof(struct udphdr) : sizeof(struct icmphdr);
+	unsigned int headers = sizeof(struct ethhdr) + sizeof(struct iphdr) + l4_len;
+	u_int8_t tcp_flags = sequence == 0 ? TH_SYN : sequence == 1 ? TH_SYN | TH_ACK : TH_ACK;
+	unsigned int len = frameSize();
+	if (protocol == IPPROTO_TCP && sequence < 2) len = headers;
+	if (len < headers) len = headers;
+	if (len > 1514) len = 1514;
+	if (protocol == IPPROTO_TCP && len > headers) tcp_flags |= TH_PUSH;
+
+	Frame frame;
+	frame.offset = data.size();
+	frame.len = len;
+	frames.push_back(frame);
+	data.resize(data.size() + len);
+	unsigned char * p = &data[frame.offset];
+
+	struct ethhdr * eth = (struct ethhdr *)p;
+	memset(eth, 0, sizeof(*eth));
+	eth->h_source[0] = eth->h_dest[0] = 0x02;
+	eth->h_source[5] = from_server ? 2 : 1;
+	eth->h_dest[5] = from_server ? 1 : 2;
+	eth->h_proto = htons(ETH_P_IP);
+
+	struct iphdr * ip = (struct iphdr *)(p + sizeof(struct ethhdr));
+	memset(ip, 0, sizeof(*ip));
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->tot_len = htons(len - sizeof(struct ethhdr));
+	ip->id = htons(sequence);
+	ip->frag_off = htons(IP_DF);
+	ip->ttl = 64;
+	ip->protocol = protocol;
+	ip->saddr = from_server ? server : client;
+	ip->daddr = from_server ? client : server;
+	ip->check = ipChecksum(ip, sizeof(*ip));
+
+	unsigned char * l4 = (unsigned char *)ip + sizeof(*ip);
+	unsigned int segment_len = len - sizeof(struct ethhdr) - sizeof(struct iphdr);
+	for (unsigned int i = headers; i < len; i += 4) { // Payload
+		u_int32_t word = random();
+		memcpy(p + i, &word, std::min(4u, len - i));
+	}
+	memset(l4, 0, l4_len);
+	if (protocol == IPPROTO_TCP) {
+		struct tcphdr * tcp = (struct tcphdr *)l4;
+		tcp->source = htons(from_server ? server_port : client_port);
+		tcp->dest = htons(from_server ? client_port : server_port);
+		tcp->seq = htonl(h + sequence * 1460);
+		tcp->ack_seq = sequence ? htonl(~h + sequence * 1460) : 0;
+		tcp->doff = sizeof(struct tcphdr) / 4;
+		l4[13] = tcp_flags;
+		tcp->window = htons(65535);
+		tcp->check = ipChecksum(l4, segment_len, pseudoHeaderSum(ip, segment_len));
+	} else if (protocol == IPPROTO_UDP) {
+		struct udphdr * udp = (struct udphdr *)l4;
+		udp->source = htons(from_server ? server_port : client_port);
+		udp->dest = htons(from_server ? client_port : server_port);
+		udp->len = htons(segment_len);
+		udp->check = ipChecksum(l4, segment_len, pseudoHeaderSum(ip, segment_len));
+		if (!udp->check) udp->check = 0xFFFF;
+	} else {
+		struct icmphdr * icmp = (struct icmphdr *)l4;
+		icmp->type = from_server ? ICMP_ECHOREPLY : ICMP_ECHO;
+		icmp->un.echo.id = htons(client_port);
+		icmp->un.echo.sequence = htons(sequence);
+		icmp->checksum = ipChecksum(l4, segment_len);
+	}
+}
+
+void TrafficGenerator::fill(PacketBatch & batch, unsigned int count, const struct timeval & start, unsigned int interval_us) {
+	PacketRecord record;
+	struct timeval ts = start;
+	for (unsigned int i = 0; i < count && !batch.full(); i++) {
+		next(record, ts);
+		batch.addRef(record.ts, record.data, record.caplen, record.len);
+		ts.tv_usec += interval_us;
+		while (ts.tv_usec >= 1000000) {
+			ts.tv_usec -= 1000000;
+			ts.tv_sec++;
+		}
+	}
+}
@@ -0,0 +1,106 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef TRAFFIC_GENERATOR_H_4D15F662_CBDF_11F1_B16F_02FC00000001_
+#define TRAFFIC_GENERATOR_H_4D15F662_CBDF_11F1_B16F_02FC00000001_
+
+#include "packet_batch.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <vector>
+
+namespace filter {
+
+// Packet sizes of a profile (Ethernet frames, without the FCS)
+enum {
+	SIZES_FIXED,    // All min_size bytes
+	SIZES_UNIFORM,  // Between min_size and max_size
+	SIZES_IMIX,     // Simple IMIX: 64, 570 and 1514 bytes in a 7:4:1 ratio
+};
+
+struct TrafficProfile {
+	TrafficProfile() : flows(10000), zipf_exponent(1.0), sizes(SIZES_IMIX), min_size(64), max_size(1514),
+			tcp_percent(80), udp_percent(18), seed(1) { }
+
+	unsigned int flows;        // Distinct connections
+	double zipf_exponent;      // Popularity of the connections by rank, 0 for uniform
+	int sizes;                 // SIZES_*
+	unsigned int min_size;
+	unsigned int max_size;
+	unsigned int tcp_percent;  // Of the connections; ICMP for the rest
+	unsigned int udp_percent;
+	u_int32_t seed;
+};
+
+// Synthesises Ethernet/IPv4 frames following a profile, with valid
+// checksums, for benchmarks and capacity tests that don't need a network
+// device. The frames are generated once into a pool that is then replayed
+// in a loop, so handing out a packet costs next to nothing and doesn't skew
+// the measurements of the code it drives. The pool should be much larger
+// than the number of popular connections.
+//
+// Connections go from 10.0.0.0/8 clients to 172.16.0.0/12 servers, on usual
+// service ports. The first packet of a TCP connection is a SYN, and one in
+// three packets goes from the server back to the client.
+
+class TrafficGenerator {
+public:
+	TrafficGenerator(const TrafficProfile & profile, unsigned int pool_size = 65536);
+
+	// Next packet of the pool, with the given time
+	inline void next(PacketRecord & record, const struct timeval & ts) {
+		const Frame & frame = frames[position];
+		if (++position == frames.size()) position = 0;
+		record.data = &data[frame.offset];
+		record.caplen = record.len = frame.len;
+		record.ts = ts;
+	}
+
+	// Adds count packets to the batch by reference, interval_us apart from start
+	void fill(PacketBatch & batch, unsigned int count, const struct timeval & start, unsigned int interval_us);
+
+	inline unsigned int getPoolSize() const { return frames.size(); }
+	// Bytes of the frames in the pool
+	inline size_t getPoolBytes() const { return data.size(); }
+
+private:
+	struct Frame {
+		size_t offset;
+		unsigned int len;
+	};
+
+	TrafficProfile profile;
+	std::vector<unsigned char> data;
+	std::vector<Frame> frames;
+	size_t position;
+	u_int64_t random_state;
+
+	u_int32_t random();
+	unsigned int frameSize();
+	void addFrame(unsigned int flow, unsigned int sequence);
+};
+
+} // namespace filter
+
+#endif // TRAFFIC_GENERATOR_H_4D15F662_CBDF_11F1_B16F_02FC00000001_
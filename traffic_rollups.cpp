@@ -0,0 +1,255 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "traffic_rollups.h"
+#include "ip_port_connection.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+
+using namespace filter;
+
+static const unsigned int TIER_SECONDS[TrafficRollups::TIERS] = { 1, 10, 60 };
+
+unsigned int TrafficRollups::getTierSeconds(unsigned int tier) {
+	return tier < TIERS ? TIER_SECONDS[tier] : 0;
+}
+
+TrafficRollups::TrafficRollups(unsigned int size, unsigned int h) : history(h < 2 ? 2 : h) {
+	table_size = 16;
+	while (table_size < size && table_size < 0x10000000u) table_size <<= 1;
+
+	size_t windows = (size_t)TIERS * history;
+	block = (RollupCounter *)calloc(windows * 2 * table_size, sizeof(RollupCounter));
+	if (!block) abort();
+	memory_size = windows * (2 * table_size * sizeof(RollupCounter) + sizeof(Window));
+
+	RollupCounter * tables = block;
+	for (unsigned int t = 0; t < TIERS; t++) {
+		Tier & tier = tiers[t];
+		tier.seconds = TIER_SECONDS[t];
+		tier.windows = new Window[history];
+		tier.open = NULL;
+		tier.latest = 0;
+		tier.ended = false;
+		for (unsigned int i = 0; i < history; i++) {
+			Window & window = tier.windows[i];
+			memset(&window, 0, sizeof(window));
+			window.hosts = tables;     tables += table_size;
+			window.ports = tables;     tables += table_size;
+		}
+	}
+}
+
+TrafficRollups::~TrafficRollups() {
+	for (unsigned int t = 0; t < TIERS; t++)
+		delete[] tiers[t].windows;
+	free(block);
+}
+
+// Writer
+
+void TrafficRollups::openWindow(unsigned int t, u_int32_t start) {
+	Tier & tier = tiers[t];
+	Window & window = tier.windows[(start / tier.seconds) % history];
+	__atomic_store_n(&window.sequence, window.sequence | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	window.start = start;
+	window.packets = window.bytes = 0;
+	window.host_overflow_packets = window.host_overflow_bytes = 0;
+	window.port_overflow_packets = window.port_overflow_bytes = 0;
+	if (window.host_count) memset(window.hosts, 0, table_size * sizeof(RollupCounter));
+	if (window.port_count) memset(window.ports, 0, table_size * sizeof(RollupCounter));
+	window.host_count = window.port_count = 0;
+	tier.open = &window;
+}
+
+// The window can be read from now on. Its counters are added to the open
+// window of the next tier, which ends too if this was its last part.
+void TrafficRollups::closeWindow(unsigned int t) {
+	Tier & tier = tiers[t];
+	Window & window = *tier.open;
+	tier.open = NULL;
+	__atomic_store_n(&window.sequence, window.sequence + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&tier.latest, window.start, __ATOMIC_RELEASE);
+	__atomic_store_n(&tier.ended, true, __ATOMIC_RELEASE);
+
+	if (t + 1 >= TIERS) return;
+	Tier & up = tiers[t + 1];
+	u_int32_t start = window.start - window.start % up.seconds;
+	if (up.open && up.open->start != start) closeWindow(t + 1);
+	if (!up.open) openWindow(t + 1, start);
+	merge(*up.open, window);
+	if (window.start + tier.seconds >= start + up.seconds) closeWindow(t + 1);
+}
+
+bool TrafficRollups::add(RollupCounter * table, u_int32_t & count, u_int32_t key, u_int32_t packets, u_int64_t bytes) {
+	u_int32_t mask = table_size - 1;
+	for (u_int32_t i = hashMix32(key) & mask; ; i = (i + 1) & mask) {
+		RollupCounter & entry = table[i];
+		if (entry.packets && entry.key == key) {
+			entry.packets += packets;
+			entry.bytes += bytes;
+			return true;
+		}
+		if (!entry.packets) {
+			if (count >= table_size - table_size / 4) return false;
+			count++;
+			entry.key = key;
+			entry.packets = packets;
+			entry.bytes = bytes;
+			return true;
+		}
+	}
+}
+
+void TrafficRollups::merge(Window & to, const Window & from) {
+	to.packets += from.packets;
+	to.bytes += from.bytes;
+	to.host_overflow_packets += from.host_overflow_packets;
+	to.host_overflow_bytes += from.host_overflow_bytes;
+	to.port_overflow_packets += from.port_overflow_packets;
+	to.port_overflow_bytes += from.port_overflow_bytes;
+	for (unsigned int i = 0; i < table_size; i++) {
+		const RollupCounter & host = from.hosts[i];
+		if (host.packets && !add(to.hosts, to.host_count, host.key, host.packets, host.bytes)) {
+			to.host_overflow_packets += host.packets;
+			to.host_overflow_bytes += host.bytes;
+		}
+		const RollupCounter & port = from.ports[i];
+		if (port.packets && !add(to.ports, to.port_count, port.key, port.packets, port.bytes)) {
+			to.port_overflow_packets += port.packets;
+			to.port_overflow_bytes += port.bytes;
+		}
+	}
+}
+
+void TrafficRollups::advance(u_int32_t sec) {
+	Tier & first = tiers[TIER_1S];
+	if (first.open && sec <= first.open->start) return;
+	if (first.open) closeWindow(TIER_1S);
+	for (unsigned int t = TIER_1S + 1; t < TIERS; t++) {
+		if (tiers[t].open && sec >= tiers[t].open->start + tiers[t].seconds)
+			closeWindow(t);
+	}
+	openWindow(TIER_1S, sec);
+}
+
+void TrafficRollups::update(const PacketSummary & summary, u_int32_t sec) {
+	if (!(summary.flags & SUMMARY_IP)) return;
+	if (!tiers[TIER_1S].open || sec > tiers[TIER_1S].open->start)
+		advance(sec);
+	// Packets that arrive late (clock going back) count for the open window
+	Window & window = *tiers[TIER_1S].open;
+	u_int32_t bytes = summary.ip_len;
+	window.packets++;
+	window.bytes += bytes;
+	unsigned int hosts_left = 0;
+	if (!add(window.hosts, window.host_count, summary.saddr, 1, bytes)) hosts_left++;
+	if (summary.daddr != summary.saddr && !add(window.hosts, window.host_count, summary.daddr, 1, bytes)) hosts_left++;
+	window.host_overflow_packets += hosts_left;
+	window.host_overflow_bytes += (u_int64_t)hosts_left * bytes;
+	if (summary.flags & SUMMARY_PORTS) {
+		u_int32_t protocol = (u_int32_t)summary.protocol << 16;
+		unsigned int ports_left = 0;
+		if (!add(window.ports, window.port_count, protocol | summary.sport, 1, bytes)) ports_left++;
+		if (summary.dport != summary.sport && !add(window.ports, window.port_count, protocol | summary.dport, 1, bytes)) ports_left++;
+		window.port_overflow_packets += ports_left;
+		window.port_overflow_bytes += (u_int64_t)ports_left * bytes;
+	}
+}
+
+// Readers
+
+static void copyTable(const RollupCounter * table, unsigned int size, std::vector<RollupCounter> & entries) {
+	entries.clear();
+	for (unsigned int i = 0; i < size; i++) {
+		if (table[i].packets) entries.push_back(table[i]);
+	}
+}
+
+bool TrafficRollups::getWindow(unsigned int t, u_int32_t time, RollupSnapshot & snapshot) const {
+	if (t >= TIERS) return false;
+	const Tier & tier = tiers[t];
+	u_int32_t start = time - time % tier.seconds;
+	const Window & window = tier.windows[(start / tier.seconds) % history];
+
+	u_int32_t sequence = __atomic_load_n(&window.sequence, __ATOMIC_ACQUIRE);
+	if (sequence == 0 || (sequence & 1)) return false;
+	snapshot.start = window.start;
+	snapshot.seconds = tier.seconds;
+	snapshot.packets = window.packets;
+	snapshot.bytes = window.bytes;
+	snapshot.host_overflow_packets = window.host_overflow_packets;
+	snapshot.host_overflow_bytes = window.host_overflow_bytes;
+	snapshot.port_overflow_packets = window.port_overflow_packets;
+	snapshot.port_overflow_bytes = window.port_overflow_bytes;
+	copyTable(window.hosts, table_size, snapshot.hosts);
+	copyTable(window.ports, table_size, snapshot.ports);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&window.sequence, __ATOMIC_RELAXED) != sequence) return false;
+	return snapshot.start == start;
+}
+
+bool TrafficRollups::getLatestWindow(unsigned int t, RollupSnapshot & snapshot) const {
+	if (t >= TIERS || !__atomic_load_n(&tiers[t].ended, __ATOMIC_ACQUIRE)) return false;
+	return getWindow(t, __atomic_load_n(&tiers[t].latest, __ATOMIC_ACQUIRE), snapshot);
+}
+
+static bool compareBytes(const RollupCounter & a, const RollupCounter & b) {
+	return a.bytes > b.bytes;
+}
+
+static void printTop(std::ostream& out, std::vector<RollupCounter> entries, bool hosts, unsigned int max_entries) {
+	std::sort(entries.begin(), entries.end(), compareBytes);
+	if (entries.size() > max_entries) entries.resize(max_entries);
+	for (size_t i = 0; i < entries.size(); i++) {
+		const RollupCounter & entry = entries[i];
+		out << "   |-";
+		if (hosts) {
+			struct in_addr addr;
+			addr.s_addr = entry.key;
+			out << "Host " << inet_ntoa(addr);
+		} else {
+			unsigned int protocol = entry.key >> 16;
+			out << "Port " << (protocol == IPPROTO_TCP ? "tcp/" : protocol == IPPROTO_UDP ? "udp/" : "") << (entry.key & 0xFFFF);
+		}
+		out << " : " << entry.packets << " packets, " << entry.bytes << " bytes" << std::endl;
+	}
+}
+
+void TrafficRollups::print(const RollupSnapshot & snapshot, std::ostream& out, unsigned int max_entries) {
+	out << "Traffic from " << snapshot.start << " for " << snapshot.seconds << "s : "
+		<< snapshot.packets << " packets, " << snapshot.bytes << " bytes" << std::endl;
+	printTop(out, snapshot.hosts, true, max_entries);
+	printTop(out, snapshot.ports, false, max_entries);
+	if (snapshot.host_overflow_packets)
+		out << "   |-Other hosts (table full) : " << snapshot.host_overflow_packets << " packets, "
+			<< snapshot.host_overflow_bytes << " bytes" << std::endl;
+	if (snapshot.port_overflow_packets)
+		out << "   |-Other ports (table full) : " << snapshot.port_overflow_packets << " packets, "
+			<< snapshot.port_overflow_bytes << " bytes" << std::endl;
+}
@@ -0,0 +1,146 @@
+// Copyright (c) 2012, Miriam Ruiz <miriam@debian.org>. All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER "AS IS", AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+// NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef TRAFFIC_ROLLUPS_H_87BDD4A4_CBDC_11F1_A35C_02FC00000001_
+#define TRAFFIC_ROLLUPS_H_87BDD4A4_CBDC_11F1_A35C_02FC00000001_
+
+#include "packet_summary.h"
+
+#include <sys/types.h>
+#include <iostream>
+#include <vector>
+
+namespace filter {
+
+// Packets and bytes per host and per port, in windows of 1 second that are
+// rolled up into windows of 10 and 60 seconds as they end. A packet counts
+// for both of its addresses, and for both of its ports (once if they are the
+// same).
+//
+// All the windows are allocated up front: every tier keeps the last history
+// windows, each with a fixed size open addressing table for the hosts and
+// another one for the ports. Once a table is 3/4 full, new hosts or ports
+// are only counted in the overflow of the table, so the memory doesn't
+// depend on the traffic. A packet counts for each of its addresses and each
+// of its ports, so the entries of a table plus its overflow always add up to
+// the same thing, whether the window was filled by packets or by merging the
+// windows of the tier below.
+//
+// Only the capture thread writes, and it never waits for the readers. A
+// window can be read from any thread once it has ended: every window has a
+// sequence number that is odd while it's open, so a reader copying a window
+// that was reused in the meantime notices it (seqlock).
+
+struct RollupCounter {
+	u_int32_t key;            // Address (network byte order), or protocol << 16 | port
+	u_int32_t packets;
+	u_int64_t bytes;
+};
+
+// Copy of a window, for the readers
+struct RollupSnapshot {
+	u_int32_t start;          // Seconds since the epoch
+	u_int32_t seconds;        // Length of the window
+	u_int64_t packets;
+	u_int64_t bytes;
+	u_int64_t host_overflow_packets;  // For the addresses left out of hosts, the table was full
+	u_int64_t host_overflow_bytes;
+	u_int64_t port_overflow_packets;  // For the ports left out of ports
+	u_int64_t port_overflow_bytes;
+	std::vector<RollupCounter> hosts;
+	std::vector<RollupCounter> ports;
+};
+
+class TrafficRollups {
+public:
+	enum {
+		TIER_1S,
+		TIER_10S,
+		TIER_60S,
+		TIERS
+	};
+
+	// table_size entries per table (rounded up to a power of two), and
+	// history windows kept for each tier (at least 2)
+	TrafficRollups(unsigned int table_size = 1024, unsigned int history = 60);
+	~TrafficRollups();
+
+	// Capture thread only. sec is the capture time of the packet.
+	void update(const PacketSummary & summary, u_int32_t sec);
+	// End the windows that are over by sec, also when there is no traffic
+	void advance(u_int32_t sec);
+
+	// Copy the ended window of the tier that contains time. Returns false if
+	// there is none (no traffic then, or too old), or if it was being reused.
+	bool getWindow(unsigned int tier, u_int32_t time, RollupSnapshot & snapshot) const;
+	// The last window of the tier that ended
+	bool getLatestWindow(unsigned int tier, RollupSnapshot & snapshot) const;
+
+	static unsigned int getTierSeconds(unsigned int tier);
+	inline size_t getMemorySize() const { return memory_size; }
+
+	// Totals, then the hosts and the ports by decreasing bytes
+	static void print(const RollupSnapshot & snapshot, std::ostream& out, unsigned int max_entries = 10);
+
+private:
+	struct Window {
+		u_int32_t sequence;   // Odd while open, 0 if never used
+		u_int32_t start;
+		u_int64_t packets;
+		u_int64_t bytes;
+		u_int64_t host_overflow_packets;
+		u_int64_t host_overflow_bytes;
+		u_int64_t port_overflow_packets;
+		u_int64_t port_overflow_bytes;
+		u_int32_t host_count;
+		u_int32_t port_count;
+		RollupCounter * hosts;    // Empty entries have no packets
+		RollupCounter * ports;
+	};
+	struct Tier {
+		unsigned int seconds;
+		Window * windows;
+		Window * open;        // NULL if none
+		u_int32_t latest;     // Start of the last window that ended
+		bool ended;           // There is one
+	};
+
+	void openWindow(unsigned int tier, u_int32_t start);
+	void closeWindow(unsigned int tier);
+	bool add(RollupCounter * table, u_int32_t & count, u_int32_t key, u_int32_t packets, u_int64_t bytes);
+	void merge(Window & to, const Window & from);
+
+	unsigned int table_size;
+	unsigned int history;
+	Tier tiers[TIERS];
+	RollupCounter * block;
+	size_t memory_size;
+
+	// Can't be copied
+	TrafficRollups(const TrafficRollups &other);
+	TrafficRollups &operator=(const TrafficRollups &other);
+};
+
+} // namespace filter
+
+#endif // TRAFFIC_ROLLUPS_H_87BDD4A4_CBDC_11F1_A35C_02FC00000001_